@@ -0,0 +1,143 @@
+-- Helper module for running benchmarks and reporting results
+--
+-- Each result is written to stdout as a single line containing a JSON object
+-- (JSON Lines format). By default, time is measured as processor time
+-- (os.clock) of the benchmarking process, which includes time spent in the
+-- kernel on behalf of the process but excludes time spent blocked. Benchmarks
+-- that involve I/O should call bench.use_wall_clock() to measure elapsed time
+-- on the monotonic clock instead.
+--
+-- Environment variables:
+--   BENCH_SAMPLES  number of measured batches per benchmark (default 30)
+--   BENCH_SCALE    factor applied to all batch sizes (default 1)
+
+local lkq = require "neumond.lkq"
+
+local clock = os.clock
+local clock_name = "cpu"
+
+local _M = {}
+
+_M.samples = tonumber(os.getenv("BENCH_SAMPLES")) or 30
+_M.scale = tonumber(os.getenv("BENCH_SCALE")) or 1
+
+-- bench.use_wall_clock() makes subsequent benchmarks measure elapsed time on
+-- the monotonic clock (which includes time spent waiting for I/O or for other
+-- processes):
+function _M.use_wall_clock()
+  clock = lkq.monotime
+  clock_name = "wall"
+end
+
+-- bench.now() returns the current time for measuring latencies of individual
+-- operations, which always uses the monotonic clock (as the resolution of
+-- os.clock is too coarse for single operations):
+_M.now = lkq.monotime
+
+-- Percentiles reported for latencies of individual operations:
+local percentiles = { 50, 90, 99 }
+
+-- Returns the nearest-rank percentile of a sorted sequence:
+local function percentile(sorted, p)
+  local idx = math.ceil(#sorted * p / 100)
+  if idx < 1 then idx = 1 end
+  return sorted[idx]
+end
+
+-- Returns the median of a sorted sequence:
+local function median(sorted)
+  local n = #sorted
+  if n % 2 == 1 then
+    return sorted[(n + 1) // 2]
+  end
+  return (sorted[n // 2] + sorted[n // 2 + 1]) / 2
+end
+
+-- Formats a number for JSON output:
+local function number(x)
+  if x ~= x or x == math.huge or x == -math.huge then
+    return "null"
+  end
+  return string.format("%.6g", x)
+end
+
+-- Formats a string for JSON output:
+local function quote(s)
+  return '"' .. string.gsub(s, '[%c"\\]', function(c)
+    return string.format("\\u%04x", string.byte(c))
+  end) .. '"'
+end
+
+-- bench.run(name, batch_size, func, bytes_per_op) calls func(batch_size,
+-- record) once for warming up and then bench.samples times while measuring
+-- the time. The function func(n, record) must perform n operations. Besides
+-- the overall throughput, the minimum, median, and maximum of the average time
+-- per operation within a batch are reported. Benchmarks that can time
+-- individual operations call record(t0) after each operation, where t0 is the
+-- value of bench.now() when the operation was started; latency percentiles
+-- are then reported as well (otherwise the field per_op_latency is false). If
+-- bytes_per_op is given, a throughput in bytes per second is reported as well.
+function _M.run(name, batch_size, func, bytes_per_op)
+  batch_size = math.max(1, math.floor(batch_size * _M.scale))
+  func(batch_size, function() end)
+  local latencies = {}
+  local latency_count = 0
+  local function record(t0)
+    latency_count = latency_count + 1
+    latencies[latency_count] = lkq.monotime() - t0
+  end
+  local averages = {}
+  local total = 0
+  for i = 1, _M.samples do
+    local t0 = clock()
+    func(batch_size, record)
+    local t = clock() - t0
+    total = total + t
+    averages[i] = t / batch_size
+  end
+  table.sort(averages)
+  local ops = batch_size * _M.samples
+  local fields = {
+    '"benchmark":' .. quote(name),
+    '"clock":' .. quote(clock_name),
+    '"ops":' .. number(ops),
+    '"seconds":' .. number(total),
+    '"ops_per_sec":' .. number(ops / total),
+  }
+  if bytes_per_op then
+    fields[#fields+1] = '"bytes_per_sec":' .. number(ops * bytes_per_op / total)
+  end
+  fields[#fields+1] = '"batch_avg_min_ns":' .. number(averages[1] * 1e9)
+  fields[#fields+1] =
+    '"batch_avg_median_ns":' .. number(median(averages) * 1e9)
+  fields[#fields+1] =
+    '"batch_avg_max_ns":' .. number(averages[#averages] * 1e9)
+  if latency_count > 0 then
+    table.sort(latencies)
+    fields[#fields+1] = '"per_op_latency":true'
+    for _, p in ipairs(percentiles) do
+      fields[#fields+1] =
+        '"latency_p' .. p .. '_ns":' .. number(percentile(latencies, p) * 1e9)
+    end
+    fields[#fields+1] =
+      '"latency_max_ns":' .. number(latencies[latency_count] * 1e9)
+  else
+    fields[#fields+1] = '"per_op_latency":false'
+  end
+  io.stdout:write("{", table.concat(fields, ","), "}\n")
+  io.stdout:flush()
+end
+
+-- Returns a random path for a temporary local socket and a to-be-closed
+-- guard that removes the socket file:
+function _M.tmp_socket_path()
+  local function r8()
+    return math.random(10000000,99999999)
+  end
+  local path = "/tmp/neumond-bench-" .. r8() .. "-" .. r8() .. ".sock"
+  return path, setmetatable({}, {
+    __close = function() os.remove(path) end,
+  })
+end
+
+return _M
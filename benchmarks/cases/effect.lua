@@ -0,0 +1,65 @@
+-- Benchmarks for effect handling at several nesting depths
+
+local bench = require "bench"
+local effect = require "neumond.effect"
+
+local eff = effect.new("eff")
+
+local function noop()
+end
+
+-- Handler that resumes the continuation with its arguments (tail call):
+local function resume_handler(resume, ...)
+  return resume(...)
+end
+
+-- Direct handler (the continuation is implicitly resumed):
+local direct_handler = effect.direct(function(...)
+  return ...
+end)
+
+-- Calls func within depth nested effect handlers, where only the outermost
+-- handler handles eff (using given handler function) and all other handlers
+-- handle unrelated effects:
+local function nested(depth, handler, func, ...)
+  if depth <= 1 then
+    return effect.handle({ [eff] = handler }, func, ...)
+  end
+  return effect.handle(
+    { [effect.new("unrelated")] = noop },
+    nested, depth - 1, handler, func, ...
+  )
+end
+
+local function perform_loop(n)
+  for i = 1, n do
+    eff(i)
+  end
+end
+
+for _, depth in ipairs{1, 4, 16, 64} do
+  bench.run("effect.perform resume depth=" .. depth, 20000, function(n)
+    nested(depth, resume_handler, perform_loop, n)
+  end)
+  bench.run("effect.perform direct depth=" .. depth, 20000, function(n)
+    nested(depth, direct_handler, perform_loop, n)
+  end)
+end
+
+local handlers = { [eff] = resume_handler }
+
+for _, depth in ipairs{1, 4, 16} do
+  bench.run("effect.handle depth=" .. depth, 5000, function(n)
+    nested(depth, resume_handler, function()
+      for i = 1, n do
+        effect.handle(handlers, noop)
+      end
+    end)
+  end)
+end
+
+bench.run("effect.default_handler", 20000, function(n)
+  effect.default_handlers[eff] = noop
+  perform_loop(n)
+  effect.default_handlers[eff] = nil
+end)
@@ -0,0 +1,54 @@
+-- Benchmarks for spawning fibers and switching between fibers
+
+local bench = require "bench"
+local fiber = require "neumond.fiber"
+
+local function noop()
+end
+
+bench.run("fiber.spawn", 5000, function(n)
+  fiber.scope(function()
+    local last
+    for i = 1, n do
+      last = fiber.spawn(noop)
+    end
+    -- fibers are run in FIFO order, thus all fibers have run afterwards:
+    last:await()
+  end)
+end)
+
+bench.run("fiber.yield context switch", 20000, function(n)
+  fiber.scope(function()
+    -- two fibers yielding to each other (n context switches in total):
+    local half = n // 2
+    local function yielder()
+      for i = 1, half do
+        fiber.yield()
+      end
+    end
+    local a = fiber.spawn(yielder)
+    local b = fiber.spawn(yielder)
+    a:await()
+    b:await()
+  end)
+end)
+
+bench.run("fiber.sleep/wake handoff", 10000, function(n, record)
+  fiber.scope(function()
+    -- latency is the time for a round trip (wait until woken, wake partner):
+    local main = fiber.current()
+    local partner = fiber.spawn(function()
+      for i = 1, n do
+        main:wake()
+        fiber.sleep()
+      end
+    end)
+    for i = 1, n do
+      local t0 = bench.now()
+      fiber.sleep()
+      partner:wake()
+      record(t0)
+    end
+    partner:await()
+  end)
+end)
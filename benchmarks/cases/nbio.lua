@@ -0,0 +1,194 @@
+-- Benchmarks for buffered reading and writing through a pair of connected
+-- local sockets, for sending files, and for UDP datagrams
+
+local bench = require "bench"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+-- Time spent waiting for the kernel or the peer is part of the benchmark:
+bench.use_wall_clock()
+
+local path, path_guard <close> = bench.tmp_socket_path()
+local file_path = path .. ".file"
+local file_guard <close> = setmetatable({}, {
+  __close = function() os.remove(file_path) end,
+})
+
+local function main()
+  local listener <close> = assert(eio.locallisten(path))
+  local connector = fiber.spawn(function()
+    return assert(eio.localconnect(path))
+  end)
+  local reader <close> = assert(listener:accept())
+  local writer <close> = connector:await()
+
+  for _, chunk_size in ipairs{64, 4096, 65536} do
+    local chunk = string.rep("x", chunk_size)
+    bench.run(
+      "nbio write/read chunk=" .. chunk_size,
+      math.max(16, 4 * 1024 * 1024 // chunk_size),
+      function(n)
+        local producer = fiber.spawn(function()
+          for i = 1, n do
+            assert(writer:write(chunk))
+          end
+          assert(writer:flush())
+        end)
+        for i = 1, n do
+          assert(#reader:read(chunk_size) == chunk_size)
+        end
+        producer:await()
+      end,
+      chunk_size
+    )
+  end
+
+  local header = string.rep("h", 200)
+  local body = string.rep("b", 65536)
+  local response_size = #header + #body
+  bench.run("nbio write header+body=65536", 64, function(n)
+    local producer = fiber.spawn(function()
+      for i = 1, n do
+        assert(writer:write(header, body))
+      end
+      assert(writer:flush())
+    end)
+    for i = 1, n do
+      assert(#reader:read(response_size) == response_size)
+    end
+    producer:await()
+  end, response_size)
+
+  local line = string.rep("x", 79) .. "\n"
+  bench.run("nbio read line=80", 20000, function(n)
+    local producer = fiber.spawn(function()
+      for i = 1, n do
+        assert(writer:write(line))
+      end
+      assert(writer:flush())
+    end)
+    for i = 1, n do
+      assert(reader:read(1024, "\n") == line)
+    end
+    producer:await()
+  end, #line)
+
+  local buf = eio.buffer()
+  bench.run("nbio read_into line=80", 20000, function(n)
+    local producer = fiber.spawn(function()
+      for i = 1, n do
+        assert(writer:write(line))
+      end
+      assert(writer:flush())
+    end)
+    local lines = 0
+    while lines < n do
+      local pos = buf:find("\n")
+      if pos then
+        buf:consume(pos)
+        lines = lines + 1
+      else
+        assert(reader:read_into(buf, 65536) > 0)
+      end
+    end
+    producer:await()
+  end, #line)
+
+  local file_size = 1024 * 1024
+  do
+    local file <close> = assert(eio.open(file_path, "w,create,truncate"))
+    assert(file:flush(string.rep("x", file_size)))
+  end
+  local file <close> = assert(eio.open(file_path))
+  local function drain(n)
+    local remaining = n * file_size
+    while remaining > 0 do
+      remaining = remaining - #reader:read_unbuffered(65536)
+    end
+  end
+  bench.run("nbio file via read/write size=1MiB", 8, function(n)
+    local producer = fiber.spawn(function()
+      for i = 1, n do
+        local file <close> = assert(eio.open(file_path))
+        while true do
+          local chunk = assert(file:read_unbuffered(65536))
+          if chunk == "" then
+            break
+          end
+          assert(writer:write(chunk))
+        end
+      end
+      assert(writer:flush())
+    end)
+    drain(n)
+    producer:await()
+  end, file_size)
+  bench.run("nbio sendfile size=1MiB", 8, function(n)
+    local producer = fiber.spawn(function()
+      for i = 1, n do
+        assert(writer:sendfile(file) == file_size)
+      end
+    end)
+    drain(n)
+    producer:await()
+  end, file_size)
+  bench.run("nbio pump size=1MiB", 8, function(n)
+    local producer = fiber.spawn(function()
+      for i = 1, n do
+        local file <close> = assert(eio.open(file_path))
+        assert(eio.pump(file, writer) == file_size)
+      end
+    end)
+    drain(n)
+    producer:await()
+  end, file_size)
+
+  -- Datagrams are sent and received in rounds of 32 to not exceed the
+  -- receive buffer of the socket:
+  local port = math.random(1024, 65535)
+  local udp_server <close> = assert(eio.udpbind("127.0.0.1", port))
+  local udp_client <close> = assert(eio.udpconnect("127.0.0.1", port))
+  local datagram = string.rep("d", 100)
+  local datagrams = {}
+  for i = 1, 32 do
+    datagrams[i] = datagram
+  end
+  bench.run("nbio udp send/recv size=100", 32 * 200, function(n)
+    for i = 1, n // 32 do
+      for j = 1, 32 do
+        assert(udp_client:send(datagram))
+      end
+      for j = 1, 32 do
+        assert(udp_server:recv())
+      end
+    end
+  end, #datagram)
+  bench.run("nbio udp send_many/recv_many size=100", 32 * 200, function(n)
+    for i = 1, n // 32 do
+      assert(udp_client:send_many(datagrams))
+      local received = 0
+      while received < 32 do
+        received = received + #assert(udp_server:recv_many(32))
+      end
+    end
+  end, #datagram)
+
+  -- Starting a process should not get slower when the heap of the parent is
+  -- large (which is the case with fork):
+  local function execute(n)
+    for i = 1, n do
+      local proc <close> = assert(eio.execute("true"))
+      proc:wait()
+    end
+  end
+  bench.run("nbio execute", 20, execute)
+  local heap = {}
+  for i = 1, 256 do
+    heap[i] = string.rep(string.char(i % 256), 1024 * 1024)
+  end
+  bench.run("nbio execute heap=256MiB", 20, execute)
+  heap = nil
+end
+
+runtime(main)
@@ -0,0 +1,84 @@
+-- Benchmark for SCGI requests per second over a local socket
+
+local bench = require "bench"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+local scgi = require "neumond.scgi"
+
+-- Time spent waiting for the kernel or the peer is part of the benchmark:
+bench.use_wall_clock()
+
+local path, path_guard <close> = bench.tmp_socket_path()
+
+-- Returns an SCGI request with given header fields (in given order):
+local function scgi_request(...)
+  local parts = {}
+  for i = 1, select("#", ...) do
+    parts[i] = select(i, ...) .. "\0"
+  end
+  local header = table.concat(parts)
+  return #header .. ":" .. header .. ","
+end
+
+local request = scgi_request(
+  "CONTENT_LENGTH", "0",
+  "SCGI", "1",
+  "REQUEST_METHOD", "GET",
+  "REQUEST_URI", "/bench?key=value",
+  "QUERY_STRING", "key=value"
+)
+
+local response = "Content-type: text/plain\n\nHello World!\n"
+
+local function request_handler(req)
+  req:write(response)
+end
+
+-- Performs a single request and reads the complete response:
+local function perform_request()
+  local conn <close> = assert(eio.localconnect(path))
+  assert(conn:flush(request))
+  local len = 0
+  while true do
+    local data = assert(conn:read(65536))
+    if data == "" then
+      break
+    end
+    len = len + #data
+  end
+  assert(len == #response)
+end
+
+local function main()
+  -- Server fiber is cleaned up when main function returns:
+  fiber.spawn(scgi.run, path, request_handler)
+  fiber.yield()
+
+  for _, concurrency in ipairs{1, 16} do
+    bench.run(
+      "scgi request concurrency=" .. concurrency, 1000,
+      function(n, record)
+        local clients = {}
+        for i = 1, concurrency do
+          local count = n // concurrency
+          if i <= n % concurrency then
+            count = count + 1
+          end
+          clients[i] = fiber.spawn(function()
+            for j = 1, count do
+              local t0 = bench.now()
+              perform_request()
+              record(t0)
+            end
+          end)
+        end
+        for i = 1, concurrency do
+          clients[i]:await()
+        end
+      end
+    )
+  end
+end
+
+runtime(main)
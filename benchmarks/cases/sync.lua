@@ -0,0 +1,99 @@
+-- Benchmarks for mutexes, queues, and broadcast channels
+
+local bench = require "bench"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+
+local function main()
+
+  bench.run("sync.mutex uncontended", 20000, function(n)
+    local mutex = sync.mutex()
+    for i = 1, n do
+      local guard <close> = mutex()
+    end
+  end)
+
+  bench.run("sync.mutex handoff", 5000, function(n, record)
+    -- two fibers competing for a mutex and yielding while holding it, such
+    -- that each lock operation requires handing over the mutex (latency is
+    -- the time until the lock has been acquired):
+    local mutex = sync.mutex()
+    local function locker()
+      for i = 1, n // 2 do
+        local t0 = bench.now()
+        local guard <close> = mutex()
+        record(t0)
+        fiber.yield()
+      end
+    end
+    local a = fiber.spawn(locker)
+    local b = fiber.spawn(locker)
+    a:await()
+    b:await()
+  end)
+
+  for _, size in ipairs{0, 1, 64} do
+    bench.run("sync.queue handoff size=" .. size, 10000, function(n, record)
+      -- latency is the time from pushing an element until it has been popped
+      -- by the consumer:
+      local queue = sync.queue(size)
+      local consumer = fiber.spawn(function()
+        for i = 1, n do
+          record(queue:pop())
+        end
+      end)
+      for i = 1, n do
+        queue:push(bench.now())
+      end
+      consumer:await()
+    end)
+  end
+
+  bench.run("sync.queue push_many/pop_many size=64", 10000, function(n)
+    local queue = sync.queue(64)
+    local values = {}
+    for i = 1, n do
+      values[i] = i
+    end
+    local consumer = fiber.spawn(function()
+      local count = 0
+      while count < n do
+        count = count + #queue:pop_many()
+      end
+    end)
+    queue:push_many(values)
+    consumer:await()
+  end)
+
+  for _, subscribers in ipairs{10, 1000} do
+    bench.run(
+      "sync.broadcast fan-out subscribers=" .. subscribers, 1000,
+      function(n)
+        -- publishing values in batches that fit into the ring buffer, with
+        -- each subscriber receiving every value:
+        local chan = sync.broadcast(64)
+        local fibers = {}
+        for i = 1, subscribers do
+          local sub = chan:subscribe()
+          fibers[i] = fiber.spawn(function()
+            while sub:recv() do end
+          end)
+        end
+        for i = 1, n do
+          chan:publish(i)
+          if i % 64 == 0 then
+            fiber.yield()
+          end
+        end
+        chan:close()
+        for i = 1, subscribers do
+          fibers[i]:await()
+        end
+      end
+    )
+  end
+
+end
+
+runtime(main)
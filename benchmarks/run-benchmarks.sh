@@ -0,0 +1,20 @@
+#!/bin/sh
+if [ ! -n "$LUA_CMD" ]; then
+  export LUA_CMD=lua
+fi
+if [ $# -eq 0 ]; then
+  echo "Warning: No benchmark specified!" >&2
+fi
+FAILED=0
+for benchmark in "$@"
+do
+  echo "Running $benchmark" >&2
+  $LUA_CMD $benchmark || FAILED=1
+done
+if [ $FAILED -eq 0 ]; then
+  echo "All benchmarks finished." >&2
+  exit 0
+else
+  echo "Some benchmarks failed." >&2
+  exit 1
+fi
@@ -5,6 +5,9 @@
 local assert       = assert
 local error        = error
 local getmetatable = getmetatable
+local next         = next
+local pairs        = pairs
+local rawequal     = rawequal
 local select       = select
 local setmetatable = setmetatable
 local tostring     = tostring
@@ -16,9 +19,21 @@ local coroutine_resume      = coroutine.resume
 local coroutine_running     = coroutine.running
 local coroutine_status      = coroutine.status
 local coroutine_yield       = coroutine.yield
+local debug_getinfo   = debug.getinfo
 local debug_traceback = debug.traceback
+local package_loaded = package.loaded
+local string_sub   = string.sub
 local table_concat = table.concat
 
+-- Optional C implementation of performing effects and resuming actions:
+local core
+do
+  local success, result = pcall(require, "neumond.effect_core")
+  if success then
+    core = result
+  end
+end
+
 -- Disallow global variables in the implementation of this module:
 _ENV = setmetatable({}, {
   __index    = function() error("cannot get global variable", 2) end,
@@ -42,8 +57,9 @@ end
 -- Default handlers, where each key is an effect and each value is a function
 -- that does not get a continuation handle but simply returns the arguments for
 -- resuming:
+-- (the public table effect.default_handlers is a proxy defined further below,
+-- which invalidates dispatch caches on every assignment):
 local default_handlers = setmetatable({}, {__mode = "k"})
-_M.default_handlers = default_handlers
 
 -- Internally used marker, which indicates that a value passed from the effect
 -- handler to the continuation should be called within the inner context, i.e.
@@ -67,8 +83,95 @@ local function check_call(...)
   return ...
 end
 
+-- Ephemeron mapping each action's coroutine to the handlers table that has
+-- been passed to the handle function:
+local thread_handlers = setmetatable({}, weak_mt)
+
+-- Ephemeron mapping each action's coroutine to the coroutine which resumed it
+-- most recently (i.e. where the handlers are running), or to true if it was
+-- resumed by the main coroutine:
+local thread_parents = setmetatable({}, weak_mt)
+
+-- Ephemeron mapping handlers created with the direct function to the function
+-- that is to be called in the context of the performer:
+local direct_funcs = setmetatable({}, weak_mt)
+
+-- Ephemeron mapping coroutines to dispatch caches, which map effects to the
+-- result of the resolve function below:
+local dispatch_caches = setmetatable({}, weak_mt)
+
+-- Generation of dispatch caches, which is increased whenever an action is
+-- resumed in a different coroutine than before or when a default handler is
+-- set (which invalidates all caches):
+local dispatch_generation = 0
+
+-- Key used to store the generation in a dispatch cache:
+local generation_key = setmetatable({}, {
+  __tostring = function() return "generation key" end,
+})
+
+-- Effect used to generate tracebacks of a continuation (it must be passed
+-- through all nested actions, thus it always yields):
+local traceback = setmetatable({}, {
+  __call = function(self, ...)
+    return coroutine_yield(self, ...)
+  end,
+  __tostring = function() return "neumond.effect.traceback effect" end,
+})
+
+-- resolve(thread, eff) finds the first handler for effect eff by walking up
+-- the coroutines of nested actions (starting with the given thread) and
+-- returns the function to be called in the context of the performer (direct
+-- handler or default handler), false if yielding is necessary, or nil if there
+-- is no handler at all:
+local function resolve(thread, eff)
+  while true do
+    local handlers = thread_handlers[thread]
+    if not handlers then
+      -- Check if main coroutine has been reached:
+      if thread == true then
+        -- Main coroutine has been reached.
+        -- Return default handler, if exists:
+        return default_handlers[eff]
+      end
+      -- Thread is not known (e.g. some other coroutine), thus yield:
+      return false
+    end
+    local handler = handlers[eff]
+    if handler then
+      -- Handler has been found.
+      -- Return function of direct handler or false (yield) otherwise:
+      return direct_funcs[handler] or false
+    end
+    thread = thread_parents[thread]
+  end
+end
+
 -- Performs an effect:
 local function perform(...)
+  -- Check if effect can be handled by calling a function in the current
+  -- context (using a cache for constant-time dispatch):
+  local thread, is_main = coroutine_running()
+  if not is_main and ... ~= nil then
+    local cache = dispatch_caches[thread]
+    if not cache or cache[generation_key] ~= dispatch_generation then
+      cache = { [generation_key] = dispatch_generation }
+      dispatch_caches[thread] = cache
+    end
+    local func = cache[...]
+    if func == nil then
+      func = resolve(thread, ...)
+      if func == nil then
+        error("unhandled effect or yield: " .. tostring((...)), 2)
+      end
+      cache[...] = func
+    end
+    if func then
+      -- Call direct handler or default handler in current context without
+      -- yielding:
+      return func(select(2, ...))
+    end
+  end
   -- Check if yielding is possible:
   if coroutine_isyieldable() then
     -- Yielding is possible.
@@ -104,8 +207,43 @@ local function perform(...)
     )
   end
 end
+-- Functions implemented in C (if available) which resume an action (or
+-- re-perform an effect first) and return either a handler followed by the
+-- arguments for the handler, or a function passing through the action's
+-- return values:
+local core_resume, core_reperform
+
+-- Function invalidating all dispatch caches:
+local invalidate_dispatch_caches
+
+-- Use C implementation, if available:
+if core then
+  perform, core_resume, core_reperform, invalidate_dispatch_caches =
+    core.funcs(
+      default_handlers, call_marker, traceback,
+      thread_handlers, thread_parents, direct_funcs, dispatch_caches
+    )
+else
+  function invalidate_dispatch_caches()
+    dispatch_generation = dispatch_generation + 1
+  end
+end
 _M.perform = perform
 
+-- Proxy for the default handlers table, which invalidates all dispatch caches
+-- whenever a default handler is set, replaced, or removed (the proxy itself
+-- always stays empty, such that __newindex is invoked on every assignment):
+_M.default_handlers = setmetatable({}, {
+  __index = default_handlers,
+  __newindex = function(self, eff, handler)
+    default_handlers[eff] = handler
+    invalidate_dispatch_caches()
+  end,
+  __pairs = function(self)
+    return next, default_handlers, nil
+  end,
+})
+
 -- Convenience function, which creates an object that is suitable to be used as
 -- an effect, because it is callable and has a string representation:
 local function new(name)
@@ -120,14 +258,147 @@ local function new(name)
 end
 _M.new = new
 
+-- direct(func) creates a handler which calls func in the context of the
+-- performer and resumes with the return values of func. When possible, func
+-- is called directly by effect.perform without yielding and without creating
+-- a continuation:
+local function direct(func)
+  local function handler(resume, ...)
+    return resume:call(func, ...)
+  end
+  direct_funcs[handler] = func
+  return handler
+end
+_M.direct = direct
+
 -- Error used to unwind the stack of a coroutine:
 local discontinued = setmetatable({}, {
   __tostring = function() return "action discontinued" end,
 })
 
--- Ephemeron holding stack trace information for non-string error objects:
+-- Ephemeron holding stack trace information for non-string error objects
+-- (each value is a sequence of captured stack traces, which are converted to
+-- strings only when the error object is stringified):
 local traces = setmetatable({}, weak_mt)
 
+-- Function capturing the stack trace of the caller's caller (which may return
+-- an unformatted stack trace that is converted to a string by tostring):
+local capture_trace
+if core then
+  capture_trace = core.capture_trace
+else
+  -- Number of stack levels shown at the top and bottom of a captured stack
+  -- trace (same limits as used by debug.traceback):
+  local trace_levels1, trace_levels2 = 10, 11
+  -- Function searching a value in a table (and nested tables up to a given
+  -- depth) and returning its name, used to find names of library functions:
+  local function trace_findfield(tbl, value, depth)
+    if depth == 0 or type(tbl) ~= "table" then
+      return nil
+    end
+    for key, field in next, tbl do
+      if type(key) == "string" then
+        if rawequal(field, value) then
+          return key
+        end
+        local name = trace_findfield(field, value, depth - 1)
+        if name then
+          return key .. "." .. name
+        end
+      end
+    end
+    return nil
+  end
+  -- Metatable for captured stack traces, which are sequences of tables
+  -- returned by debug.getinfo (or numbers of skipped levels), converted into
+  -- the same text as generated by debug.traceback when needed:
+  local trace_metatable = {
+    __tostring = function(self)
+      local parts = { "stack traceback:" }
+      for i = 1, #self do
+        local info = self[i]
+        if type(info) == "number" then
+          parts[i+1] = "\n\t...\t(skipping " .. info .. " levels)"
+        else
+          local where
+          if info.currentline > 0 then
+            where = "\n\t" .. info.short_src .. ":" .. info.currentline ..
+              ": in "
+          else
+            where = "\n\t" .. info.short_src .. ": in "
+          end
+          local name = trace_findfield(package_loaded, info.func, 2)
+          if name then
+            if string_sub(name, 1, 3) == "_G." then
+              name = string_sub(name, 4)
+            end
+            name = "function '" .. name .. "'"
+          elseif info.namewhat ~= "" then
+            name = info.namewhat .. " '" .. info.name .. "'"
+          elseif info.what == "main" then
+            name = "main chunk"
+          elseif info.what ~= "C" then
+            name = "function <" .. info.short_src .. ":" ..
+              info.linedefined .. ">"
+          else
+            name = "?"
+          end
+          if info.istailcall then
+            parts[i+1] = where .. name .. "\n\t(...tail calls...)"
+          else
+            parts[i+1] = where .. name
+          end
+        end
+      end
+      return table_concat(parts)
+    end,
+  }
+  capture_trace = function(level)
+    -- Add one level for this function:
+    level = level + 1
+    -- Find last stack level (using a binary search like luaL_traceback):
+    local li, le = 1, 1
+    while debug_getinfo(le, "l") do
+      li = le
+      le = le * 2
+    end
+    while li < le do
+      local m = (li + le) // 2
+      if debug_getinfo(m, "l") then
+        li = m + 1
+      else
+        le = m
+      end
+    end
+    local last = le - 1
+    -- Collect information on stack levels without formatting them, skipping
+    -- levels in the middle if there are too many levels:
+    local limit = -1
+    if last - level > trace_levels1 + trace_levels2 then
+      limit = trace_levels1
+    end
+    local trace = setmetatable({}, trace_metatable)
+    local count = 0
+    while true do
+      local info = debug_getinfo(level, "Slnft")
+      if not info then
+        break
+      end
+      level = level + 1
+      count = count + 1
+      if limit == 0 then
+        local skip = last - level - trace_levels2 + 1
+        trace[count] = skip
+        level = level + skip
+      else
+        trace[count] = info
+      end
+      limit = limit - 1
+    end
+    return trace
+  end
+end
+
 -- Function adding or storing stack trace to/for error objects:
 local function add_traceback(errmsg)
   -- Check if error message is a discontinuation of an action:
@@ -148,9 +419,15 @@ local function add_traceback(errmsg)
   -- Check if error message is not nil and not a number:
   if errmsg ~= nil and errtype ~= "number" then
     -- Error message is a table, userdata, function, thread, or boolean.
-    -- Store stack trace in ephemeron, prepending an existing stack trace if
-    -- one exists:
-    traces[errmsg] = debug_traceback(traces[errmsg], 2)
+    -- Capture stack trace and store it in ephemeron, appending it to
+    -- existing stack traces if they exist:
+    local trace = capture_trace(2)
+    local captures = traces[errmsg]
+    if captures then
+      captures[#captures+1] = trace
+    else
+      traces[errmsg] = { trace }
+    end
   end
   -- Return original error object:
   return errmsg
@@ -178,10 +455,14 @@ end
 
 -- Function that turns an error message (which can be a table) into a string:
 local function stringify_error(message)
-  local trace = traces[message]
+  local captures = traces[message]
   local message = tostring(message)
-  if trace then
-    return message .. "\n" .. trace
+  if captures then
+    local parts = { message }
+    for i = 1, #captures do
+      parts[i+1] = tostring(captures[i])
+    end
+    return table_concat(parts, "\n")
   else
     return message
   end
@@ -277,7 +558,7 @@ local function state_perform(state, ...)
     if default_handler then
       -- A default handler is available.
       -- Call default handler and resume with its return values:
-      return state.resume_func(default_handler())
+      return state.resume_func(default_handler(select(2, ...)))
     end
     -- No default handler has been found.
     -- Throw error in context of performer:
@@ -359,8 +640,11 @@ local function no_resume_call(func, ...)
   return perform(no_resume, func(...))
 end
 
--- Effect used to generate tracebacks of a continuation:
-local traceback = new("neumond.effect.traceback")
+-- Helper function to call the return values of core_resume or core_reperform
+-- as tail-call (which avoids growing the C stack):
+local function dispatch(func, ...)
+  return func(...)
+end
 
 -- Forward declaration:
 local handle
@@ -403,7 +687,17 @@ local continuation_metatable = {
     end,
     -- Re-performs an effect in the context of the continuation:
     perform = function(self, ...)
-      return state_perform(states[self], ...)
+      local state = states[self]
+      -- Check if C implementation is available:
+      if core_reperform then
+        -- C implementation is available.
+        -- Re-perform effect and dispatch results:
+        return dispatch(
+          core_reperform(state.thread, state.handlers, self, ...)
+        )
+      end
+      -- C implementation is not available.
+      return state_perform(state, ...)
     end,
     -- Avoids auto-discontinuation on handler return or error:
     persistent = function(self)
@@ -432,64 +726,106 @@ local continuation_metatable = {
 -- not be called after the effect handler has returned, unless
 -- resume:persistent() is called before the handler returns.
 --
+-- Handlers created with the direct function are called in the context of the
+-- performer (without continuation), if possible.
+--
+-- The handlers table is copied, i.e. modifying it after calling handle has no
+-- effect on the running action.
+--
 function handle(handlers, action, ...)
+  -- Copy handlers, such that later modifications of the passed table do not
+  -- conflict with cached dispatch results:
+  do
+    local handlers_copy = {}
+    for eff, handler in pairs(handlers) do
+      handlers_copy[eff] = handler
+    end
+    handlers = handlers_copy
+  end
   -- Create coroutine with pcall_traceback as function:
   local action_thread = coroutine_create(pcall_traceback)
+  -- Remember handlers for finding direct handlers when performing effects:
+  thread_handlers[action_thread] = handlers
   -- Forward declarations:
   local resume, process_action_results, state
   -- Function resuming the action:
-  local function resume_func(...)
-    -- Resume coroutine and use helper function to process multiple return
-    -- values:
-    return process_action_results(coroutine_resume(action_thread, ...))
-  end
-  -- Helper function to process return values of coroutine.resume:
-  function process_action_results(coro_success, ...)
-    -- Check if coroutine.resume failed (should not happen):
-    if coro_success then
-      -- coroutine.resume did not fail.
-      -- Check if coroutine terminated:
-      if coroutine_status(action_thread) == "dead" then
-        -- Coroutine terminated.
-        -- Process return values from pcall_traceback (return results on
-        -- success or throw error):
-        return assert_nopos(...)
+  local resume_func
+  -- Check if C implementation is available:
+  if core_resume then
+    -- C implementation is available.
+    function resume_func(...)
+      -- Resume coroutine and process results in C, then call returned
+      -- handler as tail-call:
+      return dispatch(core_resume(action_thread, handlers, resume, ...))
+    end
+  else
+    -- C implementation is not available.
+    function resume_func(...)
+      -- Remember where the action is resumed, and invalidate all dispatch
+      -- caches if it was previously resumed in a different coroutine:
+      local parent, is_main = coroutine_running()
+      if is_main then
+        parent = true
       end
-      -- Coroutine did not terminate yet, i.e. an effect has been performed.
-      -- Lookup matching handler:
-      local handler = handlers[...]
-      if handler then
-        -- Handler has been found.
-        -- Call handler with continuation object:
-        return handler(resume, select(2, ...))
+      local previous = thread_parents[action_thread]
+      if previous ~= parent then
+        if previous ~= nil then
+          dispatch_generation = dispatch_generation + 1
+        end
+        thread_parents[action_thread] = parent
       end
-      -- No handler has been found.
-      -- Check if traceback effect has been performed:
-      if ... == traceback then
-        -- Internal effect "traceback" has been performed.
-        -- Obtain arguments:
-        local dummy_, until_thread, parts = ...
-        -- Extend stack trace parts:
-        local part_count = #parts
-        if part_count == 0 then
-          parts[1] = debug_traceback(action_thread, nil, 3)
-        else
-          parts[part_count+1] = debug_traceback(action_thread)
+      -- Resume coroutine and use helper function to process multiple return
+      -- values:
+      return process_action_results(coroutine_resume(action_thread, ...))
+    end
+    -- Helper function to process return values of coroutine.resume:
+    function process_action_results(coro_success, ...)
+      -- Check if coroutine.resume failed (should not happen):
+      if coro_success then
+        -- coroutine.resume did not fail.
+        -- Check if coroutine terminated:
+        if coroutine_status(action_thread) == "dead" then
+          -- Coroutine terminated.
+          -- Process return values from pcall_traceback (return results on
+          -- success or throw error):
+          return assert_nopos(...)
+        end
+        -- Coroutine did not terminate yet, i.e. an effect has been performed.
+        -- Lookup matching handler:
+        local handler = handlers[...]
+        if handler then
+          -- Handler has been found.
+          -- Call handler with continuation object:
+          return handler(resume, select(2, ...))
         end
-        -- Check if end level (of nested coroutines) has been reached:
-        if action_thread == until_thread then
-          -- End level has been reached.
-          -- Resume with stack trace parts:
-          return resume_func(parts)
+        -- No handler has been found.
+        -- Check if traceback effect has been performed:
+        if ... == traceback then
+          -- Internal effect "traceback" has been performed.
+          -- Obtain arguments:
+          local dummy_, until_thread, parts = ...
+          -- Extend stack trace parts:
+          local part_count = #parts
+          if part_count == 0 then
+            parts[1] = debug_traceback(action_thread, nil, 3)
+          else
+            parts[part_count+1] = debug_traceback(action_thread)
+          end
+          -- Check if end level (of nested coroutines) has been reached:
+          if action_thread == until_thread then
+            -- End level has been reached.
+            -- Resume with stack trace parts:
+            return resume_func(parts)
+          end
+          -- End level has not been reached and traceback effect must be
+          -- re-performed.
         end
-        -- End level has not been reached and traceback effect must be
-        -- re-performed.
+        -- Re-perform effect:
+        return state_perform(state, ...)
+      else
+        -- coroutine.resume failed.
+        error("unhandled error in coroutine: " .. tostring((...)))
       end
-      -- Re-perform effect:
-      return state_perform(state, ...)
-    else
-      -- coroutine.resume failed.
-      error("unhandled error in coroutine: " .. tostring((...)))
     end
   end
   -- Create and install state for auto-discontinuation on return:
@@ -497,6 +833,7 @@ function handle(handlers, action, ...)
     {
       resume_func = resume_func,
       thread = action_thread,
+      handlers = handlers,
       onstack = true,
       auto_discontinue = true,
       closing = false,
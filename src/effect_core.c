@@ -0,0 +1,587 @@
+// Optional C implementation of the performance critical parts of the
+// neumond.effect module (performing effects and resuming actions)
+
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// Upvalues shared by perform, resume, and reperform functions:
+#define EFFECT_DEFAULT_HANDLERS_UVIDX 1
+#define EFFECT_CALL_MARKER_UVIDX 2
+#define EFFECT_TRACEBACK_UVIDX 3
+#define EFFECT_THREAD_HANDLERS_UVIDX 4
+#define EFFECT_THREAD_PARENTS_UVIDX 5
+#define EFFECT_DIRECT_FUNCS_UVIDX 6
+#define EFFECT_DISPATCH_CACHES_UVIDX 7
+#define EFFECT_DISPATCH_STATE_UVIDX 8
+#define EFFECT_UVCNT 8
+
+// Stack positions of fixed arguments to resume and reperform functions:
+#define EFFECT_THREAD_IDX 1
+#define EFFECT_HANDLERS_IDX 2
+#define EFFECT_CONTINUATION_IDX 3
+#define EFFECT_FIXED_ARGS 3
+
+// Shared state for invalidating dispatch caches:
+typedef struct {
+  lua_Integer generation;
+} effect_dispatch_t;
+
+// Number of stack levels shown at the top and bottom of a captured stack
+// trace (same limits as used by luaL_traceback):
+#define EFFECT_TRACE_LEVELS1 10
+#define EFFECT_TRACE_LEVELS2 11
+
+// Number of table entries per stack level in a captured stack trace
+// (function, current line, name kind, name, tail call flag):
+#define EFFECT_TRACE_STRIDE 5
+
+// Registry key for metatable of captured stack traces:
+#define EFFECT_TRACE_MT_REGKEY "neumond.effect_core.trace"
+
+// Key for storing the generation in a dispatch cache:
+static const char effect_generation_key = 0;
+
+// Returns all arguments, used when an action has terminated:
+static int effect_pass(lua_State *L) {
+  return lua_gettop(L);
+}
+
+// Throws an error message with position information of the performer, used
+// to report errors in the context of the performer:
+static int effect_throw(lua_State *L) {
+  // level 1 is perform, level 2 is the function that performed the effect:
+  luaL_where(L, 2);
+  lua_pushvalue(L, 1);
+  lua_concat(L, 2);
+  return lua_error(L);
+}
+
+static int effect_perform_call_cont(lua_State *L, int status, lua_KContext ctx) {
+  return lua_gettop(L);
+}
+
+static int effect_perform_cont(lua_State *L, int status, lua_KContext ctx) {
+  // elements on stack: values passed to continuation
+  // check if first value is call marker:
+  if (lua_rawequal(
+    L, 1, lua_upvalueindex(EFFECT_CALL_MARKER_UVIDX)
+  )) {
+    // call second value with remaining values and return its results:
+    lua_remove(L, 1);
+    lua_callk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, effect_perform_call_cont);
+    return effect_perform_call_cont(L, LUA_OK, 0);
+  }
+  return lua_gettop(L);
+}
+
+// Finds the first handler for the effect at stack position 1 by walking up
+// the coroutines of nested actions, starting with the thread on top of the
+// stack, which is replaced with the function to be called in the context of
+// the performer (direct handler or default handler), with false if yielding
+// is necessary, or with nil if there is no handler at all:
+static void effect_resolve(lua_State *L) {
+  while (1) {
+    lua_pushvalue(L, -1);
+    lua_rawget(L, lua_upvalueindex(EFFECT_THREAD_HANDLERS_UVIDX));
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      if (lua_isboolean(L, -1)) {
+        // main coroutine has been reached
+        lua_pop(L, 1);
+        lua_pushvalue(L, 1);
+        lua_gettable(L, lua_upvalueindex(EFFECT_DEFAULT_HANDLERS_UVIDX));
+      } else {
+        // thread is not known (e.g. some other coroutine)
+        lua_pop(L, 1);
+        lua_pushboolean(L, 0);
+      }
+      return;
+    }
+    lua_pushvalue(L, 1);
+    lua_gettable(L, -2);
+    if (!lua_isnil(L, -1)) {
+      lua_rawget(L, lua_upvalueindex(EFFECT_DIRECT_FUNCS_UVIDX));
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushboolean(L, 0);
+      }
+      lua_replace(L, -3);
+      lua_pop(L, 1);
+      return;
+    }
+    lua_pop(L, 2);
+    lua_rawget(L, lua_upvalueindex(EFFECT_THREAD_PARENTS_UVIDX));
+  }
+}
+
+// Checks if the effect can be handled by calling a function in the current
+// context (using a cache which is valid as long as the generation of the
+// dispatch state does not change), and if yes, replaces the effect with the
+// function to be called and returns 1:
+static int effect_dispatch(lua_State *L) {
+  effect_dispatch_t *dispatch;
+  int top = lua_gettop(L);
+  if (lua_isnil(L, 1)) return 0;
+  if (lua_pushthread(L)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  // elements on stack (after effect and arguments):
+  // top+1: current thread
+  // top+2: dispatch cache
+  dispatch = lua_touserdata(L, lua_upvalueindex(EFFECT_DISPATCH_STATE_UVIDX));
+  lua_pushvalue(L, top + 1);
+  lua_rawget(L, lua_upvalueindex(EFFECT_DISPATCH_CACHES_UVIDX));
+  if (!lua_isnil(L, -1)) {
+    lua_rawgetp(L, -1, &effect_generation_key);
+    if (lua_tointeger(L, -1) != dispatch->generation) {
+      lua_pop(L, 1);
+      lua_pushnil(L);
+      lua_replace(L, top + 2);
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushinteger(L, dispatch->generation);
+    lua_rawsetp(L, -2, &effect_generation_key);
+    lua_pushvalue(L, top + 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, lua_upvalueindex(EFFECT_DISPATCH_CACHES_UVIDX));
+  }
+  lua_pushvalue(L, 1);
+  lua_rawget(L, top + 2);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushvalue(L, top + 1);
+    effect_resolve(L);
+    if (lua_isnil(L, -1)) {
+      return luaL_error(L,
+        "unhandled effect or yield: %s", luaL_tolstring(L, 1, NULL)
+      );
+    }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, top + 2);
+  }
+  if (!lua_toboolean(L, -1)) {
+    lua_settop(L, top);
+    return 0;
+  }
+  lua_replace(L, 1);
+  lua_settop(L, top);
+  return 1;
+}
+
+static int effect_perform(lua_State *L) {
+  // elements on stack:
+  // 1: effect
+  // 2...: arguments
+  luaL_checkany(L, 1);
+  if (effect_dispatch(L)) {
+    // call direct handler or default handler in current context without
+    // yielding:
+    lua_callk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, effect_perform_call_cont);
+    return effect_perform_call_cont(L, LUA_OK, 0);
+  }
+  if (lua_isyieldable(L)) {
+    return lua_yieldk(L, lua_gettop(L), 0, effect_perform_cont);
+  }
+  if (lua_pushthread(L)) {
+    // main coroutine, thus no effect handlers are installed
+    lua_pop(L, 1);
+    lua_pushvalue(L, 1);
+    lua_gettable(L, lua_upvalueindex(EFFECT_DEFAULT_HANDLERS_UVIDX));
+    if (!lua_isnil(L, -1)) {
+      lua_replace(L, 1);
+      lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+      return lua_gettop(L);
+    }
+    return luaL_error(L,
+      "no effect handler installed while performing effect: %s",
+      luaL_tolstring(L, 1, NULL)
+    );
+  }
+  return luaL_error(L,
+    "cannot yield across C-call boundary while performing effect: %s",
+    luaL_tolstring(L, 1, NULL)
+  );
+}
+
+// Replaces all values above fixed arguments with call marker, effect_throw
+// function, and an error message, such that the action is resumed with an
+// error that is raised in the context of the performer:
+static void effect_prepare_throw(lua_State *L, const char *msg) {
+  luaL_tolstring(L, EFFECT_FIXED_ARGS + 1, NULL);
+  lua_pushfstring(L, "%s: %s", msg, lua_tostring(L, -1));
+  lua_replace(L, EFFECT_FIXED_ARGS + 1);
+  lua_settop(L, EFFECT_FIXED_ARGS + 1);
+  lua_pushvalue(L, lua_upvalueindex(EFFECT_CALL_MARKER_UVIDX));
+  lua_pushcfunction(L, effect_throw);
+  lua_rotate(L, EFFECT_FIXED_ARGS + 1, 2);
+}
+
+static int effect_step_cont(lua_State *L, int status, lua_KContext ctx);
+
+// Resumes the action with all values above the fixed arguments (or forwards
+// those values as an effect to outer handlers first if "forward" is set) and
+// returns either a handler followed by the arguments for the handler, or a
+// function that passes through the return values of the action:
+static int effect_step(lua_State *L, int forward) {
+  // elements on stack:
+  // 1: action thread
+  // 2: handlers
+  // 3: continuation object
+  // 4...: values to pass to action thread (or effect and arguments to forward)
+  lua_State *co = lua_tothread(L, EFFECT_THREAD_IDX);
+  int status, nargs, nres;
+  while (1) {
+    if (forward) {
+      forward = 0;
+      if (lua_isyieldable(L)) {
+        // yield further down the stack and resume action with results:
+        return lua_yieldk(
+          L, lua_gettop(L) - EFFECT_FIXED_ARGS, 0, effect_step_cont
+        );
+      }
+      if (lua_pushthread(L)) {
+        // main coroutine, thus no effect handler has been found
+        lua_pop(L, 1);
+        lua_pushvalue(L, EFFECT_FIXED_ARGS + 1);
+        lua_gettable(L,
+          lua_upvalueindex(EFFECT_DEFAULT_HANDLERS_UVIDX)
+        );
+        if (!lua_isnil(L, -1)) {
+          // call default handler and resume action with its results:
+          lua_replace(L, EFFECT_FIXED_ARGS + 1);
+          lua_call(L,
+            lua_gettop(L) - EFFECT_FIXED_ARGS - 1, LUA_MULTRET
+          );
+        } else {
+          lua_pop(L, 1);
+          effect_prepare_throw(L, "unhandled effect or yield");
+        }
+      } else {
+        lua_pop(L, 1);
+        effect_prepare_throw(L,
+          "cannot yield across C-call boundary while performing effect"
+        );
+      }
+    }
+    nargs = lua_gettop(L) - EFFECT_FIXED_ARGS;
+    if (!lua_checkstack(co, nargs)) {
+      return luaL_error(L, "too many arguments to resume");
+    }
+    lua_xmove(L, co, nargs);
+    status = lua_resume(co, L, nargs, &nres);
+    if (status == LUA_OK) {
+      // coroutine terminated, process return values from pcall_traceback:
+      luaL_checkstack(L, nres + 1, "too many results to resume");
+      lua_xmove(co, L, nres);
+      if (!lua_toboolean(L, EFFECT_FIXED_ARGS + 1)) {
+        lua_settop(L, EFFECT_FIXED_ARGS + 2);
+        return lua_error(L);
+      }
+      lua_pushcfunction(L, effect_pass);
+      lua_replace(L, EFFECT_FIXED_ARGS + 1);
+      return lua_gettop(L) - EFFECT_FIXED_ARGS;
+    }
+    if (status != LUA_YIELD) {
+      lua_xmove(co, L, 1);
+      return luaL_error(L,
+        "unhandled error in coroutine: %s", luaL_tolstring(L, -1, NULL)
+      );
+    }
+    // an effect has been performed
+    luaL_checkstack(L, nres + 2, "too many results to resume");
+    lua_xmove(co, L, nres);
+    lua_settop(L, EFFECT_FIXED_ARGS + 1 + (nres > 0 ? nres - 1 : 0));
+    lua_pushvalue(L, EFFECT_FIXED_ARGS + 1);
+    lua_gettable(L, EFFECT_HANDLERS_IDX);
+    if (!lua_isnil(L, -1)) {
+      // return handler, continuation object, and arguments:
+      lua_replace(L, EFFECT_FIXED_ARGS + 1);
+      lua_pushvalue(L, EFFECT_CONTINUATION_IDX);
+      lua_insert(L, EFFECT_FIXED_ARGS + 2);
+      return lua_gettop(L) - EFFECT_FIXED_ARGS;
+    }
+    lua_pop(L, 1);
+    if (lua_rawequal(
+      L, EFFECT_FIXED_ARGS + 1,
+      lua_upvalueindex(EFFECT_TRACEBACK_UVIDX)
+    )) {
+      // internal traceback effect has been performed
+      // elements on stack (after fixed arguments):
+      // 4: traceback effect
+      // 5: thread where traceback generation ends
+      // 6: table with parts of traceback
+      lua_Integer part_count;
+      lua_settop(L, EFFECT_FIXED_ARGS + 3);
+      luaL_checktype(L, EFFECT_FIXED_ARGS + 3, LUA_TTABLE);
+      part_count = lua_rawlen(L, EFFECT_FIXED_ARGS + 3);
+      luaL_traceback(L, co, NULL, part_count == 0 ? 3 : 0);
+      lua_rawseti(L, EFFECT_FIXED_ARGS + 3, part_count + 1);
+      if (lua_tothread(L, EFFECT_FIXED_ARGS + 2) == co) {
+        // end level has been reached, resume with traceback parts:
+        lua_replace(L, EFFECT_FIXED_ARGS + 1);
+        lua_settop(L, EFFECT_FIXED_ARGS + 1);
+        continue;
+      }
+    }
+    forward = 1;
+  }
+}
+
+static int effect_step_cont(lua_State *L, int status, lua_KContext ctx) {
+  return effect_step(L, 0);
+}
+
+// Remembers that the action is resumed in the current coroutine (or true for
+// the main coroutine), and invalidates all dispatch caches if the action was
+// previously resumed in a different coroutine:
+static void effect_set_parent(lua_State *L) {
+  lua_pushvalue(L, EFFECT_THREAD_IDX);
+  if (lua_pushthread(L)) {
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+  }
+  lua_pushvalue(L, -2);
+  lua_rawget(L, lua_upvalueindex(EFFECT_THREAD_PARENTS_UVIDX));
+  if (lua_rawequal(L, -1, -2)) {
+    lua_pop(L, 3);
+    return;
+  }
+  if (!lua_isnil(L, -1)) {
+    effect_dispatch_t *dispatch = lua_touserdata(L,
+      lua_upvalueindex(EFFECT_DISPATCH_STATE_UVIDX)
+    );
+    dispatch->generation++;
+  }
+  lua_pop(L, 1);
+  lua_rawset(L, lua_upvalueindex(EFFECT_THREAD_PARENTS_UVIDX));
+}
+
+static int effect_resume(lua_State *L) {
+  effect_set_parent(L);
+  return effect_step(L, 0);
+}
+
+static int effect_reperform(lua_State *L) {
+  luaL_checkany(L, EFFECT_FIXED_ARGS + 1);
+  effect_set_parent(L);
+  return effect_step(L, 1);
+}
+
+// Invalidates all dispatch caches (to be called when default handlers
+// change):
+static int effect_invalidate(lua_State *L) {
+  effect_dispatch_t *dispatch = lua_touserdata(L,
+    lua_upvalueindex(EFFECT_DISPATCH_STATE_UVIDX)
+  );
+  dispatch->generation++;
+  return 0;
+}
+
+// Creates perform, resume, reperform, and invalidate functions, expecting
+// default handlers, call marker, traceback effect, and ephemerons for handlers
+// of threads, parents of threads, functions of direct handlers, and dispatch
+// caches as arguments:
+static int effect_funcs(lua_State *L) {
+  static const lua_CFunction funcs[] = {
+    effect_perform, effect_resume, effect_reperform, effect_invalidate
+  };
+  effect_dispatch_t *dispatch;
+  int i, j;
+  lua_settop(L, EFFECT_UVCNT - 1);
+  dispatch = lua_newuserdatauv(L, sizeof(*dispatch), 0);
+  dispatch->generation = 0;
+  for (i = 0; i < 4; i++) {
+    for (j = 1; j <= EFFECT_UVCNT; j++) lua_pushvalue(L, j);
+    lua_pushcclosure(L, funcs[i], EFFECT_UVCNT);
+  }
+  return 4;
+}
+
+// Returns the number of the last existing stack level:
+static int effect_trace_lastlevel(lua_State *L) {
+  lua_Debug ar;
+  int li = 1, le = 1;
+  while (lua_getstack(L, le, &ar)) { li = le; le *= 2; }
+  while (li < le) {
+    int m = (li + le) / 2;
+    if (lua_getstack(L, m, &ar)) li = m + 1;
+    else le = m;
+  }
+  return le - 1;
+}
+
+// Captures the stack starting at a given level (where level 1 is the caller
+// of this function) without formatting it. The returned table is converted
+// into the same text as generated by luaL_traceback by calling tostring on
+// it, which is much more expensive and only done when needed:
+static int effect_capture_trace(lua_State *L) {
+  lua_Debug ar;
+  int level = luaL_optinteger(L, 1, 1);
+  int last = effect_trace_lastlevel(L);
+  int limit = (last - level > EFFECT_TRACE_LEVELS1 + EFFECT_TRACE_LEVELS2) ?
+    EFFECT_TRACE_LEVELS1 : -1;
+  int idx = 0;
+  lua_settop(L, 0);
+  lua_newtable(L);
+  while (lua_getstack(L, level++, &ar)) {
+    if (limit-- == 0) {
+      // too many levels, skip levels in the middle and store number of
+      // skipped levels instead of a function:
+      int skip = last - level - EFFECT_TRACE_LEVELS2 + 1;
+      lua_pushboolean(L, 0);
+      lua_rawseti(L, 1, ++idx);
+      lua_pushinteger(L, skip);
+      lua_rawseti(L, 1, ++idx);
+      idx += EFFECT_TRACE_STRIDE - 2;
+      level += skip;
+    } else {
+      lua_getinfo(L, "flnt", &ar);
+      lua_rawseti(L, 1, ++idx);
+      lua_pushinteger(L, ar.currentline);
+      lua_rawseti(L, 1, ++idx);
+      lua_pushstring(L, ar.namewhat);
+      lua_rawseti(L, 1, ++idx);
+      if (ar.name) lua_pushstring(L, ar.name);
+      else lua_pushboolean(L, 0);
+      lua_rawseti(L, 1, ++idx);
+      lua_pushboolean(L, ar.istailcall);
+      lua_rawseti(L, 1, ++idx);
+    }
+  }
+  luaL_setmetatable(L, EFFECT_TRACE_MT_REGKEY);
+  return 1;
+}
+
+// Searches for a value (at given stack index) in a table (on top of stack)
+// and pushes its name (if found), used to find names of library functions:
+static int effect_trace_findfield(lua_State *L, int objidx, int level) {
+  if (level == 0 || !lua_istable(L, -1)) return 0;
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      if (lua_rawequal(L, objidx, -1)) {
+        lua_pop(L, 1);
+        return 1;
+      } else if (effect_trace_findfield(L, objidx, level - 1)) {
+        // stack: library name, library table, field name
+        lua_pushliteral(L, ".");
+        lua_replace(L, -3);
+        lua_concat(L, 3);
+        return 1;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+// Pushes a description of a function (at given stack index) in the same
+// format as used by luaL_traceback:
+static void effect_trace_pushfuncname(
+  lua_State *L, int funcidx, lua_Debug *ar, int named
+) {
+  int top = lua_gettop(L);
+  funcidx = lua_absindex(L, funcidx);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  luaL_checkstack(L, 6, "not enough stack");
+  if (effect_trace_findfield(L, funcidx, 2)) {
+    const char *name = lua_tostring(L, -1);
+    if (!strncmp(name, LUA_GNAME ".", sizeof(LUA_GNAME))) {
+      name += sizeof(LUA_GNAME);
+    }
+    lua_pushfstring(L, "function '%s'", name);
+  } else if (named) {
+    lua_pushfstring(L, "%s '%s'", ar->namewhat, ar->name);
+  } else if (*ar->what == 'm') {
+    lua_pushliteral(L, "main chunk");
+  } else if (*ar->what != 'C') {
+    lua_pushfstring(L, "function <%s:%d>", ar->short_src, ar->linedefined);
+  } else {
+    lua_pushliteral(L, "?");
+  }
+  lua_replace(L, top + 1);
+  lua_settop(L, top + 1);
+}
+
+// Converts a captured stack trace into a string:
+static int effect_trace_tostring(lua_State *L) {
+  luaL_Buffer buf;
+  lua_Integer idx;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  luaL_buffinit(L, &buf);
+  luaL_addstring(&buf, "stack traceback:");
+  for (idx = 1; ; idx += EFFECT_TRACE_STRIDE) {
+    lua_Debug ar;
+    int currentline, named, istailcall;
+    if (lua_rawgeti(L, 1, idx) == LUA_TNIL) {
+      lua_pop(L, 1);
+      break;
+    }
+    if (!lua_toboolean(L, -1)) {
+      lua_pop(L, 1);
+      lua_rawgeti(L, 1, idx + 1);
+      lua_pushfstring(L, "\n\t...\t(skipping %d levels)",
+        (int)lua_tointeger(L, -1)
+      );
+      lua_remove(L, -2);
+      luaL_addvalue(&buf);
+      continue;
+    }
+    // stack: function
+    lua_rawgeti(L, 1, idx + 1);
+    currentline = lua_tointeger(L, -1);
+    lua_rawgeti(L, 1, idx + 2);
+    lua_rawgeti(L, 1, idx + 3);
+    lua_rawgeti(L, 1, idx + 4);
+    istailcall = lua_toboolean(L, -1);
+    // stack: function, current line, name kind, name, tail call flag
+    ar.namewhat = lua_tostring(L, -3);
+    named = ar.namewhat && *ar.namewhat && lua_isstring(L, -2);
+    ar.name = named ? lua_tostring(L, -2) : NULL;
+    lua_pushvalue(L, -5);
+    lua_getinfo(L, ">S", &ar);
+    if (currentline <= 0) {
+      lua_pushfstring(L, "\n\t%s: in ", ar.short_src);
+    } else {
+      lua_pushfstring(L, "\n\t%s:%d: in ", ar.short_src, currentline);
+    }
+    effect_trace_pushfuncname(L, -6, &ar, named);
+    if (istailcall) lua_pushliteral(L, "\n\t(...tail calls...)");
+    else lua_pushliteral(L, "");
+    lua_concat(L, 3);
+    // stack: function, current line, name kind, name, tail call flag, text
+    lua_replace(L, -6);
+    lua_pop(L, 4);
+    luaL_addvalue(&buf);
+  }
+  luaL_pushresult(&buf);
+  return 1;
+}
+
+static const struct luaL_Reg effect_module_funcs[] = {
+  {"funcs", effect_funcs},
+  {"capture_trace", effect_capture_trace},
+  {NULL, NULL}
+};
+
+int luaopen_neumond_effect_core(lua_State *L) {
+  luaL_newmetatable(L, EFFECT_TRACE_MT_REGKEY);
+  lua_pushcfunction(L, effect_trace_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushliteral(L, "neumond.effect.trace");
+  lua_setfield(L, -2, "__name");
+  lua_pop(L, 1);
+  lua_newtable(L);
+  luaL_setfuncs(L, effect_module_funcs, 0);
+  return 1;
+}
@@ -92,6 +92,23 @@ function handle_methods:read(maxlen, terminator)
   end
 end
 
+function handle_methods:read_into(buf, maxlen)
+  if maxlen == 0 then
+    return 0
+  end
+  while true do
+    local result, errmsg = self.nbio_handle:read_into(buf, maxlen)
+    if result == nil then
+      return nil, errmsg
+    elseif not result then
+      return 0 -- indicates EOF
+    elseif result > 0 then
+      return result
+    end
+    wait_posix.wait_fd_read(self.nbio_handle.fd)
+  end
+end
+
 function handle_methods:unread(data, ...)
   local arg_count = select("#", data, ...)
   if arg_count > 1 then
@@ -100,10 +117,27 @@ function handle_methods:unread(data, ...)
   return self.nbio_handle:unread(data)
 end
 
+-- Writes several strings using vectored I/O through the given nbio method
+-- (writev or writev_unbuffered), such that they are not concatenated:
+local function write_vectored(self, method, ...)
+  local nbio_handle = self.nbio_handle
+  local start = 0
+  while true do
+    local result, remaining = nbio_handle[method](nbio_handle, start, ...)
+    if not result then
+      return result, remaining
+    end
+    start = start + result
+    if remaining == 0 then
+      return true
+    end
+    wait_posix.wait_fd_write(nbio_handle.fd)
+  end
+end
+
 function handle_methods:write(data, ...)
-  local arg_count = select("#", data, ...)
-  if arg_count > 1 then
-    data = table.concat({data, ...}, nil, 1, arg_count)
+  if select("#", ...) > 0 then
+    return write_vectored(self, "writev", data, ...)
   end
   if data == "" then
     return true
@@ -126,9 +160,8 @@ function handle_methods:write(data, ...)
 end
 
 function handle_methods:flush(data, ...)
-  local arg_count = select("#", data, ...)
-  if arg_count > 1 then
-    data = table.concat({data, ...}, nil, 1, arg_count)
+  if select("#", ...) > 0 then
+    return write_vectored(self, "writev_unbuffered", data, ...)
   end
   if data ~= nil and data ~= "" then
     -- write_unbuffered also flushes
@@ -160,15 +193,96 @@ function handle_methods:flush(data, ...)
   return true
 end
 
+function handle_methods:sendfile(file, offset, length)
+  offset = offset or 0
+  local total = 0
+  while not (length and total >= length) do
+    local result, eof = self.nbio_handle:sendfile(
+      file.nbio_handle, offset + total, length and length - total
+    )
+    if not result then
+      return result, eof
+    end
+    total = total + result
+    if eof then
+      break
+    end
+    if result == 0 then
+      wait_posix.wait_fd_write(self.nbio_handle.fd)
+    end
+  end
+  return total
+end
+
+function handle_methods:setopt(name, value)
+  return self.nbio_handle:setopt(name, value)
+end
+
+function handle_methods:getopt(name)
+  return self.nbio_handle:getopt(name)
+end
+
+function handle_methods:starttls(context, hostname)
+  local nbio_handle = self.nbio_handle
+  local result, errmsg = nbio_handle:starttls(context, hostname)
+  if not result then
+    return result, errmsg
+  end
+  while true do
+    local result, direction = nbio_handle:handshake()
+    if result then
+      return true
+    elseif result == nil then
+      return result, direction
+    elseif direction == "read" then
+      wait_posix.wait_fd_read(nbio_handle.fd)
+    else
+      wait_posix.wait_fd_write(nbio_handle.fd)
+    end
+  end
+end
+
+function handle_methods:tls_info()
+  return self.nbio_handle:tls_info()
+end
+
 local function wrap_handle(handle)
-  return setmetatable(
-    {
-      nbio_handle = handle,
-      peer_addr = handle.peer_addr,
-      peer_port = handle.peer_port,
-    },
-    handle_metatable
-  )
+  return setmetatable({ nbio_handle = handle }, handle_metatable)
+end
+
+-- Metatable for handles returned by accept, which fetch the peer address from
+-- the nbio handle only when requested (nbio formats it lazily) and then
+-- switch to the ordinary handle metatable:
+local accepted_handle_metatable = {
+  __close = handle_methods.close,
+  __index = function(self, key)
+    if key == "peer_addr" or key == "peer_port" then
+      local nbio_handle = self.nbio_handle
+      rawset(self, "peer_addr", nbio_handle.peer_addr)
+      rawset(self, "peer_port", nbio_handle.peer_port)
+      setmetatable(self, handle_metatable)
+      return rawget(self, key)
+    end
+    return handle_methods[key]
+  end,
+}
+
+local function wrap_accepted_handle(handle)
+  return setmetatable({ nbio_handle = handle }, accepted_handle_metatable)
+end
+
+-- Performs TLS handshake on a new connection if requested by option "tls",
+-- closes the connection on failure:
+local function tcpconnect_tls(handle, host, opts)
+  local context = opts and opts.tls
+  if context then
+    local result, errmsg = handle:starttls(context, opts.tls_hostname or host)
+    if not result then
+      handle:close()
+      return nil, errmsg
+    end
+  end
+  return handle
 end
 
 function _M.open(...)
@@ -187,12 +301,81 @@ function _M.localconnect(...)
   return wrap_handle(handle)
 end
 
-function _M.tcpconnect(...)
-  local handle, err = nbio.tcpconnect(...)
+-- Default delay in seconds before starting a connection attempt to the next
+-- address (as recommended by RFC 8305):
+local attempt_delay_default = 0.25
+
+-- Connects to the resolved addresses of a host with staggered starts, such
+-- that an unreachable address does not delay the connection, and returns the
+-- first established connection:
+local function tcpconnect_parallel(host, port, opts)
+  local addrs, errmsg = nbio.tcpresolve(host, port)
+  if not addrs then
+    return nil, errmsg
+  end
+  local delay = opts.attempt_delay or attempt_delay_default
+  local pending = {}
+  local function close_pending()
+    for _, handle in ipairs(pending) do
+      wait_posix.deregister_fd(handle.fd)
+      handle:close()
+    end
+    pending = {}
+  end
+  -- Close attempts that are not used, also when the fiber is killed:
+  local pending_guard <close> = setmetatable({}, { __close = close_pending })
+  for idx, addr in ipairs(addrs) do
+    local handle
+    handle, errmsg = nbio.tcpconnect(addr, port, opts)
+    if handle then
+      pending[#pending+1] = handle
+    end
+    local timer <close> = idx < #addrs and wait.timeout(delay) or nil
+    -- Wait until an attempt succeeds, all attempts have failed (which starts
+    -- the next attempt immediately), or the timer has elapsed:
+    while #pending > 0 do
+      for i = #pending, 1, -1 do
+        local handle = pending[i]
+        local result, err = handle:connected()
+        if result then
+          table.remove(pending, i)
+          -- Remaining attempts are closed before the TLS handshake:
+          close_pending()
+          return tcpconnect_tls(wrap_handle(handle), host, opts)
+        elseif result == nil then
+          table.remove(pending, i)
+          wait_posix.deregister_fd(handle.fd)
+          handle:close()
+          errmsg = err
+        end
+      end
+      if #pending == 0 or (timer and timer.ready) then
+        break
+      end
+      local select_args = {}
+      for _, handle in ipairs(pending) do
+        select_args[#select_args+1] = "fd_write"
+        select_args[#select_args+1] = handle.fd
+      end
+      if timer then
+        select_args[#select_args+1] = "handle"
+        select_args[#select_args+1] = timer
+      end
+      wait.select(table.unpack(select_args))
+    end
+  end
+  return nil, errmsg
+end
+
+function _M.tcpconnect(host, port, opts)
+  if opts and opts.happy_eyeballs then
+    return tcpconnect_parallel(host, port, opts)
+  end
+  local handle, err = nbio.tcpconnect(host, port, opts)
   if not handle then
     return handle, err
   end
-  return wrap_handle(handle)
+  return tcpconnect_tls(wrap_handle(handle), host, opts)
 end
 
 local listener_methods = {}
@@ -224,12 +407,38 @@ function listener_methods:accept()
     if handle == nil then
       return handle, err
     elseif handle then
-      return wrap_handle(handle)
+      return wrap_accepted_handle(handle)
+    end
+    wait_posix.wait_fd_read(nbio_listener.fd)
+  end
+end
+
+function listener_methods:accept_many(maxcount)
+  local nbio_listener = self.nbio_listener
+  while true do
+    local handles = table.pack(nbio_listener:accept_many(maxcount))
+    local first = handles[1]
+    if first == nil then
+      return nil, handles[2]
+    elseif first then
+      for i = 1, handles.n do
+        handles[i] = wrap_accepted_handle(handles[i])
+      end
+      handles.n = nil
+      return handles
     end
     wait_posix.wait_fd_read(nbio_listener.fd)
   end
 end
 
+function listener_methods:setopt(name, value)
+  return self.nbio_listener:setopt(name, value)
+end
+
+function listener_methods:getopt(name)
+  return self.nbio_listener:getopt(name)
+end
+
 local function wrap_listener(listener)
   return setmetatable({ nbio_listener = listener }, listener_metatable)
 end
@@ -250,13 +459,149 @@ function _M.tcplisten(...)
   return wrap_listener(listener)
 end
 
+local udp_methods = {}
+_M.udp_methods = udp_methods
+
+function udp_methods:close()
+  local nbio_udp = self.nbio_udp
+  local fd = nbio_udp.fd
+  if fd then
+    wait_posix.deregister_fd(fd)
+  end
+  nbio_udp:close()
+end
+
+local udp_metatable = {
+  __close = udp_methods.close,
+  -- NOTE: Closing is not possible during garbage collection, because closing
+  -- requires the deregister_fd effect to be handled. The following line is
+  -- thus commented out.
+  --__gc = udp_methods.close,
+  __index = udp_methods,
+}
+_M.udp_metatable = udp_metatable
+
+function udp_methods:send(data, addr, port)
+  local nbio_udp = self.nbio_udp
+  while true do
+    local result, errmsg = nbio_udp:send(data, addr, port)
+    if result then
+      return true
+    elseif result == nil then
+      return nil, errmsg
+    end
+    wait_posix.wait_fd_write(nbio_udp.fd)
+  end
+end
+
+function udp_methods:send_many(datagrams, addrs, ports)
+  local nbio_udp = self.nbio_udp
+  local pos = 1
+  local count = #datagrams
+  while pos <= count do
+    local result, errmsg = nbio_udp:send_many(datagrams, addrs, ports, pos)
+    if not result then
+      return nil, errmsg
+    end
+    pos = pos + result
+    if result == 0 then
+      wait_posix.wait_fd_write(nbio_udp.fd)
+    end
+  end
+  return true
+end
+
+function udp_methods:recv(maxlen)
+  local nbio_udp = self.nbio_udp
+  while true do
+    local data, addr, port, truncated = nbio_udp:recv(maxlen)
+    if data then
+      return data, addr, port, truncated
+    elseif data == nil then
+      return nil, addr
+    end
+    wait_posix.wait_fd_read(nbio_udp.fd)
+  end
+end
+
+function udp_methods:recv_many(maxcount, maxlen)
+  local nbio_udp = self.nbio_udp
+  while true do
+    local datagrams, addrs, ports, truncated =
+      nbio_udp:recv_many(maxcount, maxlen)
+    if datagrams then
+      return datagrams, addrs, ports, truncated
+    elseif datagrams == nil then
+      return nil, addrs
+    end
+    wait_posix.wait_fd_read(nbio_udp.fd)
+  end
+end
+
+function udp_methods:setopt(name, value)
+  return self.nbio_udp:setopt(name, value)
+end
+
+function udp_methods:getopt(name)
+  return self.nbio_udp:getopt(name)
+end
+
+local function wrap_udp(udp)
+  return setmetatable({ nbio_udp = udp }, udp_metatable)
+end
+
+function _M.udpbind(...)
+  local udp, err = nbio.udpbind(...)
+  if not udp then
+    return udp, err
+  end
+  return wrap_udp(udp)
+end
+
+function _M.udpconnect(...)
+  local udp, err = nbio.udpconnect(...)
+  if not udp then
+    return udp, err
+  end
+  return wrap_udp(udp)
+end
+
+function _M.pump(src, dst, opts)
+  local length = opts and opts.length
+  local src_handle, dst_handle = src.nbio_handle, dst.nbio_handle
+  local pump <close> = nbio.pump(src_handle, dst_handle, length)
+  local total = 0
+  while true do
+    local result, status = pump:step()
+    if not result then
+      return result, status
+    end
+    total = total + result
+    if status == "read" then
+      wait_posix.wait_fd_read(src_handle.fd)
+    elseif status == "write" then
+      wait_posix.wait_fd_write(dst_handle.fd)
+    else
+      break
+    end
+  end
+  if opts and opts.shutdown then
+    local result, errmsg = dst:shutdown()
+    if not result then
+      return result, errmsg
+    end
+  end
+  return total
+end
+
 local child_methods = {}
 _M.child_methods = child_methods
 
 function child_methods:close()
-  self.stdin:close()
-  self.stdout:close()
-  self.stderr:close()
+  -- Streams that are not connected with the parent process are nil:
+  if self.stdin then self.stdin:close() end
+  if self.stdout then self.stdout:close() end
+  if self.stderr then self.stderr:close() end
   return self.nbio_child:close()
 end
 
@@ -289,25 +634,42 @@ function child_methods:wait()
 end
 
 local function wrap_child(child)
+  local stdin, stdout, stderr = child.stdin, child.stdout, child.stderr
   return setmetatable(
     {
       nbio_child = child,
-      stdin = wrap_handle(child.stdin),
-      stdout = wrap_handle(child.stdout),
-      stderr = wrap_handle(child.stderr),
+      stdin = stdin and wrap_handle(stdin),
+      stdout = stdout and wrap_handle(stdout),
+      stderr = stderr and wrap_handle(stderr),
     },
     child_metatable
   )
 end
 
-function _M.execute(...)
-  local child, err = nbio.execute(...)
+local stdio_names = { "stdin", "stdout", "stderr" }
+
+function _M.execute(opts, ...)
+  if type(opts) == "table" then
+    -- Replace I/O handles with the underlying nbio handles:
+    local nbio_opts = { pipe_size = opts.pipe_size }
+    for _, name in ipairs(stdio_names) do
+      local value = opts[name]
+      if type(value) == "table" and value.nbio_handle then
+        value = value.nbio_handle
+      end
+      nbio_opts[name] = value
+    end
+    opts = nbio_opts
+  end
+  local child, err = nbio.execute(opts, ...)
   if not child then
     return child, err
   end
   return wrap_child(child)
 end
 
+_M.buffer = nbio.buffer
+_M.tls_context = nbio.tls_context
 _M.timeout = wait.timeout
 _M.interval = wait.interval
 _M.catch_signal = wait_posix.catch_signal
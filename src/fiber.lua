@@ -310,10 +310,10 @@ local function scope(...)
   -- Effect handlers:
   local handlers = {
     -- Effect resuming with a handle of the currently running fiber:
-    [try_current] = function(resume)
-      -- Resume with handle of current fiber:
-      return resume(current_fiber)
-    end,
+    [try_current] = effect.direct(function()
+      -- Return handle of current fiber:
+      return current_fiber
+    end),
     -- Effect putting the currently running fiber to sleep:
     [sleep] = function(resume)
       -- Store continuation:
@@ -339,9 +339,9 @@ local function scope(...)
       end
     end,
     -- Effect spawning a new fiber:
-    [spawn] = function(resume, ...)
-      return resume:call(spawn_impl, ...)
-    end,
+    [spawn] = effect.direct(function(...)
+      return spawn_impl(...)
+    end),
   }
   -- Implementation of spawn function for current scheduler:
   function spawn_impl(func, ...)
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <sys/event.h>
 #include <signal.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -457,8 +458,19 @@ static const struct luaL_Reg lkq_queue_metamethods[] = {
   {NULL, NULL}
 };
 
+static int lkq_monotime(lua_State *L) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    lkq_prepare_errmsg(errno);
+    return luaL_error(L, "could not read monotonic clock: %s", errmsg);
+  }
+  lua_pushnumber(L, ts.tv_sec + ts.tv_nsec / 1e9);
+  return 1;
+}
+
 static const struct luaL_Reg lkq_module_funcs[] = {
   {"new_queue", lkq_new_queue},
+  {"monotime", lkq_monotime},
   {NULL, NULL}
 };
 
@@ -12,6 +12,7 @@
 #endif
 
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -24,7 +25,23 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <signal.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+// Child processes are started with posix_spawn where the C library reports
+// exec errors to the caller and can close inherited file descriptors (glibc
+// 2.34 and later, which uses clone with CLONE_VM and CLONE_VFORK), such that
+// the cost does not depend on the memory size of the parent; fork is used
+// otherwise:
+#if defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define NBIO_USE_POSIX_SPAWN
+#include <spawn.h>
+extern char **environ;
+#endif
 
 // On platforms without SO_NOSIGPIPE, SIGPIPE needs to be ignored process-wide:
 #ifndef SO_NOSIGPIPE
@@ -34,10 +51,56 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+// TLS support is enabled by defining NBIO_USE_OPENSSL (see Makefile.options):
+#if defined(NBIO_USE_OPENSSL)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+#error OpenSSL 1.1.1 or newer is required for TLS support.
+#endif
+#endif
+
+// On Linux, MSG_MORE is passed to send calls instead of toggling TCP_CORK:
+#if defined(MSG_MORE) && defined(TCP_CORK) && !defined(TCP_NOPUSH)
+#define NBIO_USE_MSG_MORE
+#endif
+
+// Use recvmmsg and sendmmsg to transfer several datagrams per system call:
+#if defined(__linux__) || defined(__FreeBSD__)
+#define NBIO_USE_MMSG
+#endif
+
 // Preferred chunk size:
 #define NBIO_CHUNKSIZE 8192
 
-// Backlog for incoming connections:
+// Number of size classes of buffer pool (NBIO_CHUNKSIZE times powers of two,
+// larger buffers are never pooled):
+#define NBIO_POOL_CLASSES 6
+
+// Maximum number of bytes kept per size class of buffer pool:
+#define NBIO_POOL_CLASS_MAXBYTES (1024*1024)
+
+// Maximum number of strings passed to a single writev call:
+#define NBIO_WRITEV_MAXCNT 64
+
+// Maximum number of datagrams sent or received by a single call:
+#define NBIO_DATAGRAM_MAXCNT 64
+
+// Maximum size of received datagrams (default for single receive):
+#define NBIO_DATAGRAM_MAXLEN 65535
+
+// Default maximum size of datagrams received in batches:
+#define NBIO_DATAGRAM_BATCH_MAXLEN 2048
+
+// Maximum number of plaintext bytes in a TLS record (small strings passed to
+// writev are combined up to this size when encrypting in user space):
+#define NBIO_TLS_RECORD_MAXLEN 16384
+
+// Maximum number of bytes transferred by a single sendfile call:
+#define NBIO_SENDFILE_MAXLEN (1024*1024)
+
+// Default backlog for incoming connections:
 #define NBIO_LISTEN_BACKLOG 256
 
 // Default flags when opening files:
@@ -63,17 +126,41 @@
 #define NBIO_HANDLE_MT_REGKEY "nbio_handle"
 #define NBIO_LISTENER_MT_REGKEY "nbio_listener"
 #define NBIO_CHILD_MT_REGKEY "nbio_child"
+#define NBIO_PUMP_MT_REGKEY "nbio_pump"
+#define NBIO_BUFFER_MT_REGKEY "nbio_buffer"
+#define NBIO_UDP_MT_REGKEY "nbio_udp"
+#define NBIO_TLS_CONTEXT_MT_REGKEY "nbio_tls_context"
 
 // Upvalue indices used by metamethods to access method tables:
 #define NBIO_HANDLE_METHODS_UPIDX 1
 #define NBIO_LISTENER_METHODS_UPIDX 1
 #define NBIO_CHILD_METHODS_UPIDX 1
+#define NBIO_UDP_METHODS_UPIDX 1
+
+// Uservalue indices used by pumps to reference source and destination:
+#define NBIO_PUMP_SRC_UVIDX 1
+#define NBIO_PUMP_DST_UVIDX 2
+#define NBIO_PUMP_UVCNT 2
+
+// Index of uservalue of a buffer view referring to the parent buffer:
+#define NBIO_BUFFER_PARENT_UVIDX 1
+#define NBIO_BUFFER_UVCNT 1
+
+// Maximum number of bytes moved into the pipe of a pump by a single call:
+#define NBIO_PUMP_SPLICE_MAXLEN (1024*1024)
 
 // States of an I/O handle (SHUTDOWN means only sending part is closed):
 #define NBIO_STATE_OPEN 0
 #define NBIO_STATE_SHUTDOWN 1
 #define NBIO_STATE_CLOSED 2
 
+// Socket address of an IPv4 or IPv6 peer:
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+} nbio_sockaddr_t;
+
 // I/O handle:
 typedef struct {
   int state; // see NBIO_STATE_ constants
@@ -84,13 +171,21 @@ typedef struct {
   size_t readbuf_capacity; // number of bytes allocated for read buffer
   size_t readbuf_written; // number of bytes written to read buffer
   size_t readbuf_read; // number of bytes read from read buffer
-  int readbuf_checked_terminator; // -1 or uchar of terminator not in readbuf
+  char *readbuf_terminator; // copy of last searched terminator (or NULL)
+  size_t readbuf_terminator_len; // length of last searched terminator
+  size_t readbuf_checked; // position in readbuf before which no terminator
+                          // starts (only valid if >= readbuf_read)
   void *writebuf; // allocated write buffer (or NULL if not allocated)
   size_t writebuf_written; // number of bytes written to write buffer
   size_t writebuf_read; // number of bytes read from write buffer
   int nopush; // state of TCP_NOPUSH or TCP_CORK: 0=off, 1=on, -1=unknown
-  char peer_addr[INET6_ADDRSTRLEN];
-  int peer_port;
+              // (with MSG_MORE: 1 if last send used MSG_MORE)
+  nbio_sockaddr_t peer; // peer address (sa_family is AF_UNSPEC if unknown)
+  char peer_addr[INET6_ADDRSTRLEN]; // formatted on first use (or empty)
+#if defined(NBIO_USE_OPENSSL)
+  SSL *ssl; // TLS connection (or NULL if TLS is not used)
+  int ktls_send; // non-zero if kernel encrypts sent data (kTLS)
+#endif
 } nbio_handle_t;
 
 // Listener handle:
@@ -99,12 +194,180 @@ typedef struct {
   sa_family_t addrfam; // address family (AF_LOCAL, AF_INET, AF_INET6)
 } nbio_listener_t;
 
+#if defined(NBIO_USE_OPENSSL)
+// TLS context (shared by several TLS connections):
+typedef struct {
+  SSL_CTX *ctx; // OpenSSL context (or NULL if freed)
+  int server; // non-zero for server side of connections
+} nbio_tls_context_t;
+#endif
+
+// Datagram socket handle:
+typedef struct {
+  int fd; // file descriptor, set to -1 when closed
+  sa_family_t addrfam; // address family (AF_INET or AF_INET6)
+  char *recvbuf; // receive buffer borrowed during receiving (or NULL)
+  size_t recvbuf_capacity; // number of bytes allocated for receive buffer
+} nbio_udp_t;
+
 // Child process handle:
 typedef struct {
   pid_t pid; // process ID or -1 when child status has been fetched
   int status; // waitpid status, valid when pid is set to -1
 } nbio_child_t;
 
+// Pump transferring data from one I/O handle to another:
+typedef struct {
+  int pipe_fds[2]; // pipe used for splicing (-1 if not splicing)
+  size_t pipe_fill; // number of bytes in pipe
+  char *buf; // buffer used if splicing is unsupported (or NULL)
+  size_t buf_written; // number of bytes written to buffer
+  size_t buf_read; // number of bytes read from buffer
+  int eof; // non-zero if source reported EOF
+  lua_Integer remaining; // remaining bytes to transfer or -1 for unlimited
+} nbio_pump_t;
+
+// Byte buffer (or view on a range of another byte buffer):
+typedef struct {
+  char *data; // allocated memory (or NULL if not allocated or if view)
+  size_t capacity; // number of bytes allocated
+  size_t start; // position of first byte (in memory of parent if view)
+  size_t end; // position after last byte (in memory of parent if view)
+  lua_Integer generation; // incremented when data is moved (parent's if view)
+  int view; // non-zero if view on parent buffer (stored as uservalue)
+} nbio_buffer_t;
+
+// Unused buffer in buffer pool:
+typedef struct nbio_pool_entry {
+  struct nbio_pool_entry *next;
+} nbio_pool_entry_t;
+
+// Buffer pool (one per thread, as Lua states are not shared between threads)
+// from which I/O handles borrow read and write buffers while holding data:
+static _Thread_local struct {
+  nbio_pool_entry_t *entries[NBIO_POOL_CLASSES]; // linked lists per class
+  size_t count[NBIO_POOL_CLASSES]; // number of unused buffers per class
+  size_t borrowed; // number of bytes currently borrowed
+} nbio_pool;
+
+// Returns size class for a buffer capacity (or -1 if not a pooled size):
+static int nbio_pool_class(size_t capacity) {
+  size_t size = NBIO_CHUNKSIZE;
+  for (int i=0; i<NBIO_POOL_CLASSES; i++, size *= 2) {
+    if (capacity == size) return i;
+  }
+  return -1;
+}
+
+// Borrows buffer with at least the given capacity from buffer pool, stores
+// its actual capacity and returns it (or NULL on allocation failure):
+static void *nbio_pool_acquire(size_t needed, size_t *capacity) {
+  size_t size = NBIO_CHUNKSIZE;
+  void *buf;
+  for (int i=0; i<NBIO_POOL_CLASSES; i++, size *= 2) {
+    if (needed <= size) {
+      nbio_pool_entry_t *entry = nbio_pool.entries[i];
+      if (entry) {
+        nbio_pool.entries[i] = entry->next;
+        nbio_pool.count[i]--;
+        buf = entry;
+      } else {
+        buf = malloc(size);
+        if (!buf) return NULL;
+      }
+      *capacity = size;
+      nbio_pool.borrowed += size;
+      return buf;
+    }
+  }
+  // oversized buffers are allocated individually:
+  buf = malloc(needed);
+  if (!buf) return NULL;
+  *capacity = needed;
+  nbio_pool.borrowed += needed;
+  return buf;
+}
+
+// Returns buffer to buffer pool (oversized buffers and buffers exceeding
+// NBIO_POOL_CLASS_MAXBYTES are freed):
+static void nbio_pool_release(void *buf, size_t capacity) {
+  if (!buf) return;
+  nbio_pool.borrowed -= capacity;
+  int class = nbio_pool_class(capacity);
+  if (
+    class >= 0 &&
+    (nbio_pool.count[class] + 1) * capacity <= NBIO_POOL_CLASS_MAXBYTES
+  ) {
+    nbio_pool_entry_t *entry = buf;
+    entry->next = nbio_pool.entries[class];
+    nbio_pool.entries[class] = entry;
+    nbio_pool.count[class]++;
+  } else {
+    free(buf);
+  }
+}
+
+// Returns number of bytes borrowed from buffer pool and number of bytes kept
+// in buffer pool for reuse (of the current thread):
+static int nbio_buffer_stats(lua_State *L) {
+  size_t pooled = 0;
+  size_t size = NBIO_CHUNKSIZE;
+  for (int i=0; i<NBIO_POOL_CLASSES; i++, size *= 2) {
+    pooled += nbio_pool.count[i] * size;
+  }
+  lua_pushinteger(L, nbio_pool.borrowed);
+  lua_pushinteger(L, pooled);
+  return 2;
+}
+
+// Ensures that read buffer has space for the given number of bytes after
+// the buffered data (moving buffered data to the beginning when a larger
+// buffer is borrowed), returns 0 on success or -1 on allocation failure:
+static int nbio_handle_reserve_readbuf(nbio_handle_t *handle, size_t needed) {
+  if (handle->readbuf_capacity - handle->readbuf_written >= needed) return 0;
+  size_t available = handle->readbuf_written - handle->readbuf_read;
+  if (needed > SIZE_MAX - available) return -1;
+  needed += available;
+  size_t newcap = 2 * handle->readbuf_capacity;
+  if (newcap < needed || handle->readbuf_capacity > SIZE_MAX / 2) {
+    newcap = needed;
+  }
+  void *newbuf = nbio_pool_acquire(newcap, &newcap);
+  if (!newbuf) return -1;
+  if (available > 0) {
+    memcpy(newbuf, handle->readbuf + handle->readbuf_read, available);
+  }
+  nbio_pool_release(handle->readbuf, handle->readbuf_capacity);
+  handle->readbuf = newbuf;
+  handle->readbuf_capacity = newcap;
+  if (handle->readbuf_checked > handle->readbuf_read) {
+    handle->readbuf_checked -= handle->readbuf_read;
+  } else {
+    handle->readbuf_checked = 0;
+  }
+  handle->readbuf_written = available;
+  handle->readbuf_read = 0;
+  return 0;
+}
+
+// Marks read buffer as empty and returns its memory to the buffer pool:
+static void nbio_handle_release_readbuf(nbio_handle_t *handle) {
+  nbio_pool_release(handle->readbuf, handle->readbuf_capacity);
+  handle->readbuf = NULL;
+  handle->readbuf_capacity = 0;
+  handle->readbuf_written = 0;
+  handle->readbuf_read = 0;
+  handle->readbuf_checked = 0;
+}
+
+// Marks write buffer as empty and returns its memory to the buffer pool:
+static void nbio_handle_release_writebuf(nbio_handle_t *handle) {
+  nbio_pool_release(handle->writebuf, NBIO_CHUNKSIZE);
+  handle->writebuf = NULL;
+  handle->writebuf_written = 0;
+  handle->writebuf_read = 0;
+}
+
 // Control flushing for TCP connections via TCP_NOPUSH or TCP_CORK:
 static int nbio_handle_set_nopush(nbio_handle_t *handle, int nopush) {
 #if defined(TCP_NOPUSH) || defined(TCP_CORK)
@@ -112,21 +375,143 @@ static int nbio_handle_set_nopush(nbio_handle_t *handle, int nopush) {
     handle->nopush == nopush || handle->shared ||
     !(handle->addrfam == AF_INET6 || handle->addrfam == AF_INET)
   ) return 0;
-#if defined(TCP_NOPUSH)
-  return setsockopt(
+#if defined(NBIO_USE_MSG_MORE)
+  // TCP_CORK is never set, but clearing it pushes out data that has been
+  // sent with MSG_MORE (only needed if last send used MSG_MORE):
+  if (nopush || handle->nopush != 1) return 0;
+  if (setsockopt(
+    handle->fd, IPPROTO_TCP, TCP_CORK, &nopush, sizeof(nopush)
+  )) return -1;
+#elif defined(TCP_NOPUSH)
+  if (setsockopt(
     handle->fd, IPPROTO_TCP, TCP_NOPUSH, &nopush, sizeof(nopush)
-  );
+  )) return -1;
 #elif defined(TCP_CORK)
-  return setsockopt(
+  if (setsockopt(
     handle->fd, IPPROTO_TCP, TCP_CORK, &nopush, sizeof(nopush)
-  );
+  )) return -1;
 #endif
+  handle->nopush = nopush;
+  return 0;
 #else
 #warning Neither TCP_NOPUSH nor TCP_CORK is available.
   return 0;
 #endif
 }
 
+#if defined(NBIO_USE_OPENSSL)
+// Sets errno after a failed TLS operation and returns -1 (errno is EAGAIN if
+// the operation must be repeated), returns 0 on EOF if reading:
+static ssize_t nbio_tls_failed(nbio_handle_t *handle, int result, int reading) {
+  int saved_errno = errno;
+  switch (SSL_get_error(handle->ssl, result)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    break;
+  case SSL_ERROR_ZERO_RETURN:
+    ERR_clear_error();
+    if (reading) return 0;
+    errno = EPIPE;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    errno = saved_errno ? saved_errno : EIO;
+    break;
+  default:
+    errno = EPROTO;
+  }
+  ERR_clear_error();
+  return -1;
+}
+#endif
+
+// Reads data from I/O handle (decrypting if TLS is used), returns number of
+// bytes, 0 on EOF, or -1 on error (with errno set):
+static ssize_t nbio_handle_recv(nbio_handle_t *handle, void *buf, size_t len) {
+#if defined(NBIO_USE_OPENSSL)
+  if (handle->ssl) {
+    size_t readbytes;
+    int result = SSL_read_ex(handle->ssl, buf, len, &readbytes);
+    if (result > 0) return readbytes;
+    return nbio_tls_failed(handle, result, 1);
+  }
+#endif
+  return read(handle->fd, buf, len);
+}
+
+// Writes data to I/O handle, where non-zero "more" indicates that more data
+// will follow (TCP connections then use MSG_MORE where available):
+static ssize_t nbio_handle_send(
+  nbio_handle_t *handle, const void *buf, size_t len, int more
+) {
+#if defined(NBIO_USE_OPENSSL)
+  // With kTLS, the kernel encrypts data passed to send:
+  if (handle->ssl && !handle->ktls_send) {
+    size_t written;
+    if (len == 0) return 0;
+    int result = SSL_write_ex(handle->ssl, buf, len, &written);
+    if (result > 0) return written;
+    return nbio_tls_failed(handle, result, 0);
+  }
+#endif
+#if defined(NBIO_USE_MSG_MORE)
+  if (
+    !handle->shared &&
+    (handle->addrfam == AF_INET6 || handle->addrfam == AF_INET)
+  ) {
+    ssize_t result = send(handle->fd, buf, len, more ? MSG_MORE : 0);
+    if (result >= 0) handle->nopush = more ? 1 : 0;
+    return result;
+  }
+#endif
+  return write(handle->fd, buf, len);
+}
+
+// Vectored variant of nbio_handle_send:
+static ssize_t nbio_handle_sendv(
+  nbio_handle_t *handle, struct iovec *iov, int iovcnt, int more
+) {
+#if defined(NBIO_USE_OPENSSL)
+  if (handle->ssl && !handle->ktls_send) {
+    // Combine small strings to avoid one TLS record per string:
+    char buf[NBIO_TLS_RECORD_MAXLEN];
+    ssize_t total = 0;
+    int i = 0;
+    while (i < iovcnt) {
+      const void *data = iov[i].iov_base;
+      size_t len = iov[i].iov_len;
+      if (len < sizeof(buf)) {
+        len = 0;
+        while (i < iovcnt && len + iov[i].iov_len <= sizeof(buf)) {
+          memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+          len += iov[i++].iov_len;
+        }
+        data = buf;
+      } else {
+        i++;
+      }
+      ssize_t result = nbio_handle_send(handle, data, len, more);
+      if (result < 0) return total > 0 ? total : -1;
+      total += result;
+      if ((size_t)result < len) break;
+    }
+    return total;
+  }
+#endif
+#if defined(NBIO_USE_MSG_MORE)
+  if (
+    !handle->shared &&
+    (handle->addrfam == AF_INET6 || handle->addrfam == AF_INET)
+  ) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t result = sendmsg(handle->fd, &msg, more ? MSG_MORE : 0);
+    if (result >= 0) handle->nopush = more ? 1 : 0;
+    return result;
+  }
+#endif
+  return writev(handle->fd, iov, iovcnt);
+}
+
 // Lua function allocating memory for an I/O handle
 // (as separate function to allow catching out-of-memory errors):
 static int nbio_create_handle_udata(lua_State *L) {
@@ -206,13 +591,19 @@ static int nbio_push_handle(
   handle->readbuf_capacity = 0;
   handle->readbuf_written = 0;
   handle->readbuf_read = 0;
-  handle->readbuf_checked_terminator = -1;
+  handle->readbuf_terminator = NULL;
+  handle->readbuf_terminator_len = 0;
+  handle->readbuf_checked = 0;
   handle->writebuf = NULL;
   handle->writebuf_written = 0;
   handle->writebuf_read = 0;
   handle->nopush = -1;
+  handle->peer.sa.sa_family = AF_UNSPEC;
   handle->peer_addr[0] = 0;
-  handle->peer_port = -1;
+#if defined(NBIO_USE_OPENSSL)
+  handle->ssl = NULL;
+  handle->ktls_send = 0;
+#endif
   luaL_setmetatable(L, NBIO_HANDLE_MT_REGKEY);
   return 1;
 }
@@ -221,12 +612,17 @@ static int nbio_push_handle(
 static int nbio_handle_close(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
   handle->state = NBIO_STATE_CLOSED;
+#if defined(NBIO_USE_OPENSSL)
+  SSL_free(handle->ssl);
+  handle->ssl = NULL;
+#endif
   if (handle->fd != -1 && !handle->shared) close(handle->fd);
   handle->fd = -1;
-  free(handle->readbuf);
-  handle->readbuf = NULL;
-  free(handle->writebuf);
-  handle->writebuf = NULL;
+  nbio_handle_release_readbuf(handle);
+  free(handle->readbuf_terminator);
+  handle->readbuf_terminator = NULL;
+  handle->readbuf_terminator_len = 0;
+  nbio_handle_release_writebuf(handle);
   return 0;
 }
 
@@ -236,6 +632,13 @@ static int nbio_handle_shutdown(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
   if (handle->state == NBIO_STATE_OPEN) {
     handle->state = NBIO_STATE_SHUTDOWN;
+#if defined(NBIO_USE_OPENSSL)
+    // Send close_notify alert (without waiting for the peer's alert):
+    if (handle->ssl && SSL_is_init_finished(handle->ssl)) {
+      SSL_shutdown(handle->ssl);
+      ERR_clear_error();
+    }
+#endif
     if (handle->addrfam == AF_INET6 || handle->addrfam == AF_INET) {
       if (handle->writebuf_written == 0) {
         struct linger lingerval = { 0, };
@@ -266,10 +669,7 @@ static int nbio_handle_shutdown(lua_State *L) {
       }
       handle->fd = -1;
     }
-    free(handle->writebuf);
-    handle->writebuf = NULL;
-    handle->writebuf_written = 0;
-    handle->writebuf_read = 0;
+    nbio_handle_release_writebuf(handle);
   }
   lua_pushboolean(L, 1);
   return 1;
@@ -367,11 +767,187 @@ static int nbio_localconnect(lua_State *L) {
   return nbio_push_handle(L, fd, AF_LOCAL, 0, 1);
 }
 
+// Socket option that can be set through options tables or setopt/getopt:
+typedef struct {
+  const char *name; // name used in Lua
+  const char *label; // name of C constant used in error messages
+  int level; // protocol level or -1 if unsupported on this platform
+  int optname; // option name passed to setsockopt/getsockopt
+  int boolean; // non-zero if option is a flag (otherwise integer)
+} nbio_sockopt_t;
+
+static const nbio_sockopt_t nbio_sockopts[] = {
+  {"nodelay", "TCP_NODELAY", IPPROTO_TCP, TCP_NODELAY, 1},
+  {"keepalive", "SO_KEEPALIVE", SOL_SOCKET, SO_KEEPALIVE, 1},
+#if defined(TCP_KEEPIDLE)
+  {"keepidle", "TCP_KEEPIDLE", IPPROTO_TCP, TCP_KEEPIDLE, 0},
+#elif defined(TCP_KEEPALIVE)
+  // macOS uses different name:
+  {"keepidle", "TCP_KEEPALIVE", IPPROTO_TCP, TCP_KEEPALIVE, 0},
+#else
+  {"keepidle", "TCP_KEEPIDLE", -1, 0, 0},
+#endif
+#if defined(TCP_KEEPINTVL)
+  {"keepintvl", "TCP_KEEPINTVL", IPPROTO_TCP, TCP_KEEPINTVL, 0},
+#else
+  {"keepintvl", "TCP_KEEPINTVL", -1, 0, 0},
+#endif
+#if defined(TCP_KEEPCNT)
+  {"keepcnt", "TCP_KEEPCNT", IPPROTO_TCP, TCP_KEEPCNT, 0},
+#else
+  {"keepcnt", "TCP_KEEPCNT", -1, 0, 0},
+#endif
+  {"sndbuf", "SO_SNDBUF", SOL_SOCKET, SO_SNDBUF, 0},
+  {"rcvbuf", "SO_RCVBUF", SOL_SOCKET, SO_RCVBUF, 0},
+#if defined(TCP_NOTSENT_LOWAT)
+  {"notsent_lowat", "TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT, 0},
+#else
+  {"notsent_lowat", "TCP_NOTSENT_LOWAT", -1, 0, 0},
+#endif
+#if defined(TCP_FASTOPEN)
+  {"fastopen", "TCP_FASTOPEN", IPPROTO_TCP, TCP_FASTOPEN, 0},
+#else
+  {"fastopen", "TCP_FASTOPEN", -1, 0, 0},
+#endif
+#if defined(TCP_FASTOPEN_CONNECT)
+  {"fastopen_connect", "TCP_FASTOPEN_CONNECT",
+    IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1},
+#else
+  {"fastopen_connect", "TCP_FASTOPEN_CONNECT", -1, 0, 1},
+#endif
+#if defined(SO_BUSY_POLL)
+  {"busy_poll", "SO_BUSY_POLL", SOL_SOCKET, SO_BUSY_POLL, 0},
+#else
+  {"busy_poll", "SO_BUSY_POLL", -1, 0, 0},
+#endif
+  {NULL, NULL, 0, 0, 0}
+};
+
+// Returns socket option with given name or NULL if unknown:
+static const nbio_sockopt_t *nbio_find_sockopt(const char *name) {
+  const nbio_sockopt_t *opt;
+  for (opt = nbio_sockopts; opt->name; opt++) {
+    if (!strcmp(opt->name, name)) return opt;
+  }
+  return NULL;
+}
+
+// Converts value of socket option at given stack index to an int or raises
+// an error for argument argidx:
+static int nbio_sockopt_value(lua_State *L, const nbio_sockopt_t *opt,
+  int idx, int argidx
+) {
+  if (opt->boolean) return lua_toboolean(L, idx);
+  int isnum;
+  lua_Integer value = lua_tointegerx(L, idx, &isnum);
+  if (!isnum || value < INT_MIN || value > INT_MAX) {
+    luaL_argerror(L, argidx, lua_pushfstring(L,
+      "socket option %s must be an integer", opt->name
+    ));
+  }
+  return value;
+}
+
+// Checks socket options in optional table at given stack index before a
+// socket is created (such that setting them later does not raise errors),
+// returns zero on success or pushes nil and an error message and returns 2:
+static int nbio_check_sockopts(lua_State *L, int idx) {
+  const nbio_sockopt_t *opt;
+  if (lua_isnoneornil(L, idx)) return 0;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  for (opt = nbio_sockopts; opt->name; opt++) {
+    if (lua_getfield(L, idx, opt->name) != LUA_TNIL) {
+      // like with defer_accept, disabling an unsupported option is no error:
+      if (nbio_sockopt_value(L, opt, -1, idx) && opt->level == -1) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s socket option not supported", opt->label);
+        return 2;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+// Sets socket options from optional table at given stack index (previously
+// checked with nbio_check_sockopts), returns zero on success or pushes nil
+// and an error message and returns 2 (file descriptor is not closed):
+static int nbio_apply_sockopts(lua_State *L, int fd, int idx) {
+  const nbio_sockopt_t *opt;
+  if (lua_isnoneornil(L, idx)) return 0;
+  for (opt = nbio_sockopts; opt->name; opt++) {
+    if (lua_getfield(L, idx, opt->name) != LUA_TNIL && opt->level != -1) {
+      int val = nbio_sockopt_value(L, opt, -1, idx);
+      if (setsockopt(fd, opt->level, opt->optname, &val, sizeof(val))) {
+        nbio_prepare_errmsg(errno);
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_pushfstring(L,
+          "cannot set %s socket option: %s", opt->label, errmsg
+        );
+        return 2;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+// Sets socket option of open file descriptor (used for I/O and listener
+// handles):
+static int nbio_setopt_impl(lua_State *L, int fd) {
+  const nbio_sockopt_t *opt = nbio_find_sockopt(luaL_checkstring(L, 2));
+  if (!opt) return luaL_argerror(L, 2, "unknown socket option");
+  luaL_checkany(L, 3);
+  int val = nbio_sockopt_value(L, opt, 3, 3);
+  if (opt->level == -1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s socket option not supported", opt->label);
+    return 2;
+  }
+  if (setsockopt(fd, opt->level, opt->optname, &val, sizeof(val))) {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushfstring(L,
+      "cannot set %s socket option: %s", opt->label, errmsg
+    );
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// Gets socket option of open file descriptor (used for I/O and listener
+// handles):
+static int nbio_getopt_impl(lua_State *L, int fd) {
+  const nbio_sockopt_t *opt = nbio_find_sockopt(luaL_checkstring(L, 2));
+  if (!opt) return luaL_argerror(L, 2, "unknown socket option");
+  if (opt->level == -1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s socket option not supported", opt->label);
+    return 2;
+  }
+  int val = 0;
+  socklen_t len = sizeof(val);
+  if (getsockopt(fd, opt->level, opt->optname, &val, &len)) {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushfstring(L,
+      "cannot get %s socket option: %s", opt->label, errmsg
+    );
+    return 2;
+  }
+  if (opt->boolean) lua_pushboolean(L, val);
+  else lua_pushinteger(L, val);
+  return 1;
+}
+
 // Initiate TCP connection and return I/O handle (may block on DNS resolving):
 static int nbio_tcpconnect(lua_State *L) {
   const char *host, *port;
   host = luaL_checkstring(L, 1);
   port = luaL_checkstring(L, 2);
+  if (nbio_check_sockopts(L, 3)) return 2;
   struct addrinfo hints = { 0, };
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
@@ -411,6 +987,11 @@ static int nbio_tcpconnect(lua_State *L) {
     lua_pushstring(L, errmsg);
     return 2;
   }
+  if (nbio_apply_sockopts(L, fd, 3)) {
+    freeaddrinfo(res);
+    close(fd);
+    return 2;
+  }
   int addrfam = addrinfo->ai_family;
   if (connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen)) {
     freeaddrinfo(res);
@@ -427,10 +1008,124 @@ static int nbio_tcpconnect(lua_State *L) {
   return nbio_push_handle(L, fd, addrfam, 0, 1);
 }
 
+// Resolve host name and return sequence of numeric addresses for TCP
+// connections, alternating between address families (starting with the
+// family of the first address), as recommended by RFC 8305 (may block):
+static int nbio_tcpresolve(lua_State *L) {
+  const char *host, *port;
+  host = luaL_checkstring(L, 1);
+  port = luaL_optstring(L, 2, NULL);
+  struct addrinfo hints = { 0, };
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = AI_ADDRCONFIG;
+  struct addrinfo *res;
+  int errcode = getaddrinfo(host, port, &hints, &res);
+  if (errcode) {
+    if (errcode == EAI_SYSTEM) {
+      nbio_prepare_errmsg(errno);
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", gai_strerror(errcode), errmsg);
+    } else {
+      lua_pushnil(L);
+      lua_pushstring(L, gai_strerror(errcode));
+    }
+    return 2;
+  }
+  // Collect addresses of each family in tables at stack positions 3 and 4
+  // before merging them into result table at stack position 5:
+  lua_settop(L, 2);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_Integer count[2] = { 0, 0 };
+  int first = -1;
+  struct addrinfo *addrinfo;
+  for (addrinfo=res; addrinfo; addrinfo=addrinfo->ai_next) {
+    char buf[INET6_ADDRSTRLEN];
+    const void *addr;
+    int fam;
+    if (addrinfo->ai_family == AF_INET6) {
+      addr = &((struct sockaddr_in6 *)addrinfo->ai_addr)->sin6_addr;
+      fam = 0;
+    } else if (addrinfo->ai_family == AF_INET) {
+      addr = &((struct sockaddr_in *)addrinfo->ai_addr)->sin_addr;
+      fam = 1;
+    } else {
+      continue;
+    }
+    if (!inet_ntop(addrinfo->ai_family, addr, buf, sizeof(buf))) continue;
+    if (first == -1) first = fam;
+    lua_pushstring(L, buf);
+    lua_rawseti(L, 3 + fam, ++count[fam]);
+  }
+  freeaddrinfo(res);
+  if (first == -1) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no IPv4 or IPv6 address found");
+    return 2;
+  }
+  lua_Integer n = 0;
+  for (lua_Integer i=1; i<=count[0] || i<=count[1]; i++) {
+    for (int j=0; j<2; j++) {
+      int fam = j ? !first : first;
+      if (i <= count[fam]) {
+        lua_rawgeti(L, 3 + fam, i);
+        lua_rawseti(L, 5, ++n);
+      }
+    }
+  }
+  return 1;
+}
+
+// Options for listening sockets:
+typedef struct {
+  int backlog; // backlog for incoming connections
+  int reuseport; // non-zero to set SO_REUSEPORT (or SO_REUSEPORT_LB)
+  int defer_accept; // seconds to wait for data before accepting or zero
+} nbio_listen_opts_t;
+
+// Reads options for listening sockets from optional table at given stack
+// index:
+static void nbio_get_listen_opts(lua_State *L, int idx,
+  nbio_listen_opts_t *opts
+) {
+  opts->backlog = NBIO_LISTEN_BACKLOG;
+  opts->reuseport = 0;
+  opts->defer_accept = 0;
+  if (lua_isnoneornil(L, idx)) return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  if (lua_getfield(L, idx, "backlog") != LUA_TNIL) {
+    int isnum;
+    lua_Integer backlog = lua_tointegerx(L, -1, &isnum);
+    if (!isnum || backlog <= 0) {
+      luaL_argerror(L, idx, "backlog must be a positive integer");
+    }
+    opts->backlog = backlog > INT_MAX ? INT_MAX : backlog;
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "reuseport");
+  opts->reuseport = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (lua_getfield(L, idx, "defer_accept") != LUA_TNIL) {
+    int isnum;
+    lua_Integer seconds = lua_tointegerx(L, -1, &isnum);
+    if (!isnum || seconds < 0) {
+      luaL_argerror(L, idx, "defer_accept must be a non-negative integer");
+    }
+    opts->defer_accept = seconds > INT_MAX ? INT_MAX : seconds;
+  }
+  lua_pop(L, 1);
+}
+
 // Listen on local socket and return listener handle:
 static int nbio_locallisten(lua_State *L) {
   const char *path;
   path = luaL_checkstring(L, 1);
+  nbio_listen_opts_t opts;
+  nbio_get_listen_opts(L, 2, &opts);
+  if (nbio_check_sockopts(L, 2)) return 2;
   if (strlen(path) > NBIO_SUN_PATH_MAXLEN) {
     return luaL_error(L,
       "path too long; only %d characters allowed",
@@ -450,6 +1145,10 @@ static int nbio_locallisten(lua_State *L) {
     lua_pushstring(L, errmsg);
     return 2;
   }
+  if (nbio_apply_sockopts(L, fd, 2)) {
+    close(fd);
+    return 2;
+  }
   if (bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr))) {
     nbio_prepare_errmsg(errno);
     close(fd);
@@ -464,7 +1163,7 @@ static int nbio_locallisten(lua_State *L) {
     lua_pushstring(L, errmsg);
     return 2;
   }
-  if (listen(fd, NBIO_LISTEN_BACKLOG)) {
+  if (listen(fd, opts.backlog)) {
     nbio_prepare_errmsg(errno);
     close(fd);
     lua_pushnil(L);
@@ -483,6 +1182,16 @@ static int nbio_tcplisten(lua_State *L) {
   const char *host, *port;
   host = luaL_optstring(L, 1, NULL);
   port = luaL_checkstring(L, 2);
+  nbio_listen_opts_t opts;
+  nbio_get_listen_opts(L, 3, &opts);
+  if (nbio_check_sockopts(L, 3)) return 2;
+#if !defined(TCP_DEFER_ACCEPT)
+  if (opts.defer_accept) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "TCP_DEFER_ACCEPT socket option not supported");
+    return 2;
+  }
+#endif
   struct addrinfo hints = { 0, };
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
@@ -533,28 +1242,66 @@ static int nbio_tcplisten(lua_State *L) {
       return 2;
     }
   }
-  if (addrinfo->ai_family == AF_INET6) {
-    const int val = (host != NULL) ? 1 : 0;
-    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val))) {
+  if (opts.reuseport) {
+    static const int val = 1;
+#if defined(SO_REUSEPORT_LB)
+    // distribute connections among sockets on FreeBSD:
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &val, sizeof(val))) {
+#else
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+#endif
       nbio_prepare_errmsg(errno);
       freeaddrinfo(res);
       close(fd);
       lua_pushnil(L);
-      lua_pushfstring(L, "cannot set IPV6_V6ONLY socket option: %s", errmsg);
+      lua_pushfstring(L, "cannot set SO_REUSEPORT socket option: %s", errmsg);
       return 2;
     }
   }
-  if (bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen)) {
-    nbio_prepare_errmsg(errno);
-    freeaddrinfo(res);
-    close(fd);
-    lua_pushnil(L);
-    lua_pushstring(L, errmsg);
-    return 2;
-  }
+#if defined(TCP_DEFER_ACCEPT)
+  if (opts.defer_accept) {
+    if (setsockopt(
+      fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+      &opts.defer_accept, sizeof(opts.defer_accept)
+    )) {
+      nbio_prepare_errmsg(errno);
+      freeaddrinfo(res);
+      close(fd);
+      lua_pushnil(L);
+      lua_pushfstring(L,
+        "cannot set TCP_DEFER_ACCEPT socket option: %s", errmsg
+      );
+      return 2;
+    }
+  }
+#endif
+  if (addrinfo->ai_family == AF_INET6) {
+    const int val = (host != NULL) ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val))) {
+      nbio_prepare_errmsg(errno);
+      freeaddrinfo(res);
+      close(fd);
+      lua_pushnil(L);
+      lua_pushfstring(L, "cannot set IPV6_V6ONLY socket option: %s", errmsg);
+      return 2;
+    }
+  }
+  if (nbio_apply_sockopts(L, fd, 3)) {
+    freeaddrinfo(res);
+    close(fd);
+    return 2;
+  }
+  if (bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen)) {
+    nbio_prepare_errmsg(errno);
+    freeaddrinfo(res);
+    close(fd);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
   int addrfam = addrinfo->ai_family;
   freeaddrinfo(res);
-  if (listen(fd, NBIO_LISTEN_BACKLOG)) {
+  if (listen(fd, opts.backlog)) {
     nbio_prepare_errmsg(errno);
     close(fd);
     lua_pushnil(L);
@@ -579,13 +1326,34 @@ static int nbio_handle_index(lua_State *L) {
       return 1;
     }
     if (!strcmp(key, "peer_addr")) {
+      // format address stored by accept only when requested:
+      if (!handle->peer_addr[0]) {
+        const void *addr = NULL;
+        if (handle->peer.sa.sa_family == AF_INET6) {
+          addr = &handle->peer.in6.sin6_addr;
+        } else if (handle->peer.sa.sa_family == AF_INET) {
+          addr = &handle->peer.in.sin_addr;
+        }
+        if (addr && !inet_ntop(
+          handle->peer.sa.sa_family, addr,
+          handle->peer_addr, sizeof(handle->peer_addr)
+        )) {
+          handle->peer_addr[0] = 0;
+          return luaL_error(L, "could not format peer address");
+        }
+      }
       if (handle->peer_addr[0]) lua_pushstring(L, handle->peer_addr);
       else lua_pushnil(L);
       return 1;
     }
     if (!strcmp(key, "peer_port")) {
-      if (handle->peer_port >= 0) lua_pushinteger(L, handle->peer_port);
-      else lua_pushnil(L);
+      if (handle->peer.sa.sa_family == AF_INET6) {
+        lua_pushinteger(L, ntohs(handle->peer.in6.sin6_port));
+      } else if (handle->peer.sa.sa_family == AF_INET) {
+        lua_pushinteger(L, ntohs(handle->peer.in.sin_port));
+      } else {
+        lua_pushnil(L);
+      }
       return 1;
     }
   }
@@ -610,6 +1378,22 @@ static int nbio_listener_index(lua_State *L) {
   return 1;
 }
 
+// __index metamethod for datagram socket handle:
+static int nbio_udp_index(lua_State *L) {
+  nbio_udp_t *udp = luaL_checkudata(L, 1, NBIO_UDP_MT_REGKEY);
+  const char *key = lua_tostring(L, 2);
+  if (key) {
+    if (!strcmp(key, "fd")) {
+      if (udp->fd == -1) lua_pushboolean(L, 0);
+      else lua_pushinteger(L, udp->fd);
+      return 1;
+    }
+  }
+  lua_settop(L, 2);
+  lua_gettable(L, lua_upvalueindex(NBIO_UDP_METHODS_UPIDX));
+  return 1;
+}
+
 // __index metamethod for child process handle:
 static int nbio_child_index(lua_State *L) {
   nbio_child_t *child = luaL_checkudata(L, 1, NBIO_CHILD_MT_REGKEY);
@@ -638,6 +1422,193 @@ static int nbio_child_index(lua_State *L) {
   return 1;
 }
 
+// Returns pointer to memory of buffer at given stack index, which is the
+// memory of the parent buffer in case of a view (raises an error if the
+// parent has moved its data since the view has been created):
+static char *nbio_buffer_memory(lua_State *L, int idx, nbio_buffer_t *buf) {
+  if (!buf->view) return buf->data;
+  lua_getiuservalue(L, idx, NBIO_BUFFER_PARENT_UVIDX);
+  nbio_buffer_t *parent = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (parent->generation != buf->generation) {
+    luaL_error(L, "buffer view has been invalidated");
+  }
+  return parent->data;
+}
+
+// Ensures that at least the given number of bytes can be appended to a
+// (non-view) buffer, moves data to the beginning or reallocates memory if
+// necessary, and returns pointer to free space:
+static char *nbio_buffer_reserve(lua_State *L, nbio_buffer_t *buf,
+  size_t needed
+) {
+  if (buf->capacity - buf->end >= needed) return buf->data + buf->end;
+  size_t used = buf->end - buf->start;
+  if (needed > SIZE_MAX - used) luaL_error(L, "buffer allocation failed");
+  if (buf->capacity - used < needed) {
+    size_t newcap = buf->capacity;
+    if (newcap < NBIO_CHUNKSIZE) newcap = NBIO_CHUNKSIZE;
+    while (newcap - used < needed) {
+      if (newcap > SIZE_MAX / 2) {
+        newcap = used + needed;
+        break;
+      }
+      newcap *= 2;
+    }
+    char *newdata = malloc(newcap);
+    if (!newdata) luaL_error(L, "buffer allocation failed");
+    if (used) memcpy(newdata, buf->data + buf->start, used);
+    free(buf->data);
+    buf->data = newdata;
+    buf->capacity = newcap;
+  } else {
+    memmove(buf->data, buf->data + buf->start, used);
+  }
+  buf->start = 0;
+  buf->end = used;
+  buf->generation++;
+  return buf->data + buf->end;
+}
+
+// Converts a relative start position (like with string.sub) to an offset:
+static size_t nbio_buffer_startpos(lua_Integer pos, size_t len) {
+  if (pos > 0) return (lua_Unsigned)pos - 1 < len ? pos - 1 : len;
+  if (pos == 0 || (lua_Unsigned)-pos > len) return 0;
+  return len + pos;
+}
+
+// Converts a relative end position (like with string.sub) to an offset:
+static size_t nbio_buffer_endpos(lua_Integer pos, size_t len) {
+  if (pos >= 0) return (lua_Unsigned)pos < len ? pos : len;
+  if ((lua_Unsigned)-pos > len) return 0;
+  return len + pos + 1;
+}
+
+// Creates a new byte buffer (with optional initial capacity):
+static int nbio_buffer_new(lua_State *L) {
+  lua_Integer capacity = luaL_optinteger(L, 1, 0);
+  if (capacity < 0) {
+    return luaL_argerror(L, 1, "capacity must not be negative");
+  }
+  nbio_buffer_t *buf = lua_newuserdatauv(L, sizeof(*buf), NBIO_BUFFER_UVCNT);
+  buf->data = NULL;
+  buf->capacity = 0;
+  buf->start = 0;
+  buf->end = 0;
+  buf->generation = 0;
+  buf->view = 0;
+  luaL_setmetatable(L, NBIO_BUFFER_MT_REGKEY);
+  if (capacity > 0) nbio_buffer_reserve(L, buf, capacity);
+  return 1;
+}
+
+// Releases memory of buffer:
+static int nbio_buffer_gc(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  free(buf->data);
+  buf->data = NULL;
+  buf->capacity = 0;
+  buf->start = 0;
+  buf->end = 0;
+  return 0;
+}
+
+// Returns number of bytes in buffer:
+static int nbio_buffer_len(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  lua_pushinteger(L, buf->end - buf->start);
+  return 1;
+}
+
+// Appends strings to buffer:
+static int nbio_buffer_append(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  int argc = lua_gettop(L);
+  if (buf->view) return luaL_error(L, "cannot append to buffer view");
+  for (int i=2; i<=argc; i++) {
+    size_t len;
+    const char *data = luaL_checklstring(L, i, &len);
+    if (len) memcpy(nbio_buffer_reserve(L, buf, len), data, len);
+    buf->end += len;
+  }
+  return 0;
+}
+
+// Searches a string in buffer (starting at an optional position) and returns
+// start and end position of first occurrence (or nil if not found):
+static int nbio_buffer_find(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  size_t needle_len;
+  const char *needle = luaL_checklstring(L, 2, &needle_len);
+  size_t len = buf->end - buf->start;
+  size_t init = nbio_buffer_startpos(luaL_optinteger(L, 3, 1), len);
+  char *start = nbio_buffer_memory(L, 1, buf) + buf->start;
+  if (needle_len <= len - init) {
+    char *found = needle_len ?
+      memmem(start + init, len - init, needle, needle_len) : start + init;
+    if (found) {
+      lua_pushinteger(L, found - start + 1);
+      lua_pushinteger(L, found - start + needle_len);
+      return 2;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+// Returns view on range of buffer (positions like with string.sub), which is
+// invalidated when the underlying buffer has to move its data:
+static int nbio_buffer_sub(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  size_t len = buf->end - buf->start;
+  size_t i = nbio_buffer_startpos(luaL_checkinteger(L, 2), len);
+  size_t j = nbio_buffer_endpos(luaL_optinteger(L, 3, -1), len);
+  if (j < i) j = i;
+  nbio_buffer_memory(L, 1, buf); // check validity
+  lua_settop(L, 1);
+  nbio_buffer_t *view = lua_newuserdatauv(L, sizeof(*view), NBIO_BUFFER_UVCNT);
+  view->data = NULL;
+  view->capacity = 0;
+  view->start = buf->start + i;
+  view->end = buf->start + j;
+  view->generation = buf->generation;
+  view->view = 1;
+  // views on views refer to the original buffer:
+  if (buf->view) lua_getiuservalue(L, 1, NBIO_BUFFER_PARENT_UVIDX);
+  else lua_pushvalue(L, 1);
+  lua_setiuservalue(L, 2, NBIO_BUFFER_PARENT_UVIDX);
+  luaL_setmetatable(L, NBIO_BUFFER_MT_REGKEY);
+  return 1;
+}
+
+// Removes given number of bytes (defaults to all) from beginning of buffer
+// and returns the number of removed bytes:
+static int nbio_buffer_consume(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  size_t len = buf->end - buf->start;
+  lua_Integer count = luaL_optinteger(L, 2, len);
+  if (count < 0) {
+    return luaL_argerror(L, 2, "byte count must not be negative");
+  }
+  if ((lua_Unsigned)count > len) count = len;
+  buf->start += count;
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+// Returns contents of buffer (or of range given like with string.sub) as
+// string:
+static int nbio_buffer_tostring(lua_State *L) {
+  nbio_buffer_t *buf = luaL_checkudata(L, 1, NBIO_BUFFER_MT_REGKEY);
+  size_t len = buf->end - buf->start;
+  size_t i = nbio_buffer_startpos(luaL_optinteger(L, 2, 1), len);
+  size_t j = nbio_buffer_endpos(luaL_optinteger(L, 3, -1), len);
+  char *start = nbio_buffer_memory(L, 1, buf) + buf->start;
+  if (j > i) lua_pushlstring(L, start + i, j - i);
+  else lua_pushliteral(L, "");
+  return 1;
+}
+
 // Unbuffered reads from I/O handle:
 static int nbio_handle_read_unbuffered(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
@@ -656,8 +1627,7 @@ static int nbio_handle_read_unbuffered(lua_State *L) {
       handle->readbuf_read += maxlen;
     } else {
       lua_pushlstring(L, start, available);
-      handle->readbuf_written = 0;
-      handle->readbuf_read = 0;
+      nbio_handle_release_readbuf(handle);
     }
     return 1;
   }
@@ -667,31 +1637,70 @@ static int nbio_handle_read_unbuffered(lua_State *L) {
     lua_pushliteral(L, "end of data");
     return 2;
   }
-  if (maxlen > handle->readbuf_capacity) {
-    void *newbuf = realloc(handle->readbuf, maxlen);
-    if (!newbuf) return luaL_error(L, "buffer allocation failed");
-    handle->readbuf = newbuf;
-    handle->readbuf_capacity = maxlen;
+  // borrow buffer only during the system call:
+  if (nbio_handle_reserve_readbuf(handle, maxlen)) {
+    return luaL_error(L, "buffer allocation failed");
   }
-  ssize_t result = read(handle->fd, handle->readbuf, maxlen);
+  ssize_t result = nbio_handle_recv(handle, handle->readbuf, maxlen);
+  int read_errno = errno;
+  if (result > 0) lua_pushlstring(L, handle->readbuf, result);
+  nbio_handle_release_readbuf(handle);
   if (result > 0) {
-    lua_pushlstring(L, handle->readbuf, result);
     return 1;
   } else if (result == 0) {
     lua_pushboolean(L, 0);
     lua_pushliteral(L, "end of data");
     return 2;
-  } else if (errno == EAGAIN || errno == EINTR) {
+  } else if (read_errno == EAGAIN || read_errno == EINTR) {
     lua_pushlstring(L, NULL, 0);
     return 1;
   } else {
-    nbio_prepare_errmsg(errno);
+    nbio_prepare_errmsg(read_errno);
     lua_pushnil(L);
     lua_pushstring(L, errmsg);
     return 2;
   }
 }
 
+// Searches terminator in read buffer, skipping bytes that have been searched
+// before, and returns number of bytes up to and including the terminator (or
+// zero if the terminator does not end within the first maxlen bytes):
+static size_t nbio_handle_find_terminator(lua_State *L,
+  nbio_handle_t *handle, const char *terminator, size_t terminator_len,
+  lua_Integer maxlen
+) {
+  if (
+    terminator_len != handle->readbuf_terminator_len ||
+    memcmp(terminator, handle->readbuf_terminator, terminator_len)
+  ) {
+    char *copy = realloc(handle->readbuf_terminator, terminator_len);
+    if (!copy) luaL_error(L, "buffer allocation failed");
+    memcpy(copy, terminator, terminator_len);
+    handle->readbuf_terminator = copy;
+    handle->readbuf_terminator_len = terminator_len;
+    handle->readbuf_checked = 0;
+  }
+  char *buf = handle->readbuf;
+  size_t pos = handle->readbuf_checked;
+  if (pos < handle->readbuf_read) pos = handle->readbuf_read;
+  size_t limit = handle->readbuf_written;
+  if ((lua_Unsigned)maxlen < limit - handle->readbuf_read) {
+    limit = handle->readbuf_read + maxlen;
+  }
+  if (pos < limit && limit - pos >= terminator_len) {
+    char *found = terminator_len == 1 ?
+      memchr(buf + pos, *terminator, limit - pos) :
+      memmem(buf + pos, limit - pos, terminator, terminator_len);
+    if (found) {
+      handle->readbuf_checked = found - buf;
+      return found - buf - handle->readbuf_read + terminator_len;
+    }
+    // terminator may start within the last terminator_len-1 bytes:
+    handle->readbuf_checked = limit - terminator_len + 1;
+  }
+  return 0;
+}
+
 // Buffered reads from I/O handle:
 static int nbio_handle_read(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
@@ -704,46 +1713,29 @@ static int nbio_handle_read(lua_State *L) {
   if (handle->state == NBIO_STATE_CLOSED) {
     return luaL_error(L, "read from closed handle");
   }
-  if (terminator != NULL && terminator_len != 1) {
-    return luaL_argerror(L, 3, "optional terminator must be a single char");
+  if (terminator != NULL && terminator_len == 0) {
+    return luaL_argerror(L, 3, "optional terminator must not be empty");
   }
   if (handle->readbuf_written > 0) {
     void *start = handle->readbuf + handle->readbuf_read;
     size_t available = handle->readbuf_written - handle->readbuf_read;
     size_t uselen = maxlen;
     if (terminator != NULL) {
-      if ((unsigned char)*terminator != handle->readbuf_checked_terminator) {
-        handle->readbuf_checked_terminator = (unsigned char)*terminator;
-        for (size_t i=0; i<available; i++) {
-          if (((char *)start)[i] == *terminator) {
-            if (i < maxlen) uselen = i + 1;
-            handle->readbuf_checked_terminator = -1;
-            break;
-          }
-        }
-      }
+      size_t found = nbio_handle_find_terminator(
+        L, handle, terminator, terminator_len, maxlen
+      );
+      if (found) uselen = found;
     }
-    if (available < uselen) {
-      if (handle->readbuf_read > 0) {
-        memmove(handle->readbuf, start, available);
-        handle->readbuf_written = available;
-        handle->readbuf_read = 0;
-      }
-    } else {
+    if (available >= uselen) {
       if (uselen >= LUA_MAXINTEGER) {
         return luaL_error(L, "data reached maximum allocation size");
       }
       lua_pushlstring(L, start, uselen);
-      if (uselen == available) {
-        handle->readbuf_written = 0;
-        handle->readbuf_read = 0;
-      } else {
-        handle->readbuf_read += uselen;
-      }
+      if (uselen == available) nbio_handle_release_readbuf(handle);
+      else handle->readbuf_read += uselen;
       return 1;
     }
   }
-  // handle->readbuf_read is zero at this point
   if (handle->fd == -1) {
     // simulate EOF
     lua_pushboolean(L, 0);
@@ -751,68 +1743,75 @@ static int nbio_handle_read(lua_State *L) {
     return 2;
   }
   while (1) {
-    if (handle->readbuf_written > SIZE_MAX - NBIO_CHUNKSIZE) {
-      return luaL_error(L, "buffer allocation failed");
-    }
-    size_t needed_capacity = handle->readbuf_written + NBIO_CHUNKSIZE;
-    if (handle->readbuf_capacity < needed_capacity) {
-      if (handle->readbuf_capacity > SIZE_MAX / 2) {
-        return luaL_error(L, "buffer allocation failed");
+    // Move data to beginning only if there is no space for another chunk
+    // (consumed data at the beginning is skipped otherwise):
+    if (
+      handle->readbuf_read > 0 &&
+      handle->readbuf_capacity - handle->readbuf_written < NBIO_CHUNKSIZE
+    ) {
+      size_t available = handle->readbuf_written - handle->readbuf_read;
+      memmove(
+        handle->readbuf, handle->readbuf + handle->readbuf_read, available
+      );
+      if (handle->readbuf_checked > handle->readbuf_read) {
+        handle->readbuf_checked -= handle->readbuf_read;
+      } else {
+        handle->readbuf_checked = 0;
       }
-      size_t newcap = 2 * handle->readbuf_capacity;
-      if (newcap < needed_capacity) newcap = needed_capacity;
-      void *newbuf = realloc(handle->readbuf, newcap);
-      if (!newbuf) return luaL_error(L, "buffer allocation failed");
-      handle->readbuf = newbuf;
-      handle->readbuf_capacity = newcap;
+      handle->readbuf_written = available;
+      handle->readbuf_read = 0;
     }
-    ssize_t result = read(
-      handle->fd,
+    if (nbio_handle_reserve_readbuf(handle, NBIO_CHUNKSIZE)) {
+      return luaL_error(L, "buffer allocation failed");
+    }
+    ssize_t result = nbio_handle_recv(
+      handle,
       handle->readbuf + handle->readbuf_written,
       NBIO_CHUNKSIZE
     );
     if (result > 0) {
-      size_t old_written = handle->readbuf_written;
       handle->readbuf_written += result;
+      void *start = handle->readbuf + handle->readbuf_read;
+      size_t available = handle->readbuf_written - handle->readbuf_read;
       size_t uselen = maxlen;
       if (terminator != NULL) {
-        handle->readbuf_checked_terminator = (unsigned char)*terminator;
-        for (size_t i=old_written; i<handle->readbuf_written; i++) {
-          if (((char *)handle->readbuf)[i] == *terminator) {
-            if (i < maxlen) uselen = i + 1;
-            handle->readbuf_checked_terminator = -1;
-            break;
-          }
-        }
-      } else {
-        handle->readbuf_checked_terminator = -1;
+        size_t found = nbio_handle_find_terminator(
+          L, handle, terminator, terminator_len, maxlen
+        );
+        if (found) uselen = found;
       }
-      if (handle->readbuf_written >= uselen) {
+      if (available >= uselen) {
         if (uselen >= LUA_MAXINTEGER) {
           return luaL_error(L, "data reached maximum allocation size");
         }
-        lua_pushlstring(L, handle->readbuf, uselen);
-        if (handle->readbuf_written > uselen) {
-          handle->readbuf_read = uselen;
-        } else {
-          handle->readbuf_written = 0;
-        }
+        lua_pushlstring(L, start, uselen);
+        if (available > uselen) handle->readbuf_read += uselen;
+        else nbio_handle_release_readbuf(handle);
         return 1;
       }
     } else if (result == 0) {
       if (handle->readbuf_written > 0) {
-        lua_pushlstring(L, handle->readbuf, handle->readbuf_written);
-        handle->readbuf_written = 0;
+        lua_pushlstring(
+          L,
+          handle->readbuf + handle->readbuf_read,
+          handle->readbuf_written - handle->readbuf_read
+        );
+        nbio_handle_release_readbuf(handle);
         return 1;
       }
+      nbio_handle_release_readbuf(handle);
       lua_pushboolean(L, 0);
       lua_pushliteral(L, "end of data");
       return 2;
-    } else if (errno == EAGAIN || errno == EINTR) {
-      lua_pushlstring(L, NULL, 0);
-      return 1;
     } else {
-      nbio_prepare_errmsg(errno);
+      int read_errno = errno;
+      // do not keep empty buffer while waiting:
+      if (handle->readbuf_written == 0) nbio_handle_release_readbuf(handle);
+      if (read_errno == EAGAIN || read_errno == EINTR) {
+        lua_pushlstring(L, NULL, 0);
+        return 1;
+      }
+      nbio_prepare_errmsg(read_errno);
       lua_pushnil(L);
       lua_pushstring(L, errmsg);
       return 2;
@@ -825,37 +1824,100 @@ static int nbio_handle_unread(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
   size_t bytes;
   const char *data = luaL_checklstring(L, 2, &bytes);
+  if (bytes == 0) return 0;
   if (handle->readbuf_read >= bytes) {
     handle->readbuf_read -= bytes;
     memcpy(handle->readbuf + handle->readbuf_read, data, bytes);
   } else {
-    size_t needed_capacity =
-      handle->readbuf_written - handle->readbuf_read + bytes;
+    size_t available = handle->readbuf_written - handle->readbuf_read;
+    if (available > SIZE_MAX - bytes) {
+      return luaL_error(L, "buffer allocation failed");
+    }
+    size_t needed_capacity = available + bytes;
     if (handle->readbuf_capacity < needed_capacity) {
-      if (handle->readbuf_capacity > SIZE_MAX / 2) {
-        return luaL_error(L, "buffer allocation failed");
-      }
-      size_t newcap = 2 * handle->readbuf_capacity;
-      if (newcap < needed_capacity) newcap = needed_capacity;
-      void *newbuf = realloc(handle->readbuf, newcap);
+      // copy existing data directly to its new position:
+      size_t newcap;
+      void *newbuf = nbio_pool_acquire(needed_capacity, &newcap);
       if (!newbuf) return luaL_error(L, "buffer allocation failed");
+      if (available > 0) {
+        memcpy(
+          newbuf + bytes, handle->readbuf + handle->readbuf_read, available
+        );
+      }
+      nbio_pool_release(handle->readbuf, handle->readbuf_capacity);
       handle->readbuf = newbuf;
       handle->readbuf_capacity = newcap;
+    } else if (available > 0) {
+      memmove(
+        handle->readbuf + bytes,
+        handle->readbuf + handle->readbuf_read,
+        available
+      );
     }
-    memmove(
-      handle->readbuf + bytes,
-      handle->readbuf + handle->readbuf_read,
-      handle->readbuf_written - handle->readbuf_read
-    );
     memcpy(handle->readbuf, data, bytes);
-    handle->readbuf_written =
-      handle->readbuf_written - handle->readbuf_read + bytes;
+    handle->readbuf_written = needed_capacity;
     handle->readbuf_read = 0;
   }
-  handle->readbuf_checked_terminator = -1;
+  handle->readbuf_checked = 0;
   return 0;
 }
 
+// Read data from I/O handle and append it to a buffer (returns number of
+// appended bytes):
+static int nbio_handle_read_into(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  nbio_buffer_t *buf = luaL_checkudata(L, 2, NBIO_BUFFER_MT_REGKEY);
+  lua_Integer maxlen = luaL_optinteger(L, 3, NBIO_CHUNKSIZE);
+  if (maxlen <= 0) {
+    return luaL_argerror(L, 3, "maximum byte count must be positive");
+  }
+  if (buf->view) {
+    return luaL_argerror(L, 2, "cannot read into buffer view");
+  }
+  if (handle->state == NBIO_STATE_CLOSED) {
+    return luaL_error(L, "read from closed handle");
+  }
+  if (handle->readbuf_written > 0) {
+    void *start = handle->readbuf + handle->readbuf_read;
+    size_t available = handle->readbuf_written - handle->readbuf_read;
+    if (maxlen < available) available = maxlen;
+    memcpy(nbio_buffer_reserve(L, buf, available), start, available);
+    buf->end += available;
+    handle->readbuf_read += available;
+    if (handle->readbuf_read == handle->readbuf_written) {
+      nbio_handle_release_readbuf(handle);
+    }
+    handle->readbuf_checked = 0;
+    lua_pushinteger(L, available);
+    return 1;
+  }
+  if (handle->fd == -1) {
+    // simulate EOF
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "end of data");
+    return 2;
+  }
+  char *free_space = nbio_buffer_reserve(L, buf, maxlen);
+  ssize_t result = nbio_handle_recv(handle, free_space, maxlen);
+  if (result > 0) {
+    buf->end += result;
+    lua_pushinteger(L, result);
+    return 1;
+  } else if (result == 0) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "end of data");
+    return 2;
+  } else if (errno == EAGAIN || errno == EINTR) {
+    lua_pushinteger(L, 0);
+    return 1;
+  } else {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+}
+
 // Unbuffered writes to I/O handle (implicitly flushes buffered data):
 static int nbio_handle_write_unbuffered(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
@@ -892,16 +1954,16 @@ static int nbio_handle_write_unbuffered(lua_State *L) {
         return 2;
       }
     }
-    written = write(
-      handle->fd,
+    written = nbio_handle_send(
+      handle,
       handle->writebuf + handle->writebuf_read,
-      handle->writebuf_written - handle->writebuf_read
+      handle->writebuf_written - handle->writebuf_read,
+      to_write > 0
     );
     if (written >= 0) {
       handle->writebuf_read += written;
       if (handle->writebuf_read == handle->writebuf_written) {
-        handle->writebuf_written = 0;
-        handle->writebuf_read = 0;
+        nbio_handle_release_writebuf(handle);
         if (to_write == 0) {
           if (nbio_handle_set_nopush(handle, 0)) {
             nbio_prepare_errmsg(errno);
@@ -942,7 +2004,7 @@ static int nbio_handle_write_unbuffered(lua_State *L) {
       return 2;
     }
   }
-  written = write(handle->fd, buf-1+start, to_write);
+  written = nbio_handle_send(handle, buf-1+start, to_write, 0);
   if (written >= 0) {
     if (nbio_handle_set_nopush(handle, 0)) {
       nbio_prepare_errmsg(errno);
@@ -1012,16 +2074,16 @@ static int nbio_handle_write(lua_State *L) {
       handle->writebuf_written + to_write > NBIO_CHUNKSIZE
     )
   ) {
-    written = write(
-      handle->fd,
+    written = nbio_handle_send(
+      handle,
       handle->writebuf + handle->writebuf_read,
-      handle->writebuf_written - handle->writebuf_read
+      handle->writebuf_written - handle->writebuf_read,
+      1
     );
     if (written >= 0) {
       handle->writebuf_read += written;
       if (handle->writebuf_read == handle->writebuf_written) {
-        handle->writebuf_written = 0;
-        handle->writebuf_read = 0;
+        nbio_handle_release_writebuf(handle);
       } else {
         lua_pushinteger(L, 0);
         return 1;
@@ -1044,12 +2106,19 @@ static int nbio_handle_write(lua_State *L) {
     to_write <= NBIO_CHUNKSIZE && // avoids integer overflow
     handle->writebuf_written + to_write <= NBIO_CHUNKSIZE
   ) {
-    if (handle->writebuf == NULL) {
-      handle->writebuf = malloc(NBIO_CHUNKSIZE);
-      if (!handle->writebuf) return luaL_error(L, "buffer allocation failed");
+    if (to_write > 0) {
+      if (handle->writebuf == NULL) {
+        size_t capacity;
+        handle->writebuf = nbio_pool_acquire(NBIO_CHUNKSIZE, &capacity);
+        if (!handle->writebuf) {
+          return luaL_error(L, "buffer allocation failed");
+        }
+      }
+      memcpy(
+        handle->writebuf + handle->writebuf_written, buf-1+start, to_write
+      );
+      handle->writebuf_written += to_write;
     }
-    memcpy(handle->writebuf + handle->writebuf_written, buf-1+start, to_write);
-    handle->writebuf_written += to_write;
     lua_pushinteger(L, to_write);
     return 1;
   }
@@ -1057,7 +2126,7 @@ static int nbio_handle_write(lua_State *L) {
     lua_pushinteger(L, 0);
     return 1;
   }
-  written = write(handle->fd, buf-1+start, to_write);
+  written = nbio_handle_send(handle, buf-1+start, to_write, 1);
   if (written >= 0) {
     lua_pushinteger(L, written);
     return 1;
@@ -1076,6 +2145,139 @@ static int nbio_handle_write(lua_State *L) {
   }
 }
 
+// Vectored writes to I/O handle (common implementation of nbio_handle_writev
+// and nbio_handle_writev_unbuffered), writing all strings passed as arguments
+// after skipping a given number of bytes together with buffered data, returns
+// the number of written bytes (excluding buffered data) and the number of
+// bytes remaining to be written (including buffered data if unbuffered):
+static int nbio_handle_writev_impl(lua_State *L, int unbuffered) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  lua_Integer skip = luaL_checkinteger(L, 2);
+  int top = lua_gettop(L);
+  if (skip < 0) {
+    return luaL_argerror(L, 2, "number of bytes to skip must not be negative");
+  }
+  if (handle->state == NBIO_STATE_CLOSED) {
+    return luaL_error(L, "write to closed handle");
+  }
+  if (handle->state == NBIO_STATE_SHUTDOWN) {
+    return luaL_error(L, "write to shut down handle");
+  }
+  struct iovec iov[NBIO_WRITEV_MAXCNT + 1];
+  int iovcnt = 0;
+  size_t buffered = handle->writebuf_written - handle->writebuf_read;
+  if (buffered > 0) {
+    iov[0].iov_base = handle->writebuf + handle->writebuf_read;
+    iov[0].iov_len = buffered;
+    iovcnt = 1;
+  }
+  size_t remaining = 0;
+  int complete = 1; // set to zero if not all strings fit into iov
+  for (int i=3; i<=top; i++) {
+    size_t len;
+    const char *data = luaL_checklstring(L, i, &len);
+    if ((size_t)skip >= len) {
+      skip -= len;
+      continue;
+    }
+    data += skip;
+    len -= skip;
+    skip = 0;
+    if (len > SIZE_MAX - remaining) {
+      return luaL_error(L, "chunk length longer than SIZE_MAX");
+    }
+    remaining += len;
+    if (iovcnt <= NBIO_WRITEV_MAXCNT) {
+      iov[iovcnt].iov_base = (void *)data;
+      iov[iovcnt].iov_len = len;
+      iovcnt++;
+    } else {
+      complete = 0;
+    }
+  }
+  if (!unbuffered) {
+    if (nbio_handle_set_nopush(handle, 1)) {
+      nbio_prepare_errmsg(errno);
+      lua_pushnil(L);
+      lua_pushstring(L, errmsg);
+      return 2;
+    }
+    // Store small amounts of data in buffer:
+    if (
+      complete && remaining <= NBIO_CHUNKSIZE && // avoids integer overflow
+      handle->writebuf_written + remaining <= NBIO_CHUNKSIZE
+    ) {
+      if (handle->writebuf == NULL) {
+        size_t capacity;
+        handle->writebuf = nbio_pool_acquire(NBIO_CHUNKSIZE, &capacity);
+        if (!handle->writebuf) return luaL_error(L, "buffer allocation failed");
+      }
+      for (int i=(buffered > 0 ? 1 : 0); i<iovcnt; i++) {
+        memcpy(
+          handle->writebuf + handle->writebuf_written,
+          iov[i].iov_base, iov[i].iov_len
+        );
+        handle->writebuf_written += iov[i].iov_len;
+      }
+      lua_pushinteger(L, remaining);
+      lua_pushinteger(L, 0);
+      return 2;
+    }
+  }
+  if (iovcnt == 0) {
+    lua_pushinteger(L, 0);
+    lua_pushinteger(L, 0);
+    return 2;
+  }
+  ssize_t written = nbio_handle_sendv(
+    handle, iov, iovcnt, !unbuffered || !complete
+  );
+  if (written >= 0) {
+    if ((size_t)written < buffered) {
+      handle->writebuf_read += written;
+      written = 0;
+    } else {
+      nbio_handle_release_writebuf(handle);
+      written -= buffered;
+      buffered = 0;
+    }
+  } else if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN) {
+    written = 0;
+  } else if (errno == EPIPE) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "peer closed stream");
+    return 2;
+  } else {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+  remaining -= written;
+  if (unbuffered) {
+    remaining += handle->writebuf_written - handle->writebuf_read;
+    if (remaining == 0 && nbio_handle_set_nopush(handle, 0)) {
+      nbio_prepare_errmsg(errno);
+      lua_pushnil(L);
+      lua_pushstring(L, errmsg);
+      return 2;
+    }
+  }
+  lua_pushinteger(L, written);
+  lua_pushinteger(L, remaining);
+  return 2;
+}
+
+// Buffered vectored writes to I/O handle:
+static int nbio_handle_writev(lua_State *L) {
+  return nbio_handle_writev_impl(L, 0);
+}
+
+// Unbuffered vectored writes to I/O handle (implicitly flushes buffered data):
+static int nbio_handle_writev_unbuffered(lua_State *L) {
+  return nbio_handle_writev_impl(L, 1);
+}
+
 // Flush write buffer of I/O handle:
 static int nbio_handle_flush(lua_State *L) {
   nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
@@ -1086,10 +2288,11 @@ static int nbio_handle_flush(lua_State *L) {
     return luaL_error(L, "flushing shut down handle");
   }
   if (handle->writebuf_written > 0) {
-    ssize_t written = write(
-      handle->fd,
+    ssize_t written = nbio_handle_send(
+      handle,
       handle->writebuf + handle->writebuf_read,
-      handle->writebuf_written - handle->writebuf_read
+      handle->writebuf_written - handle->writebuf_read,
+      0
     );
     if (written >= 0) {
       handle->writebuf_read += written;
@@ -1114,107 +2317,1298 @@ static int nbio_handle_flush(lua_State *L) {
   }
   size_t remaining = handle->writebuf_written - handle->writebuf_read;
   if (remaining == 0) {
-    handle->writebuf_written = 0;
-    handle->writebuf_read = 0;
+    nbio_handle_release_writebuf(handle);
   }
   lua_pushinteger(L, remaining);
   return 1;
 }
 
-// Accept connection from listener handle:
-static int nbio_listener_accept(lua_State *L) {
-  nbio_listener_t *listener = luaL_checkudata(L, 1, NBIO_LISTENER_MT_REGKEY);
-  if (listener->fd == -1) return luaL_error(L,
-    "attempt to use closed listener"
+// Write out buffered data (used before transferring data that bypasses the
+// write buffer), returns 1 if buffer is empty, 0 if data is remaining (e.g.
+// because writing would block), or -1 on error (with errno set):
+static int nbio_handle_drain_writebuf(nbio_handle_t *handle) {
+  if (handle->writebuf_written == 0) return 1;
+  ssize_t written = nbio_handle_send(
+    handle,
+    handle->writebuf + handle->writebuf_read,
+    handle->writebuf_written - handle->writebuf_read,
+    1
   );
-  int fd;
-  while (1) {
-    fd = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC);
-    if (fd == -1) {
-      // NOTE: Do not report ECONNABORTED as error to allow users of library to
-      // exit on (hard) errors.
-      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-        lua_pushboolean(L, 0);
-        lua_pushliteral(L, "no incoming connection pending");
+  if (written >= 0) {
+    handle->writebuf_read += written;
+    if (handle->writebuf_read == handle->writebuf_written) {
+      nbio_handle_release_writebuf(handle);
+      return 1;
+    }
+    return 0;
+  } else if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN) {
+    return 0;
+  }
+  return -1;
+}
+
+// Transfer data from a file to I/O handle without copying it into Lua memory
+// (implicitly flushes buffered data), returns number of transferred bytes and
+// true as second return value if end of file has been reached:
+static int nbio_handle_sendfile(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  nbio_handle_t *src = luaL_checkudata(L, 2, NBIO_HANDLE_MT_REGKEY);
+  lua_Integer offset = luaL_checkinteger(L, 3);
+  lua_Integer length = luaL_optinteger(L, 4, NBIO_SENDFILE_MAXLEN);
+  if (offset < 0) {
+    return luaL_argerror(L, 3, "offset must not be negative");
+  }
+  if (length <= 0) {
+    return luaL_argerror(L, 4, "maximum byte count must be positive");
+  }
+  if (handle->state == NBIO_STATE_CLOSED) {
+    return luaL_error(L, "write to closed handle");
+  }
+  if (handle->state == NBIO_STATE_SHUTDOWN) {
+    return luaL_error(L, "write to shut down handle");
+  }
+  if (src->state == NBIO_STATE_CLOSED || src->fd == -1) {
+    return luaL_error(L, "read from closed handle");
+  }
+  if (length > NBIO_SENDFILE_MAXLEN) length = NBIO_SENDFILE_MAXLEN;
+  ssize_t result = -1;
+  int drained = nbio_handle_drain_writebuf(handle);
+  if (drained == 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  if (drained == 1) {
+    int fallback = 1;
+#if defined(NBIO_USE_OPENSSL)
+    // sendfile is only possible if the kernel handles encryption:
+    if (handle->ssl && !handle->ktls_send) goto nbio_handle_sendfile_fallback;
+#endif
+#if defined(__linux__)
+    off_t off = offset;
+    result = sendfile(handle->fd, src->fd, &off, length);
+    // sendfile is not supported for every kind of file descriptor:
+    fallback = result < 0 && (errno == EINVAL || errno == ENOSYS);
+#elif defined(__FreeBSD__)
+    if (handle->addrfam != AF_UNSPEC) {
+      off_t sbytes = 0;
+      if (sendfile(src->fd, handle->fd, offset, length, NULL, &sbytes, 0)) {
+        if (sbytes > 0 && (errno == EAGAIN || errno == EINTR)) {
+          result = sbytes;
+        } else {
+          result = -1;
+          fallback = errno == EOPNOTSUPP || errno == ENOTSOCK;
+        }
+      } else {
+        result = sbytes;
+      }
+      if (result >= 0) fallback = 0;
+    }
+#endif
+#if defined(NBIO_USE_OPENSSL)
+    nbio_handle_sendfile_fallback:
+#endif
+    if (fallback) {
+      char buf[NBIO_CHUNKSIZE];
+      result = pread(
+        src->fd, buf, length < NBIO_CHUNKSIZE ? length : NBIO_CHUNKSIZE,
+        offset
+      );
+      if (result > 0) result = nbio_handle_send(handle, buf, result, 0);
+      else if (result == 0) {
+        lua_pushinteger(L, 0);
+        lua_pushboolean(L, 1);
         return 2;
-      } else if (errno != EINTR) {
-        nbio_prepare_errmsg(errno);
+      }
+    }
+  }
+  if (result >= 0) {
+    if (nbio_handle_set_nopush(handle, 0)) {
+      nbio_prepare_errmsg(errno);
+      lua_pushnil(L);
+      lua_pushstring(L, errmsg);
+      return 2;
+    }
+    lua_pushinteger(L, result);
+    if (result == 0) {
+      // sendfile transfers zero bytes only at end of file:
+      lua_pushboolean(L, 1);
+      return 2;
+    }
+    return 1;
+  } else if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN) {
+    lua_pushinteger(L, 0);
+    return 1;
+  } else if (errno == EPIPE) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "peer closed stream");
+    return 2;
+  } else {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+}
+
+#if defined(NBIO_USE_OPENSSL)
+// Pushes message for last OpenSSL error (with prefix) and clears the error
+// queue of the current thread:
+static void nbio_tls_push_errmsg(lua_State *L, const char *prefix) {
+  unsigned long err = ERR_get_error();
+  ERR_clear_error();
+  if (err) {
+    const char *reason = ERR_reason_error_string(err);
+    if (reason) {
+      lua_pushfstring(L, "%s: %s", prefix, reason);
+    } else {
+      // e.g. system errors have no reason string in some OpenSSL versions:
+      char buf[256];
+      ERR_error_string_n(err, buf, sizeof(buf));
+      lua_pushfstring(L, "%s: %s", prefix, buf);
+    }
+  } else {
+    lua_pushstring(L, prefix);
+  }
+}
+
+// Reads optional string field from options table at given stack index and
+// leaves it on the stack:
+static const char *nbio_tls_optstring(lua_State *L, int idx, const char *key) {
+  lua_getfield(L, idx, key);
+  if (lua_isnil(L, -1)) return NULL;
+  const char *value = lua_tostring(L, -1);
+  if (!value) {
+    luaL_argerror(L, idx, lua_pushfstring(L, "%s must be a string", key));
+  }
+  return value;
+}
+
+// Create TLS context with options given as table:
+static int nbio_tls_context_new(lua_State *L) {
+  if (lua_isnoneornil(L, 1)) {
+    lua_settop(L, 0);
+    lua_newtable(L);
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "server");
+  int server = lua_toboolean(L, -1);
+  lua_getfield(L, 1, "verify");
+  int verify = lua_isnil(L, -1) ? !server : lua_toboolean(L, -1);
+  lua_getfield(L, 1, "ktls");
+  int ktls = lua_isnil(L, -1) ? 1 : lua_toboolean(L, -1);
+  lua_settop(L, 1);
+  // userdata is created first, such that the context is freed on errors:
+  nbio_tls_context_t *context = lua_newuserdatauv(L, sizeof(*context), 0);
+  context->ctx = NULL;
+  context->server = server;
+  luaL_setmetatable(L, NBIO_TLS_CONTEXT_MT_REGKEY);
+  context->ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if (!context->ctx) {
+    lua_pushnil(L);
+    nbio_tls_push_errmsg(L, "cannot create TLS context");
+    return 2;
+  }
+  SSL_CTX_set_min_proto_version(context->ctx, TLS1_2_VERSION);
+  // Data may be written partially and retried from a different buffer (e.g.
+  // from the write buffer of the I/O handle):
+  SSL_CTX_set_mode(context->ctx,
+    SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+    SSL_MODE_RELEASE_BUFFERS
+  );
+  // Renegotiation could require writing while reading:
+  SSL_CTX_set_options(context->ctx, SSL_OP_NO_RENEGOTIATION);
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+  // Treat missing close_notify alert as EOF (like most other software):
+  SSL_CTX_set_options(context->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#if defined(SSL_OP_ENABLE_KTLS)
+  // Let the kernel encrypt and decrypt after the handshake, if supported:
+  if (ktls) SSL_CTX_set_options(context->ctx, SSL_OP_ENABLE_KTLS);
+#else
+  (void)ktls;
+#endif
+  const char *cert = nbio_tls_optstring(L, 1, "cert");
+  if (cert && SSL_CTX_use_certificate_chain_file(context->ctx, cert) != 1) {
+    lua_pushnil(L);
+    nbio_tls_push_errmsg(L, "cannot load certificate");
+    return 2;
+  }
+  const char *key = nbio_tls_optstring(L, 1, "key");
+  if (key) {
+    if (
+      SSL_CTX_use_PrivateKey_file(context->ctx, key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(context->ctx) != 1
+    ) {
+      lua_pushnil(L);
+      nbio_tls_push_errmsg(L, "cannot load private key");
+      return 2;
+    }
+  }
+  const char *ca = nbio_tls_optstring(L, 1, "ca");
+  if (ca) {
+    if (SSL_CTX_load_verify_locations(context->ctx, ca, NULL) != 1) {
+      lua_pushnil(L);
+      nbio_tls_push_errmsg(L, "cannot load CA certificates");
+      return 2;
+    }
+  } else if (verify) {
+    if (SSL_CTX_set_default_verify_paths(context->ctx) != 1) {
+      lua_pushnil(L);
+      nbio_tls_push_errmsg(L, "cannot load default CA certificates");
+      return 2;
+    }
+  }
+  if (verify) {
+    SSL_CTX_set_verify(context->ctx,
+      SSL_VERIFY_PEER | (server ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), NULL
+    );
+  }
+  lua_settop(L, 2);
+  return 1;
+}
+
+// Free TLS context (may be invoked multiple times, connections keep their
+// own reference to the OpenSSL context):
+static int nbio_tls_context_gc(lua_State *L) {
+  nbio_tls_context_t *context =
+    luaL_checkudata(L, 1, NBIO_TLS_CONTEXT_MT_REGKEY);
+  SSL_CTX_free(context->ctx);
+  context->ctx = NULL;
+  return 0;
+}
+
+// Start TLS on I/O handle using a TLS context, with optional host name for
+// server name indication and certificate verification on the client side
+// (the handshake is performed by nbio_handle_handshake):
+static int nbio_handle_starttls(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  nbio_tls_context_t *context =
+    luaL_checkudata(L, 2, NBIO_TLS_CONTEXT_MT_REGKEY);
+  const char *hostname = luaL_optstring(L, 3, NULL);
+  if (handle->state != NBIO_STATE_OPEN || handle->fd == -1) {
+    return luaL_error(L, "starting TLS on closed handle");
+  }
+  if (!context->ctx) return luaL_argerror(L, 2, "TLS context has been freed");
+  if (handle->ssl) return luaL_error(L, "TLS has already been started");
+  // Buffered data would bypass encryption:
+  if (handle->readbuf_written > 0 || handle->writebuf_written > 0) {
+    return luaL_error(L, "cannot start TLS with buffered data");
+  }
+  SSL *ssl = SSL_new(context->ctx);
+  if (!ssl) {
+    lua_pushnil(L);
+    nbio_tls_push_errmsg(L, "cannot create TLS connection");
+    return 2;
+  }
+  if (SSL_set_fd(ssl, handle->fd) != 1) {
+    SSL_free(ssl);
+    lua_pushnil(L);
+    nbio_tls_push_errmsg(L, "cannot create TLS connection");
+    return 2;
+  }
+  if (context->server) {
+    SSL_set_accept_state(ssl);
+  } else {
+    SSL_set_connect_state(ssl);
+    if (hostname) {
+      struct in6_addr addr;
+      int ok;
+      if (
+        inet_pton(AF_INET, hostname, &addr) == 1 ||
+        inet_pton(AF_INET6, hostname, &addr) == 1
+      ) {
+        ok = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), hostname);
+      } else {
+        ok = SSL_set_tlsext_host_name(ssl, hostname) &&
+          SSL_set1_host(ssl, hostname);
+      }
+      if (!ok) {
+        SSL_free(ssl);
         lua_pushnil(L);
-        lua_pushstring(L, errmsg);
+        nbio_tls_push_errmsg(L, "cannot set TLS host name");
         return 2;
       }
-    } else {
-      int flags = fcntl(fd, F_GETFL, 0);
-      if (flags == -1) {
-        nbio_prepare_errmsg(errno);
-        close(fd);
-        return luaL_error(L, "error in fcntl call: %s", errmsg);
+    }
+  }
+  handle->ssl = ssl;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// Continue TLS handshake, returns true when completed or false and "read" or
+// "write" if waiting for the file descriptor to become readable or writable
+// is required:
+static int nbio_handle_handshake(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  if (!handle->ssl || handle->fd == -1) {
+    return luaL_error(L, "TLS has not been started");
+  }
+  ERR_clear_error();
+  int result = SSL_do_handshake(handle->ssl);
+  if (result == 1) {
+#if defined(BIO_get_ktls_send)
+    handle->ktls_send = BIO_get_ktls_send(SSL_get_wbio(handle->ssl));
+#endif
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  int saved_errno = errno;
+  switch (SSL_get_error(handle->ssl, result)) {
+  case SSL_ERROR_WANT_READ:
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "read");
+    return 2;
+  case SSL_ERROR_WANT_WRITE:
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "write");
+    return 2;
+  case SSL_ERROR_SYSCALL:
+    if (saved_errno == EAGAIN || saved_errno == ENOTCONN) {
+      // connection is still being established:
+      ERR_clear_error();
+      lua_pushboolean(L, 0);
+      lua_pushliteral(L, "write");
+      return 2;
+    }
+    if (saved_errno && !ERR_peek_error()) {
+      nbio_prepare_errmsg(saved_errno);
+      lua_pushnil(L);
+      lua_pushfstring(L, "TLS handshake failed: %s", errmsg);
+      return 2;
+    }
+    break;
+  }
+  long verify_result = SSL_get_verify_result(handle->ssl);
+  lua_pushnil(L);
+  if (verify_result != X509_V_OK) {
+    ERR_clear_error();
+    lua_pushfstring(L,
+      "TLS certificate verification failed: %s",
+      X509_verify_cert_error_string(verify_result)
+    );
+  } else {
+    nbio_tls_push_errmsg(L, "TLS handshake failed");
+  }
+  return 2;
+}
+
+// Returns table with information about the TLS connection (or nil if TLS is
+// not used):
+static int nbio_handle_tls_info(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  if (!handle->ssl) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 5);
+  lua_pushboolean(L, SSL_is_init_finished(handle->ssl));
+  lua_setfield(L, -2, "established");
+  lua_pushstring(L, SSL_get_version(handle->ssl));
+  lua_setfield(L, -2, "version");
+  const char *cipher = SSL_get_cipher_name(handle->ssl);
+  if (cipher) {
+    lua_pushstring(L, cipher);
+    lua_setfield(L, -2, "cipher");
+  }
+  lua_pushboolean(L, handle->ktls_send);
+  lua_setfield(L, -2, "ktls_send");
+#if defined(BIO_get_ktls_recv)
+  lua_pushboolean(L, BIO_get_ktls_recv(SSL_get_rbio(handle->ssl)));
+#else
+  lua_pushboolean(L, 0);
+#endif
+  lua_setfield(L, -2, "ktls_recv");
+  return 1;
+}
+#endif
+
+// Check if connection initiated with tcpconnect or localconnect has been
+// established (returns false while still in progress):
+static int nbio_handle_connected(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  if (handle->fd == -1) {
+    return luaL_error(L, "checking connection of closed handle");
+  }
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(handle->fd, SOL_SOCKET, SO_ERROR, &err, &len)) err = errno;
+  if (!err) {
+    nbio_sockaddr_t peer;
+    socklen_t peer_len = sizeof(peer);
+    if (!getpeername(handle->fd, &peer.sa, &peer_len)) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+    if (errno == ENOTCONN) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+    err = errno;
+  }
+  nbio_prepare_errmsg(err);
+  lua_pushnil(L);
+  lua_pushstring(L, errmsg);
+  return 2;
+}
+
+// Set socket option of I/O handle:
+static int nbio_handle_setopt(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  if (handle->fd == -1) {
+    return luaL_error(L, "setting option of closed handle");
+  }
+  return nbio_setopt_impl(L, handle->fd);
+}
+
+// Get socket option of I/O handle:
+static int nbio_handle_getopt(lua_State *L) {
+  nbio_handle_t *handle = luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  if (handle->fd == -1) {
+    return luaL_error(L, "getting option of closed handle");
+  }
+  return nbio_getopt_impl(L, handle->fd);
+}
+
+// Close pump (may be invoked multiple times):
+static int nbio_pump_close(lua_State *L) {
+  nbio_pump_t *pump = luaL_checkudata(L, 1, NBIO_PUMP_MT_REGKEY);
+  if (pump->pipe_fds[0] != -1) close(pump->pipe_fds[0]);
+  if (pump->pipe_fds[1] != -1) close(pump->pipe_fds[1]);
+  pump->pipe_fds[0] = -1;
+  pump->pipe_fds[1] = -1;
+  pump->pipe_fill = 0;
+  free(pump->buf);
+  pump->buf = NULL;
+  pump->buf_written = 0;
+  pump->buf_read = 0;
+  return 0;
+}
+
+// Create pump that transfers data from an I/O handle to another I/O handle
+// (with optional maximum number of bytes):
+static int nbio_pump(lua_State *L) {
+  luaL_checkudata(L, 1, NBIO_HANDLE_MT_REGKEY);
+  luaL_checkudata(L, 2, NBIO_HANDLE_MT_REGKEY);
+  lua_Integer length = luaL_optinteger(L, 3, -1);
+  if (lua_isnoneornil(L, 3)) length = -1;
+  else if (length < 0) {
+    return luaL_argerror(L, 3, "byte count must not be negative");
+  }
+  lua_settop(L, 2);
+  nbio_pump_t *pump = lua_newuserdatauv(L, sizeof(*pump), NBIO_PUMP_UVCNT);
+  pump->pipe_fds[0] = -1;
+  pump->pipe_fds[1] = -1;
+  pump->pipe_fill = 0;
+  pump->buf = NULL;
+  pump->buf_written = 0;
+  pump->buf_read = 0;
+  pump->eof = 0;
+  pump->remaining = length;
+  luaL_setmetatable(L, NBIO_PUMP_MT_REGKEY);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, 3, NBIO_PUMP_SRC_UVIDX);
+  lua_pushvalue(L, 2);
+  lua_setiuservalue(L, 3, NBIO_PUMP_DST_UVIDX);
+#if defined(__linux__)
+#if defined(NBIO_USE_OPENSSL)
+  // Data must pass through OpenSSL unless the kernel handles encryption:
+  nbio_handle_t *src = lua_touserdata(L, 1);
+  nbio_handle_t *dst = lua_touserdata(L, 2);
+  if (src->ssl || (dst->ssl && !dst->ktls_send)) return 1;
+#endif
+  if (pipe2(pump->pipe_fds, O_NONBLOCK | O_CLOEXEC)) {
+    pump->pipe_fds[0] = -1;
+    pump->pipe_fds[1] = -1;
+  }
+#if defined(F_SETPIPE_SZ)
+  else {
+    // Enlarge pipe to reduce number of system calls (errors are ignored, e.g.
+    // when exceeding the limit for unprivileged users):
+    fcntl(pump->pipe_fds[1], F_SETPIPE_SZ, NBIO_PUMP_SPLICE_MAXLEN);
+  }
+#endif
+#endif
+  return 1;
+}
+
+// Helper function for nbio_pump_step, returning maximum number of bytes to
+// read from source:
+static size_t nbio_pump_maxlen(nbio_pump_t *pump, size_t limit) {
+  if (pump->remaining >= 0 && (lua_Unsigned)pump->remaining < limit) {
+    return pump->remaining;
+  }
+  return limit;
+}
+
+#if defined(__linux__)
+// Helper function for nbio_pump_step, stopping the use of splicing by moving
+// data in the pipe (if any) into a newly allocated buffer and closing the pipe,
+// returns 0 on success or -1 on error:
+static int nbio_pump_unsplice(nbio_pump_t *pump) {
+  if (pump->pipe_fill > 0) {
+    size_t capacity = pump->pipe_fill;
+    if (capacity < NBIO_CHUNKSIZE) capacity = NBIO_CHUNKSIZE;
+    pump->buf = malloc(capacity);
+    if (!pump->buf) {
+      errno = ENOMEM;
+      return -1;
+    }
+    while (pump->buf_written < pump->pipe_fill) {
+      ssize_t result = read(
+        pump->pipe_fds[0], pump->buf + pump->buf_written,
+        pump->pipe_fill - pump->buf_written
+      );
+      if (result <= 0) {
+        if (result < 0 && errno == EINTR) continue;
+        if (result == 0) errno = EIO;
+        return -1;
       }
-      flags |= O_NONBLOCK;
-      if (fcntl(fd, F_SETFL, flags) == -1) {
-        nbio_prepare_errmsg(errno);
-        close(fd);
-        return luaL_error(L, "error in fcntl call: %s", errmsg);
+      pump->buf_written += result;
+    }
+    pump->pipe_fill = 0;
+  }
+  close(pump->pipe_fds[0]);
+  close(pump->pipe_fds[1]);
+  pump->pipe_fds[0] = -1;
+  pump->pipe_fds[1] = -1;
+  return 0;
+}
+#endif
+
+// Transfer as much data as possible without blocking, returns number of bytes
+// written to destination and "read" or "write" if waiting for the source to
+// become readable or the destination to become writable, respectively, is
+// required, or "done" if all data has been transferred:
+static int nbio_pump_step(lua_State *L) {
+  nbio_pump_t *pump = luaL_checkudata(L, 1, NBIO_PUMP_MT_REGKEY);
+  lua_settop(L, 1);
+  lua_getiuservalue(L, 1, NBIO_PUMP_SRC_UVIDX);
+  lua_getiuservalue(L, 1, NBIO_PUMP_DST_UVIDX);
+  nbio_handle_t *src = lua_touserdata(L, 2);
+  nbio_handle_t *dst = lua_touserdata(L, 3);
+  if (src->state == NBIO_STATE_CLOSED) {
+    return luaL_error(L, "read from closed handle");
+  }
+  if (dst->state == NBIO_STATE_CLOSED) {
+    return luaL_error(L, "write to closed handle");
+  }
+  if (dst->state == NBIO_STATE_SHUTDOWN) {
+    return luaL_error(L, "write to shut down handle");
+  }
+  lua_Integer total = 0;
+  const char *status;
+  ssize_t result;
+  // Write out buffered data of destination first:
+  int drained = nbio_handle_drain_writebuf(dst);
+  if (drained == 0) {
+    status = "write";
+    goto nbio_pump_step_done;
+  } else if (drained < 0) {
+    goto nbio_pump_step_error;
+  }
+  // Transfer buffered data of source (which has already been read):
+  while (src->readbuf_written > 0 && pump->remaining != 0) {
+    result = nbio_handle_send(
+      dst,
+      src->readbuf + src->readbuf_read,
+      nbio_pump_maxlen(pump, src->readbuf_written - src->readbuf_read),
+      0
+    );
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN) {
+        status = "write";
+        goto nbio_pump_step_done;
       }
-      nbio_push_handle(L, fd, listener->addrfam, 0, 1);
-      if (listener->addrfam == AF_INET6) {
-        nbio_handle_t *handle = lua_touserdata(L, -1);
-        struct sockaddr_in6 addr_in6;
-        socklen_t addrlen = sizeof(addr_in6);
-        if (getpeername(fd, (struct sockaddr *)&addr_in6, &addrlen)) {
-          nbio_prepare_errmsg(errno);
-          close(fd);
-          return luaL_error(L, "error in getpeername call: %s", errmsg);
-        }
-        if (addrlen > sizeof(addr_in6)) {
-          nbio_prepare_errmsg(errno);
-          close(fd);
-          return luaL_error(L, "getpeername result exceeded buffer size");
-        }
-        char addr_buffer[INET6_ADDRSTRLEN];
-        const char *addr = inet_ntop(
-          AF_INET6, &addr_in6.sin6_addr.s6_addr,
-          addr_buffer, sizeof(addr_buffer)
+      goto nbio_pump_step_error;
+    }
+    total += result;
+    if (pump->remaining > 0) pump->remaining -= result;
+    src->readbuf_read += result;
+    if (src->readbuf_read == src->readbuf_written) {
+      nbio_handle_release_readbuf(src);
+    }
+    src->readbuf_checked = 0;
+  }
+  while (1) {
+#if defined(__linux__)
+    if (pump->pipe_fds[0] != -1) {
+      // Move data from pipe to destination:
+      if (pump->pipe_fill > 0) {
+        result = splice(
+          pump->pipe_fds[0], NULL, dst->fd, NULL, pump->pipe_fill,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK
         );
-        if (!addr) {
-          nbio_prepare_errmsg(errno);
-          close(fd);
-          return luaL_error(L, "could not format peer address");
+        if (result < 0) {
+          if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN) {
+            status = "write";
+            goto nbio_pump_step_done;
+          }
+          if (errno != EINVAL) goto nbio_pump_step_error;
+          // Splicing is not supported for the destination:
+          if (nbio_pump_unsplice(pump)) goto nbio_pump_step_error;
+          continue;
         }
-        strncpy(handle->peer_addr, addr, sizeof(handle->peer_addr));
-        handle->peer_addr[sizeof(handle->peer_addr)-1] = 0;
-        handle->peer_port = ntohs(addr_in6.sin6_port);
-      } else if (listener->addrfam == AF_INET) {
-        nbio_handle_t *handle = lua_touserdata(L, -1);
-        struct sockaddr_in addr_in;
-        socklen_t addrlen = sizeof(addr_in);
-        if (getpeername(fd, (struct sockaddr *)&addr_in, &addrlen)) {
-          nbio_prepare_errmsg(errno);
-          close(fd);
-          return luaL_error(L, "error in getpeername call: %s", errmsg);
+        pump->pipe_fill -= result;
+        total += result;
+        continue;
+      }
+      if (pump->eof || pump->remaining == 0 || src->fd == -1) break;
+      // Move data from source to pipe:
+      result = splice(
+        src->fd, NULL, pump->pipe_fds[1], NULL,
+        nbio_pump_maxlen(pump, NBIO_PUMP_SPLICE_MAXLEN),
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+      );
+      if (result < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+          status = "read";
+          goto nbio_pump_step_done;
         }
-        if (addrlen > sizeof(addr_in)) {
-          nbio_prepare_errmsg(errno);
-          close(fd);
-          return luaL_error(L, "getpeername result exceeded buffer size");
+        if (errno != EINVAL) goto nbio_pump_step_error;
+        // Splicing is not supported for the source:
+        if (nbio_pump_unsplice(pump)) goto nbio_pump_step_error;
+        continue;
+      }
+      if (result == 0) pump->eof = 1;
+      pump->pipe_fill += result;
+      if (pump->remaining > 0) pump->remaining -= result;
+      continue;
+    }
+#endif
+    // Move data from buffer to destination:
+    if (pump->buf_written > 0) {
+      result = nbio_handle_send(
+        dst,
+        pump->buf + pump->buf_read,
+        pump->buf_written - pump->buf_read,
+        0
+      );
+      if (result < 0) {
+        if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN) {
+          status = "write";
+          goto nbio_pump_step_done;
         }
-        char addr_buffer[INET_ADDRSTRLEN];
-        const char *addr = inet_ntop(
-          AF_INET, &addr_in.sin_addr.s_addr,
-          addr_buffer, sizeof(addr_buffer)
+        goto nbio_pump_step_error;
+      }
+      pump->buf_read += result;
+      if (pump->buf_read == pump->buf_written) {
+        pump->buf_written = 0;
+        pump->buf_read = 0;
+      }
+      total += result;
+      continue;
+    }
+    if (pump->eof || pump->remaining == 0 || src->fd == -1) break;
+    // Move data from source to buffer:
+    if (pump->buf == NULL) {
+      pump->buf = malloc(NBIO_CHUNKSIZE);
+      if (!pump->buf) return luaL_error(L, "buffer allocation failed");
+    }
+    result = nbio_handle_recv(
+      src, pump->buf, nbio_pump_maxlen(pump, NBIO_CHUNKSIZE)
+    );
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        status = "read";
+        goto nbio_pump_step_done;
+      }
+      goto nbio_pump_step_error;
+    }
+    if (result == 0) pump->eof = 1;
+    pump->buf_written = result;
+    if (pump->remaining > 0) pump->remaining -= result;
+  }
+  status = "done";
+  nbio_pump_step_done:
+  if (nbio_handle_set_nopush(dst, 0)) goto nbio_pump_step_error;
+  lua_pushinteger(L, total);
+  lua_pushstring(L, status);
+  return 2;
+  nbio_pump_step_error:
+  if (errno == EPIPE) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "peer closed stream");
+    return 2;
+  }
+  {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+  }
+  return 2;
+}
+
+// Accept pending connection from listener handle and push I/O handle on
+// success, returns 1 if a handle has been pushed, 0 if no connection is
+// pending, or -1 on error (with errno set):
+static int nbio_listener_accept_one(lua_State *L, nbio_listener_t *listener) {
+  nbio_sockaddr_t peer;
+  while (1) {
+    // peer address is stored without formatting (see nbio_handle_index):
+    socklen_t peer_len = sizeof(peer);
+    int fd = accept4(
+      listener->fd, &peer.sa, &peer_len, SOCK_CLOEXEC | SOCK_NONBLOCK
+    );
+    if (fd == -1) {
+      // NOTE: Do not report ECONNABORTED as error to allow users of library to
+      // exit on (hard) errors.
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+        return 0;
+      } else if (errno != EINTR) {
+        return -1;
+      }
+    } else {
+      nbio_push_handle(L, fd, listener->addrfam, 0, 1);
+      if (
+        (listener->addrfam == AF_INET6 || listener->addrfam == AF_INET) &&
+        peer_len <= sizeof(peer) &&
+        (peer.sa.sa_family == AF_INET6 || peer.sa.sa_family == AF_INET)
+      ) {
+        nbio_handle_t *handle = lua_touserdata(L, -1);
+        handle->peer = peer;
+      }
+      return 1;
+    }
+  }
+}
+
+// Accept connection from listener handle:
+static int nbio_listener_accept(lua_State *L) {
+  nbio_listener_t *listener = luaL_checkudata(L, 1, NBIO_LISTENER_MT_REGKEY);
+  if (listener->fd == -1) return luaL_error(L,
+    "attempt to use closed listener"
+  );
+  int result = nbio_listener_accept_one(L, listener);
+  if (result > 0) return 1;
+  if (result == 0) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "no incoming connection pending");
+    return 2;
+  }
+  nbio_prepare_errmsg(errno);
+  lua_pushnil(L);
+  lua_pushstring(L, errmsg);
+  return 2;
+}
+
+// Accept up to a given number of pending connections from listener handle
+// and return their I/O handles (errors are only reported if no connection
+// could be accepted):
+static int nbio_listener_accept_many(lua_State *L) {
+  nbio_listener_t *listener = luaL_checkudata(L, 1, NBIO_LISTENER_MT_REGKEY);
+  lua_Integer maxcount = luaL_checkinteger(L, 2);
+  if (maxcount <= 0) {
+    return luaL_argerror(L, 2, "maximum count must be positive");
+  }
+  if (listener->fd == -1) return luaL_error(L,
+    "attempt to use closed listener"
+  );
+  lua_settop(L, 1);
+  int count = 0;
+  while (count < maxcount) {
+    luaL_checkstack(L, 1, "too many connections to return");
+    int result = nbio_listener_accept_one(L, listener);
+    if (result > 0) {
+      count++;
+    } else if (count > 0) {
+      break;
+    } else if (result == 0) {
+      lua_pushboolean(L, 0);
+      lua_pushliteral(L, "no incoming connection pending");
+      return 2;
+    } else {
+      nbio_prepare_errmsg(errno);
+      lua_pushnil(L);
+      lua_pushstring(L, errmsg);
+      return 2;
+    }
+  }
+  return count;
+}
+
+// Set socket option of listener handle:
+static int nbio_listener_setopt(lua_State *L) {
+  nbio_listener_t *listener = luaL_checkudata(L, 1, NBIO_LISTENER_MT_REGKEY);
+  if (listener->fd == -1) return luaL_error(L,
+    "attempt to use closed listener"
+  );
+  return nbio_setopt_impl(L, listener->fd);
+}
+
+// Get socket option of listener handle:
+static int nbio_listener_getopt(lua_State *L) {
+  nbio_listener_t *listener = luaL_checkudata(L, 1, NBIO_LISTENER_MT_REGKEY);
+  if (listener->fd == -1) return luaL_error(L,
+    "attempt to use closed listener"
+  );
+  return nbio_getopt_impl(L, listener->fd);
+}
+
+// Create datagram socket for given host and port, which is bound to the
+// address (if passive is non-zero) or connected to it (may block on DNS
+// resolving):
+static int nbio_udp_open(lua_State *L, int passive) {
+  const char *host, *port;
+  host = passive ? luaL_optstring(L, 1, NULL) : luaL_checkstring(L, 1);
+  port = luaL_checkstring(L, 2);
+  if (nbio_check_sockopts(L, 3)) return 2;
+  struct addrinfo hints = { 0, };
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
+  hints.ai_flags = AI_ADDRCONFIG | (passive ? AI_PASSIVE : 0);
+  struct addrinfo *res;
+  int errcode = getaddrinfo(host, port, &hints, &res);
+  if (errcode) {
+    if (errcode == EAI_SYSTEM) {
+      nbio_prepare_errmsg(errno);
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", gai_strerror(errcode), errmsg);
+    } else {
+      lua_pushnil(L);
+      lua_pushstring(L, gai_strerror(errcode));
+    }
+    return 2;
+  }
+  struct addrinfo *addrinfo;
+  for (addrinfo=res; addrinfo; addrinfo=addrinfo->ai_next) {
+    if (addrinfo->ai_family == AF_INET6) goto nbio_udp_open_found;
+  }
+  for (addrinfo=res; addrinfo; addrinfo=addrinfo->ai_next) {
+    if (addrinfo->ai_family == AF_INET) goto nbio_udp_open_found;
+  }
+  freeaddrinfo(res);
+  lua_pushnil(L);
+  lua_pushliteral(L, "no IPv4 or IPv6 address found");
+  return 2;
+  nbio_udp_open_found:;
+  int fd = socket(
+    addrinfo->ai_family,  // incorrect to not use PF_* but AF_* constants here
+    addrinfo->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+    addrinfo->ai_protocol
+  );
+  if (fd == -1) {
+    nbio_prepare_errmsg(errno);
+    freeaddrinfo(res);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+  if (nbio_apply_sockopts(L, fd, 3)) {
+    freeaddrinfo(res);
+    close(fd);
+    return 2;
+  }
+  if (passive && addrinfo->ai_family == AF_INET6) {
+    const int val = (host != NULL) ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val))) {
+      nbio_prepare_errmsg(errno);
+      freeaddrinfo(res);
+      close(fd);
+      lua_pushnil(L);
+      lua_pushfstring(L, "cannot set IPV6_V6ONLY socket option: %s", errmsg);
+      return 2;
+    }
+  }
+  if (passive ?
+    bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) :
+    connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen)
+  ) {
+    nbio_prepare_errmsg(errno);
+    freeaddrinfo(res);
+    close(fd);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+  int addrfam = addrinfo->ai_family;
+  freeaddrinfo(res);
+  nbio_udp_t *udp = lua_newuserdatauv(L, sizeof(*udp), 0);
+  udp->fd = fd;
+  udp->addrfam = addrfam;
+  udp->recvbuf = NULL;
+  udp->recvbuf_capacity = 0;
+  luaL_setmetatable(L, NBIO_UDP_MT_REGKEY);
+  return 1;
+}
+
+// Bind datagram socket to local address and port and return socket handle:
+static int nbio_udpbind(lua_State *L) {
+  return nbio_udp_open(L, 1);
+}
+
+// Connect datagram socket to remote address and port and return socket
+// handle:
+static int nbio_udpconnect(lua_State *L) {
+  return nbio_udp_open(L, 0);
+}
+
+// Close datagram socket handle (may be invoked multiple times):
+static int nbio_udp_close(lua_State *L) {
+  nbio_udp_t *udp = luaL_checkudata(L, 1, NBIO_UDP_MT_REGKEY);
+  if (udp->fd != -1) close(udp->fd);
+  udp->fd = -1;
+  nbio_pool_release(udp->recvbuf, udp->recvbuf_capacity);
+  udp->recvbuf = NULL;
+  udp->recvbuf_capacity = 0;
+  return 0;
+}
+
+// Returns datagram socket handle at given stack index or raises an error if
+// it is invalid or closed:
+static nbio_udp_t *nbio_udp_check(lua_State *L, int idx) {
+  nbio_udp_t *udp = luaL_checkudata(L, idx, NBIO_UDP_MT_REGKEY);
+  if (udp->fd == -1) luaL_error(L, "attempt to use closed datagram socket");
+  return udp;
+}
+
+// Borrows receive buffer with given capacity from buffer pool (the buffer
+// is stored in the handle, such that it is released on close if an error is
+// raised before nbio_udp_release_recvbuf is called), returns 0 on success or
+// -1 on allocation failure:
+static int nbio_udp_reserve_recvbuf(nbio_udp_t *udp, size_t needed) {
+  if (udp->recvbuf_capacity >= needed) return 0;
+  nbio_pool_release(udp->recvbuf, udp->recvbuf_capacity);
+  udp->recvbuf = nbio_pool_acquire(needed, &udp->recvbuf_capacity);
+  if (!udp->recvbuf) {
+    udp->recvbuf_capacity = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Returns receive buffer to buffer pool:
+static void nbio_udp_release_recvbuf(nbio_udp_t *udp) {
+  nbio_pool_release(udp->recvbuf, udp->recvbuf_capacity);
+  udp->recvbuf = NULL;
+  udp->recvbuf_capacity = 0;
+}
+
+// Stores destination address given as numeric host and port, returns length
+// of socket address (IPv4 addresses are mapped when sending through IPv6
+// sockets):
+static socklen_t nbio_udp_destination(lua_State *L, nbio_udp_t *udp,
+  const char *addr, lua_Integer port, nbio_sockaddr_t *dst
+) {
+  if (port < 0 || port > 65535) luaL_error(L, "invalid port number");
+  memset(dst, 0, sizeof(*dst));
+  if (udp->addrfam == AF_INET6) {
+    dst->in6.sin6_family = AF_INET6;
+    dst->in6.sin6_port = htons(port);
+    if (inet_pton(AF_INET6, addr, &dst->in6.sin6_addr) == 1) {
+      return sizeof(dst->in6);
+    }
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr, &in) == 1) {
+      dst->in6.sin6_addr.s6_addr[10] = 0xff;
+      dst->in6.sin6_addr.s6_addr[11] = 0xff;
+      memcpy(&dst->in6.sin6_addr.s6_addr[12], &in, sizeof(in));
+      return sizeof(dst->in6);
+    }
+  } else {
+    dst->in.sin_family = AF_INET;
+    dst->in.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &dst->in.sin_addr) == 1) {
+      return sizeof(dst->in);
+    }
+  }
+  luaL_error(L, "invalid numeric address: %s", addr);
+  return 0;
+}
+
+// Pushes numeric address and port of a source address (or nil twice if
+// unknown) and returns 2:
+static int nbio_udp_push_source(lua_State *L, nbio_sockaddr_t *src,
+  socklen_t srclen
+) {
+  char buf[INET6_ADDRSTRLEN];
+  if (
+    srclen >= sizeof(src->in6) && src->sa.sa_family == AF_INET6 &&
+    inet_ntop(AF_INET6, &src->in6.sin6_addr, buf, sizeof(buf))
+  ) {
+    lua_pushstring(L, buf);
+    lua_pushinteger(L, ntohs(src->in6.sin6_port));
+  } else if (
+    srclen >= sizeof(src->in) && src->sa.sa_family == AF_INET &&
+    inet_ntop(AF_INET, &src->in.sin_addr, buf, sizeof(buf))
+  ) {
+    lua_pushstring(L, buf);
+    lua_pushinteger(L, ntohs(src->in.sin_port));
+  } else {
+    lua_pushnil(L);
+    lua_pushnil(L);
+  }
+  return 2;
+}
+
+// Send single datagram to connected peer or to given numeric address and
+// port:
+static int nbio_udp_send(lua_State *L) {
+  nbio_udp_t *udp = nbio_udp_check(L, 1);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  nbio_sockaddr_t dst;
+  socklen_t dstlen = 0;
+  if (!lua_isnoneornil(L, 3)) {
+    dstlen = nbio_udp_destination(
+      L, udp, luaL_checkstring(L, 3), luaL_checkinteger(L, 4), &dst
+    );
+  }
+  ssize_t result;
+  do {
+    result = dstlen ?
+      sendto(udp->fd, data, len, 0, &dst.sa, dstlen) :
+      send(udp->fd, data, len, 0);
+  } while (result == -1 && errno == EINTR);
+  if (result == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      lua_pushboolean(L, 0);
+      lua_pushliteral(L, "send buffer full");
+      return 2;
+    }
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// Send datagrams from a sequence, starting at an optional index, to the
+// connected peer or to numeric addresses and ports given in two further
+// sequences, returns number of sent datagrams (zero if send buffer is full):
+static int nbio_udp_send_many(lua_State *L) {
+  nbio_udp_t *udp = nbio_udp_check(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int with_dst = !lua_isnoneornil(L, 3);
+  if (with_dst) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+  }
+  lua_Integer first = luaL_optinteger(L, 5, 1);
+  lua_Integer last = luaL_len(L, 2);
+  if (first > last) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  int count = last - first >= NBIO_DATAGRAM_MAXCNT ?
+    NBIO_DATAGRAM_MAXCNT : last - first + 1;
+  struct iovec iov[NBIO_DATAGRAM_MAXCNT];
+  nbio_sockaddr_t dst[NBIO_DATAGRAM_MAXCNT];
+  socklen_t dstlen[NBIO_DATAGRAM_MAXCNT];
+  for (int i=0; i<count; i++) {
+    // strings are kept alive by the table, thus they can be popped:
+    if (lua_rawgeti(L, 2, first + i) != LUA_TSTRING) {
+      return luaL_error(L, "datagram %I is not a string", first + i);
+    }
+    iov[i].iov_base = (void *)lua_tolstring(L, -1, &iov[i].iov_len);
+    lua_pop(L, 1);
+    if (with_dst) {
+      lua_rawgeti(L, 3, first + i);
+      lua_rawgeti(L, 4, first + i);
+      const char *addr = lua_tostring(L, -2);
+      int isnum;
+      lua_Integer port = lua_tointegerx(L, -1, &isnum);
+      if (!addr || !isnum) {
+        return luaL_error(L,
+          "missing address or port for datagram %I", first + i
         );
-        if (!addr) {
-          nbio_prepare_errmsg(errno);
-          close(fd);
-          return luaL_error(L, "could not format peer address");
-        }
-        strncpy(handle->peer_addr, addr, sizeof(handle->peer_addr));
-        handle->peer_addr[sizeof(handle->peer_addr)-1] = 0;
-        handle->peer_port = ntohs(addr_in.sin_port);
       }
-      return 1;
+      dstlen[i] = nbio_udp_destination(L, udp, addr, port, &dst[i]);
+      lua_pop(L, 2);
+    }
+  }
+  int sent = 0;
+#if defined(NBIO_USE_MMSG)
+  struct mmsghdr msgs[NBIO_DATAGRAM_MAXCNT];
+  memset(msgs, 0, count * sizeof(msgs[0]));
+  for (int i=0; i<count; i++) {
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (with_dst) {
+      msgs[i].msg_hdr.msg_name = &dst[i];
+      msgs[i].msg_hdr.msg_namelen = dstlen[i];
+    }
+  }
+  int result;
+  do {
+    result = sendmmsg(udp->fd, msgs, count, 0);
+  } while (result == -1 && errno == EINTR);
+  if (result > 0) sent = result;
+#else
+  for (; sent<count; sent++) {
+    ssize_t result;
+    do {
+      result = with_dst ?
+        sendto(
+          udp->fd, iov[sent].iov_base, iov[sent].iov_len, 0,
+          &dst[sent].sa, dstlen[sent]
+        ) :
+        send(udp->fd, iov[sent].iov_base, iov[sent].iov_len, 0);
+    } while (result == -1 && errno == EINTR);
+    if (result == -1) break;
+  }
+#endif
+  // errors are reported on the next call if some datagrams were sent:
+  if (sent == 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    nbio_prepare_errmsg(errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+  lua_pushinteger(L, sent);
+  return 1;
+}
+
+// Receive single datagram, returns data, numeric source address, source port,
+// and whether the datagram has been truncated (false if no datagram is
+// pending):
+static int nbio_udp_recv(lua_State *L) {
+  nbio_udp_t *udp = nbio_udp_check(L, 1);
+  lua_Integer maxlen = luaL_optinteger(L, 2, NBIO_DATAGRAM_MAXLEN);
+  if (maxlen <= 0) {
+    return luaL_argerror(L, 2, "maximum byte count must be positive");
+  }
+  if (maxlen > NBIO_DATAGRAM_MAXLEN) maxlen = NBIO_DATAGRAM_MAXLEN;
+  if (nbio_udp_reserve_recvbuf(udp, maxlen)) {
+    return luaL_error(L, "buffer allocation failed");
+  }
+  nbio_sockaddr_t src;
+  struct iovec iov = { .iov_base = udp->recvbuf, .iov_len = maxlen };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  ssize_t result;
+  do {
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_flags = 0;
+    result = recvmsg(udp->fd, &msg, 0);
+  } while (result == -1 && errno == EINTR);
+  if (result == -1) {
+    int recv_errno = errno;
+    nbio_udp_release_recvbuf(udp);
+    if (recv_errno == EAGAIN || recv_errno == EWOULDBLOCK) {
+      lua_pushboolean(L, 0);
+      lua_pushliteral(L, "no datagram pending");
+      return 2;
+    }
+    nbio_prepare_errmsg(recv_errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+  }
+  lua_pushlstring(L, udp->recvbuf, result);
+  nbio_udp_release_recvbuf(udp);
+  nbio_udp_push_source(L, &src, msg.msg_namelen);
+  lua_pushboolean(L, msg.msg_flags & MSG_TRUNC);
+  return 4;
+}
+
+// Receive up to a given number of pending datagrams, returns sequences of
+// data, numeric source addresses, source ports, and flags indicating whether
+// each datagram has been truncated (false if no datagram is pending):
+static int nbio_udp_recv_many(lua_State *L) {
+  nbio_udp_t *udp = nbio_udp_check(L, 1);
+  lua_Integer maxcount = luaL_checkinteger(L, 2);
+  lua_Integer maxlen = luaL_optinteger(L, 3, NBIO_DATAGRAM_BATCH_MAXLEN);
+  if (maxcount <= 0) {
+    return luaL_argerror(L, 2, "maximum count must be positive");
+  }
+  if (maxlen <= 0) {
+    return luaL_argerror(L, 3, "maximum byte count must be positive");
+  }
+  if (maxcount > NBIO_DATAGRAM_MAXCNT) maxcount = NBIO_DATAGRAM_MAXCNT;
+  if (maxlen > NBIO_DATAGRAM_MAXLEN) maxlen = NBIO_DATAGRAM_MAXLEN;
+  if (nbio_udp_reserve_recvbuf(udp, maxcount * maxlen)) {
+    return luaL_error(L, "buffer allocation failed");
+  }
+  nbio_sockaddr_t src[NBIO_DATAGRAM_MAXCNT];
+  socklen_t srclen[NBIO_DATAGRAM_MAXCNT];
+  size_t len[NBIO_DATAGRAM_MAXCNT];
+  int truncated[NBIO_DATAGRAM_MAXCNT];
+  int count = 0;
+#if defined(NBIO_USE_MMSG)
+  struct mmsghdr msgs[NBIO_DATAGRAM_MAXCNT];
+  struct iovec iov[NBIO_DATAGRAM_MAXCNT];
+  memset(msgs, 0, maxcount * sizeof(msgs[0]));
+  for (int i=0; i<maxcount; i++) {
+    iov[i].iov_base = udp->recvbuf + i * maxlen;
+    iov[i].iov_len = maxlen;
+    msgs[i].msg_hdr.msg_name = &src[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int result;
+  do {
+    result = recvmmsg(udp->fd, msgs, maxcount, 0, NULL);
+  } while (result == -1 && errno == EINTR);
+  for (; count<result; count++) {
+    len[count] = msgs[count].msg_len;
+    srclen[count] = msgs[count].msg_hdr.msg_namelen;
+    truncated[count] = msgs[count].msg_hdr.msg_flags & MSG_TRUNC;
+  }
+#else
+  for (; count<maxcount; count++) {
+    struct iovec iov = {
+      .iov_base = udp->recvbuf + count * maxlen, .iov_len = maxlen
+    };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    ssize_t result;
+    do {
+      msg.msg_name = &src[count];
+      msg.msg_namelen = sizeof(src[count]);
+      msg.msg_flags = 0;
+      result = recvmsg(udp->fd, &msg, 0);
+    } while (result == -1 && errno == EINTR);
+    if (result == -1) break;
+    len[count] = result;
+    srclen[count] = msg.msg_namelen;
+    truncated[count] = msg.msg_flags & MSG_TRUNC;
+  }
+#endif
+  if (count == 0) {
+    int recv_errno = errno;
+    nbio_udp_release_recvbuf(udp);
+    if (recv_errno == EAGAIN || recv_errno == EWOULDBLOCK) {
+      lua_pushboolean(L, 0);
+      lua_pushliteral(L, "no datagram pending");
+      return 2;
     }
+    nbio_prepare_errmsg(recv_errno);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
   }
+  lua_settop(L, 1);
+  lua_createtable(L, count, 0);
+  lua_createtable(L, count, 0);
+  lua_createtable(L, count, 0);
+  lua_createtable(L, count, 0);
+  for (int i=0; i<count; i++) {
+    lua_pushlstring(L, udp->recvbuf + i * maxlen, len[i]);
+    lua_rawseti(L, 2, i + 1);
+    nbio_udp_push_source(L, &src[i], srclen[i]);
+    lua_rawseti(L, 4, i + 1);
+    lua_rawseti(L, 3, i + 1);
+    lua_pushboolean(L, truncated[i]);
+    lua_rawseti(L, 5, i + 1);
+  }
+  nbio_udp_release_recvbuf(udp);
+  return 4;
+}
+
+// Set socket option of datagram socket handle:
+static int nbio_udp_setopt(lua_State *L) {
+  nbio_udp_t *udp = nbio_udp_check(L, 1);
+  return nbio_setopt_impl(L, udp->fd);
+}
+
+// Get socket option of datagram socket handle:
+static int nbio_udp_getopt(lua_State *L) {
+  nbio_udp_t *udp = nbio_udp_check(L, 1);
+  return nbio_getopt_impl(L, udp->fd);
 }
 
 // Close child process handle and kill and reap child process if still running
@@ -1294,106 +3688,264 @@ static int nbio_child_wait(lua_State *L) {
   return 1;
 }
 
-// Helper function for nbio_execute:
-static void nbio_execute_set_nonblock(lua_State *L, int fd) {
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags == -1) {
-    nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    luaL_error(L, "error in fcntl call: %s", errmsg);
-    return;
+// Ways to connect stdin, stdout, or stderr of a child process:
+#define NBIO_STDIO_SOCKET 0  // socket pair (default)
+#define NBIO_STDIO_PIPE 1    // pipe
+#define NBIO_STDIO_NULL 2    // /dev/null
+#define NBIO_STDIO_INHERIT 3 // same file descriptor as parent
+#define NBIO_STDIO_HANDLE 4  // file descriptor of an I/O handle
+#define NBIO_STDIO_STDOUT 5  // same as stdout of child (for stderr only)
+
+#if defined(NBIO_USE_POSIX_SPAWN)
+// Helper function for nbio_execute, which starts a process with the given
+// file descriptors as stdin, stdout, and stderr, and returns zero on success
+// or an errno value otherwise (also if executing failed):
+static int nbio_execute_spawn(pid_t *pid, const char **argv, const int *fds) {
+  posix_spawn_file_actions_t actions;
+  int err = posix_spawn_file_actions_init(&actions);
+  if (err) return err;
+  for (int i=0; i<3 && !err; i++) {
+    // dup2 clears FD_CLOEXEC, even if the file descriptor stays the same:
+    err = posix_spawn_file_actions_adddup2(&actions, fds[i], i);
   }
-  flags |= O_NONBLOCK;
-  if (fcntl(fd, F_SETFL, flags) == -1) {
-    nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    luaL_error(L, "error in fcntl call: %s", errmsg);
-    return;
+  if (!err) err = posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+  if (!err) err = posix_spawnp(
+    pid, argv[0], &actions, NULL, (char *const *)argv, environ
+  );
+  posix_spawn_file_actions_destroy(&actions);
+  return err;
+}
+#endif
+
+// Helper function for nbio_execute, which restores the file status flags of
+// handles that have been switched to blocking mode for a child process that
+// could not be started (flags are -1 for unchanged handles):
+static void nbio_execute_restore(nbio_handle_t **handles, const int *flags) {
+  for (int i=0; i<3; i++) {
+    if (flags[i] != -1) fcntl(handles[i]->fd, F_SETFL, flags[i]);
   }
 }
 
-// Execute child process and return child handle:
+// Execute child process and return child handle, where an optional table
+// passed as first argument selects how stdin, stdout, and stderr are
+// connected (fields "stdin", "stdout", "stderr", and "pipe_size"):
 static int nbio_execute(lua_State *L) {
-  int argc = lua_gettop(L);
+  static const char *const stdio_names[] = {"stdin", "stdout", "stderr"};
+  int optidx = lua_istable(L, 1) ? 1 : 0;
+  int argc = lua_gettop(L) - optidx;
+  luaL_checkstring(L, optidx + 1);
+  int modes[3] = {
+    NBIO_STDIO_SOCKET, NBIO_STDIO_SOCKET, NBIO_STDIO_SOCKET
+  };
+  nbio_handle_t *handles[3] = { NULL, NULL, NULL };
+  lua_Integer pipe_size = 0;
+  if (optidx) {
+    for (int i=0; i<3; i++) {
+      lua_getfield(L, optidx, stdio_names[i]);
+      if (!lua_isnil(L, -1)) {
+        handles[i] = luaL_testudata(L, -1, NBIO_HANDLE_MT_REGKEY);
+        if (handles[i]) {
+          // handle is kept from being collected by the options table:
+          modes[i] = NBIO_STDIO_HANDLE;
+          if (handles[i]->fd == -1) {
+            return luaL_argerror(L, optidx, lua_pushfstring(L,
+              "handle for %s is closed", stdio_names[i]
+            ));
+          }
+          // Buffered data would be read or written out of order:
+          if (
+            handles[i]->readbuf_written > handles[i]->readbuf_read ||
+            handles[i]->writebuf_written > handles[i]->writebuf_read
+          ) {
+            return luaL_argerror(L, optidx, lua_pushfstring(L,
+              "handle for %s has buffered data", stdio_names[i]
+            ));
+          }
+        } else {
+          const char *mode = lua_tostring(L, -1);
+          if (mode && !strcmp(mode, "socket")) modes[i] = NBIO_STDIO_SOCKET;
+          else if (mode && !strcmp(mode, "pipe")) modes[i] = NBIO_STDIO_PIPE;
+          else if (mode && !strcmp(mode, "null")) modes[i] = NBIO_STDIO_NULL;
+          else if (mode && !strcmp(mode, "inherit")) {
+            modes[i] = NBIO_STDIO_INHERIT;
+          } else if (mode && i == 2 && !strcmp(mode, "stdout")) {
+            modes[i] = NBIO_STDIO_STDOUT;
+          } else {
+            return luaL_argerror(L, optidx, lua_pushfstring(L,
+              "invalid value for %s", stdio_names[i]
+            ));
+          }
+        }
+      }
+      lua_pop(L, 1);
+    }
+    lua_getfield(L, optidx, "pipe_size");
+    if (!lua_isnil(L, -1)) {
+      int isnum;
+      pipe_size = lua_tointegerx(L, -1, &isnum);
+      if (!isnum || pipe_size <= 0 || pipe_size > INT_MAX) {
+        return luaL_argerror(L, optidx, "invalid pipe_size");
+      }
+#if !defined(F_SETPIPE_SZ)
+      lua_pushnil(L);
+      lua_pushliteral(L, "setting pipe size not supported");
+      return 2;
+#endif
+    }
+    lua_pop(L, 1);
+  }
   const char **argv = lua_newuserdatauv(L, (argc + 1) * sizeof(char *), 0);
-  for (int i=0; i<argc; i++) argv[i] = luaL_checkstring(L, i+1);
+  for (int i=0; i<argc; i++) argv[i] = luaL_checkstring(L, optidx + i + 1);
   argv[argc] = NULL;
   nbio_child_t *child = lua_newuserdatauv(L, sizeof(nbio_child_t), 3);
+  int child_idx = lua_gettop(L);
   child->pid = 0;
   luaL_setmetatable(L, NBIO_CHILD_MT_REGKEY);
-  int sockin[2], sockout[2], sockerr[2], sockipc[2];
-  if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sockin)) {
-    nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    lua_pushnil(L);
-    lua_pushfstring(L, "could not create socket pair for stdio: %s", errmsg);
-    return 2;
-  }
-  if (nbio_push_handle(L, sockin[0], AF_UNSPEC, 0, 0) == 2) {
-    lua_toclose(L, -3);
-    close(sockin[1]);
-    return 2;
-  }
-  lua_setiuservalue(L, -2, 1);
-  if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sockout)) {
-    nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    close(sockin[1]);
-    lua_pushnil(L);
-    lua_pushfstring(L, "could not create socket pair for stdio: %s", errmsg);
-    return 2;
+  // File descriptors for the child process and file descriptors that need to
+  // be closed after the child process has been started:
+  int fds[3] = { -1, -1, -1 };
+  int owned[6] = { -1, -1, -1, -1, -1, -1 };
+  // Original file status flags of handles switched to blocking mode:
+  int handle_flags[3] = { -1, -1, -1 };
+  for (int i=0; i<3; i++) {
+    if (modes[i] == NBIO_STDIO_SOCKET || modes[i] == NBIO_STDIO_PIPE) {
+      int pair[2];
+      int parent_fd;
+      if (modes[i] == NBIO_STDIO_SOCKET) {
+        if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, pair)) {
+          nbio_prepare_errmsg(errno);
+          lua_pushnil(L);
+          lua_pushfstring(L,
+            "could not create socket pair for stdio: %s", errmsg
+          );
+          goto nbio_execute_error;
+        }
+        parent_fd = pair[0];
+        fds[i] = pair[1];
+      } else {
+        if (pipe2(pair, O_CLOEXEC)) {
+          nbio_prepare_errmsg(errno);
+          lua_pushnil(L);
+          lua_pushfstring(L, "could not create pipe for stdio: %s", errmsg);
+          goto nbio_execute_error;
+        }
+        // stdin is the reading end for the child:
+        parent_fd = i == 0 ? pair[1] : pair[0];
+        fds[i] = i == 0 ? pair[0] : pair[1];
+      }
+      owned[i] = fds[i];
+      int flags = fcntl(parent_fd, F_GETFL, 0);
+      if (flags == -1 || fcntl(parent_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        nbio_prepare_errmsg(errno);
+        close(parent_fd);
+        lua_pushnil(L);
+        lua_pushfstring(L, "error in fcntl call: %s", errmsg);
+        goto nbio_execute_error;
+      }
+#if defined(F_SETPIPE_SZ)
+      if (modes[i] == NBIO_STDIO_PIPE && pipe_size) {
+        if (fcntl(parent_fd, F_SETPIPE_SZ, (int)pipe_size) == -1) {
+          nbio_prepare_errmsg(errno);
+          close(parent_fd);
+          lua_pushnil(L);
+          lua_pushfstring(L, "could not set pipe size: %s", errmsg);
+          goto nbio_execute_error;
+        }
+      }
+#endif
+      // nbio_push_handle closes the file descriptor on error:
+      if (nbio_push_handle(L, parent_fd, AF_UNSPEC, 0, 0) == 2) {
+        goto nbio_execute_error;
+      }
+      lua_setiuservalue(L, child_idx, i + 1);
+    } else if (modes[i] == NBIO_STDIO_NULL) {
+      fds[i] = open("/dev/null", O_RDWR | O_CLOEXEC);
+      if (fds[i] == -1) {
+        nbio_prepare_errmsg(errno);
+        lua_pushnil(L);
+        lua_pushfstring(L, "could not open /dev/null: %s", errmsg);
+        goto nbio_execute_error;
+      }
+      owned[i] = fds[i];
+    } else if (modes[i] == NBIO_STDIO_INHERIT) {
+      fds[i] = i;
+    } else if (modes[i] == NBIO_STDIO_HANDLE) {
+      // The handle is passed on to the child, which expects blocking I/O
+      // (the flag is shared with the parent, and it is restored if the child
+      // process cannot be started):
+      fds[i] = handles[i]->fd;
+      int flags = fcntl(fds[i], F_GETFL, 0);
+      if (flags == -1) {
+        nbio_prepare_errmsg(errno);
+        lua_pushnil(L);
+        lua_pushfstring(L, "error in fcntl call: %s", errmsg);
+        goto nbio_execute_error;
+      }
+      if (flags & O_NONBLOCK) {
+        if (fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK) == -1) {
+          nbio_prepare_errmsg(errno);
+          lua_pushnil(L);
+          lua_pushfstring(L, "error in fcntl call: %s", errmsg);
+          goto nbio_execute_error;
+        }
+        handle_flags[i] = flags;
+      }
+    } else {
+      fds[i] = fds[1];
+    }
   }
-  if (nbio_push_handle(L, sockout[0], AF_UNSPEC, 0, 0) == 2) {
-    lua_toclose(L, -3);
-    close(sockin[1]);
-    close(sockout[1]);
-    return 2;
+  // File descriptors 0 to 2 are overwritten in the child process in order,
+  // thus other file descriptors below 3 must be duplicated first:
+  for (int i=0; i<3; i++) {
+    if (fds[i] < 3 && fds[i] != i) {
+      fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+      if (fds[i] == -1) {
+        nbio_prepare_errmsg(errno);
+        lua_pushnil(L);
+        lua_pushfstring(L, "error in fcntl call: %s", errmsg);
+        goto nbio_execute_error;
+      }
+      owned[3 + i] = fds[i];
+    }
   }
-  lua_setiuservalue(L, -2, 2);
-  if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sockerr)) {
-    nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    close(sockin[1]);
-    close(sockout[1]);
+#if defined(NBIO_USE_POSIX_SPAWN)
+  pid_t pid;
+  int err = nbio_execute_spawn(&pid, argv, fds);
+  for (int i=0; i<6; i++) if (owned[i] != -1) close(owned[i]);
+  if (err) {
+    nbio_prepare_errmsg(err);
+    nbio_execute_restore(handles, handle_flags);
+    lua_toclose(L, child_idx);
     lua_pushnil(L);
-    lua_pushfstring(L, "could not create socket pair for stdio: %s", errmsg);
-    return 2;
-  }
-  if (nbio_push_handle(L, sockerr[0], AF_UNSPEC, 0, 0) == 2) {
-    lua_toclose(L, -3);
-    close(sockin[1]);
-    close(sockout[1]);
-    close(sockerr[1]);
+    lua_pushfstring(L, "could not execute: %s", errmsg);
     return 2;
   }
-  lua_setiuservalue(L, -2, 3);
+  child->pid = pid;
+  lua_settop(L, child_idx);
+  return 1;
+#else
+  int sockipc[2];
   if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sockipc)) {
     nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    close(sockin[1]);
-    close(sockout[1]);
-    close(sockerr[1]);
     lua_pushnil(L);
     lua_pushfstring(L, "could not create socket pair for IPC: %s", errmsg);
+    goto nbio_execute_error;
   }
   child->pid = fork();
   if (child->pid == -1) {
+    child->pid = 0;
     nbio_prepare_errmsg(errno);
-    lua_toclose(L, -1);
-    close(sockin[1]);
-    close(sockout[1]);
-    close(sockerr[1]);
     close(sockipc[0]);
     close(sockipc[1]);
     lua_pushnil(L);
     lua_pushfstring(L, "could not fork: %s", errmsg);
-    return 2;
+    goto nbio_execute_error;
   }
   if (!child->pid) {
     int ipcfd = sockipc[1];
-    if (dup2(sockin[1], 0) == -1) goto nbio_execute_stdio_error;
-    if (dup2(sockout[1], 1) == -1) goto nbio_execute_stdio_error;
-    if (dup2(sockerr[1], 2) == -1) goto nbio_execute_stdio_error;
+    if (dup2(fds[0], 0) == -1) goto nbio_execute_stdio_error;
+    if (dup2(fds[1], 1) == -1) goto nbio_execute_stdio_error;
+    if (dup2(fds[2], 2) == -1) goto nbio_execute_stdio_error;
     if (dup2(sockipc[1], 3) == -1) goto nbio_execute_stdio_error;
     ipcfd = 3;
     closefrom(4);
@@ -1416,56 +3968,63 @@ static int nbio_execute(lua_State *L) {
     send(ipcfd, ipcmsg, 1 + sizeof(int), 0);
     _exit(1);
   }
-  close(sockin[1]);
-  close(sockout[1]);
-  close(sockerr[1]);
+  for (int i=0; i<6; i++) if (owned[i] != -1) close(owned[i]);
   close(sockipc[1]);
-  nbio_execute_set_nonblock(L, sockin[0]);
-  nbio_execute_set_nonblock(L, sockout[0]);
-  nbio_execute_set_nonblock(L, sockerr[0]);
   while (1) {
     char ipcmsg[1 + sizeof(int)];
     ssize_t bytes = recv(sockipc[0], ipcmsg, 1 + sizeof(int), 0);
     if (bytes == -1) {
       if (errno != EINTR) {
         nbio_prepare_errmsg(errno);
-        lua_toclose(L, -1);
+        close(sockipc[0]);
+        nbio_execute_restore(handles, handle_flags);
+        lua_toclose(L, child_idx);
         lua_pushnil(L);
         lua_pushfstring(L, "error during IPC with fork: %s", errmsg);
         return 2;
       }
     } else if (bytes == 0) {
+      close(sockipc[0]);
+      lua_settop(L, child_idx);
       return 1;
     } else if (bytes == 1 + sizeof(int)) {
       char msgtype = ipcmsg[0];
       int err;
       memcpy(&err, ipcmsg + 1, sizeof(err));
+      close(sockipc[0]);
+      nbio_execute_restore(handles, handle_flags);
+      lua_toclose(L, child_idx);
       if (msgtype == 'A') {
         nbio_prepare_errmsg(err);
-        lua_toclose(L, -1);
         lua_pushnil(L);
         lua_pushfstring(L, "could not execute: %s", errmsg);
         return 2;
       } else if (msgtype == 'B') {
         nbio_prepare_errmsg(err);
-        lua_toclose(L, -1);
         lua_pushnil(L);
         lua_pushfstring(L, "could not prepare stdio in fork: %s", errmsg);
         return 2;
       } else {
-        lua_toclose(L, -1);
         lua_pushnil(L);
         lua_pushfstring(L, "error during IPC with fork: unknown message type");
         return 2;
       }
     } else {
-      lua_toclose(L, -1);
+      close(sockipc[0]);
+      nbio_execute_restore(handles, handle_flags);
+      lua_toclose(L, child_idx);
       lua_pushnil(L);
       lua_pushfstring(L, "error during IPC with fork: wrong message length");
       return 2;
     }
   }
-  return 1;
+#endif
+  // Expects nil and error message on top of stack:
+  nbio_execute_error:
+  for (int i=0; i<6; i++) if (owned[i] != -1) close(owned[i]);
+  nbio_execute_restore(handles, handle_flags);
+  lua_toclose(L, child_idx);
+  return 2;
 }
 
 // Module functions:
@@ -1473,9 +4032,18 @@ static const struct luaL_Reg nbio_module_funcs[] = {
   {"open", nbio_open},
   {"localconnect", nbio_localconnect},
   {"tcpconnect", nbio_tcpconnect},
+  {"tcpresolve", nbio_tcpresolve},
   {"locallisten", nbio_locallisten},
   {"tcplisten", nbio_tcplisten},
   {"execute", nbio_execute},
+  {"pump", nbio_pump},
+  {"buffer", nbio_buffer_new},
+  {"buffer_stats", nbio_buffer_stats},
+  {"udpbind", nbio_udpbind},
+  {"udpconnect", nbio_udpconnect},
+#if defined(NBIO_USE_OPENSSL)
+  {"tls_context", nbio_tls_context_new},
+#endif
   {NULL, NULL}
 };
 
@@ -1486,9 +4054,21 @@ static const struct luaL_Reg nbio_handle_methods[] = {
   {"read_unbuffered", nbio_handle_read_unbuffered},
   {"read", nbio_handle_read},
   {"unread", nbio_handle_unread},
+  {"read_into", nbio_handle_read_into},
   {"write_unbuffered", nbio_handle_write_unbuffered},
   {"write", nbio_handle_write},
+  {"writev_unbuffered", nbio_handle_writev_unbuffered},
+  {"writev", nbio_handle_writev},
   {"flush", nbio_handle_flush},
+  {"sendfile", nbio_handle_sendfile},
+  {"connected", nbio_handle_connected},
+#if defined(NBIO_USE_OPENSSL)
+  {"starttls", nbio_handle_starttls},
+  {"handshake", nbio_handle_handshake},
+  {"tls_info", nbio_handle_tls_info},
+#endif
+  {"setopt", nbio_handle_setopt},
+  {"getopt", nbio_handle_getopt},
   {NULL, NULL}
 };
 
@@ -1496,6 +4076,21 @@ static const struct luaL_Reg nbio_handle_methods[] = {
 static const struct luaL_Reg nbio_listener_methods[] = {
   {"close", nbio_listener_close},
   {"accept", nbio_listener_accept},
+  {"accept_many", nbio_listener_accept_many},
+  {"setopt", nbio_listener_setopt},
+  {"getopt", nbio_listener_getopt},
+  {NULL, NULL}
+};
+
+// Datagram socket handle methods:
+static const struct luaL_Reg nbio_udp_methods[] = {
+  {"close", nbio_udp_close},
+  {"send", nbio_udp_send},
+  {"send_many", nbio_udp_send_many},
+  {"recv", nbio_udp_recv},
+  {"recv_many", nbio_udp_recv_many},
+  {"setopt", nbio_udp_setopt},
+  {"getopt", nbio_udp_getopt},
   {NULL, NULL}
 };
 
@@ -1507,7 +4102,23 @@ static const struct luaL_Reg nbio_child_methods[] = {
   {NULL, NULL}
 };
 
+// Pump methods:
+static const struct luaL_Reg nbio_pump_methods[] = {
+  {"close", nbio_pump_close},
+  {"step", nbio_pump_step},
+  {NULL, NULL}
+};
+
 // I/O handle metamethods:
+static const struct luaL_Reg nbio_buffer_methods[] = {
+  {"append", nbio_buffer_append},
+  {"find", nbio_buffer_find},
+  {"sub", nbio_buffer_sub},
+  {"consume", nbio_buffer_consume},
+  {"tostring", nbio_buffer_tostring},
+  {NULL, NULL}
+};
+
 static const struct luaL_Reg nbio_handle_metamethods[] = {
   {"__close", nbio_handle_close},
   {"__gc", nbio_handle_close},
@@ -1523,6 +4134,14 @@ static const struct luaL_Reg nbio_listener_metamethods[] = {
   {NULL, NULL}
 };
 
+// Datagram socket handle metamethods:
+static const struct luaL_Reg nbio_udp_metamethods[] = {
+  {"__close", nbio_udp_close},
+  {"__gc", nbio_udp_close},
+  {"__index", nbio_udp_index},
+  {NULL, NULL}
+};
+
 // Child process handle metamethods:
 static const struct luaL_Reg nbio_child_metamethods[] = {
   {"__close", nbio_child_close},
@@ -1545,12 +4164,49 @@ int luaopen_neumond_nbio(lua_State *L) {
   luaL_setfuncs(L, nbio_listener_metamethods, 1);
   lua_pop(L, 1);
 
+  luaL_newmetatable(L, NBIO_UDP_MT_REGKEY);
+  lua_newtable(L);
+  luaL_setfuncs(L, nbio_udp_methods, 0);
+  luaL_setfuncs(L, nbio_udp_metamethods, 1);
+  lua_pop(L, 1);
+
+#if defined(NBIO_USE_OPENSSL)
+  luaL_newmetatable(L, NBIO_TLS_CONTEXT_MT_REGKEY);
+  lua_pushcfunction(L, nbio_tls_context_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, nbio_tls_context_gc);
+  lua_setfield(L, -2, "__close");
+  lua_pop(L, 1);
+#endif
+
   luaL_newmetatable(L, NBIO_CHILD_MT_REGKEY);
   lua_newtable(L);
   luaL_setfuncs(L, nbio_child_methods, 0);
   luaL_setfuncs(L, nbio_child_metamethods, 1);
   lua_pop(L, 1);
 
+  luaL_newmetatable(L, NBIO_PUMP_MT_REGKEY);
+  lua_newtable(L);
+  luaL_setfuncs(L, nbio_pump_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, nbio_pump_close);
+  lua_setfield(L, -2, "__close");
+  lua_pushcfunction(L, nbio_pump_close);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, NBIO_BUFFER_MT_REGKEY);
+  lua_newtable(L);
+  luaL_setfuncs(L, nbio_buffer_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, nbio_buffer_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, nbio_buffer_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, nbio_buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
   lua_newtable(L);
   luaL_setfuncs(L, nbio_module_funcs, 0);
   nbio_push_handle(L, 0, AF_UNSPEC, 1, 1);
@@ -82,19 +82,20 @@ end
 local function stream_until_boundary(handle, boundary, callback)
   local chunk_size = _M.streaming_chunk_size
   local rlen = chunk_size + #boundary
+  local boundary_len = #boundary
   while true do
-    local chunk = assert_io(handle:_read(rlen))
+    local chunk = assert_io(handle:_read(rlen, boundary))
     if chunk == "" then
       return false
     end
-    local pos1, pos2 = string_find(chunk, boundary, 1, true)
-    if pos1 then
-      handle:_unread(string_sub(chunk, pos2 + 1))
-      if pos1 > 1 then
-        callback(string_sub(chunk, 1, pos1 - 1))
+    if string_sub(chunk, -boundary_len) == boundary then
+      if #chunk > boundary_len then
+        callback(string_sub(chunk, 1, -boundary_len - 1))
       end
       return true
     end
+    -- Boundary may start within the last bytes, thus only pass chunk_size
+    -- bytes to callback:
     handle:_unread(string_sub(chunk, chunk_size + 1))
     callback(string_sub(chunk, 1, chunk_size))
   end
@@ -148,7 +149,7 @@ function request_methods:_read(maxlen, terminator)
     self._request_body_remaining = remaining - resultlen
     if
       resultlen >= maxlen or
-      terminator == string_sub(result, resultlen, resultlen)
+      terminator and string_sub(result, -#terminator) == terminator
     then
       return result
     end
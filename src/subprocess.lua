@@ -49,6 +49,8 @@ local no_limits = {}
 -- error message (which may be set also when the first return value is a
 -- table). The third return value is nil on success or a string being
 -- "execfail", "ioerror", "overflow", "timeout", "exitcode", or "signal".
+-- Streams redirected with an options table passed to eio.execute are neither
+-- written nor collected (the respective fields are nil then).
 function _M.execute_collect(stdin, limits, ...)
   if not limits then
     limits = no_limits
@@ -69,21 +71,33 @@ function _M.execute_collect(stdin, limits, ...)
         proc:kill(9)
       end)
     end
-    if stdin and stdin ~= "" then
-      fiber.spawn(writer, proc.stdin, stdin)
-    else
-      proc.stdin:close()
+    -- Streams redirected by options passed to eio.execute are nil:
+    if proc.stdin then
+      if stdin and stdin ~= "" then
+        fiber.spawn(writer, proc.stdin, stdin)
+      else
+        proc.stdin:close()
+      end
     end
-    local stdout_fiber = fiber.spawn(reader, proc.stdout, stdout_maxlen)
-    local stderr_fiber = fiber.spawn(reader, proc.stderr, stderr_maxlen)
+    local stdout_fiber =
+      proc.stdout and fiber.spawn(reader, proc.stdout, stdout_maxlen)
+    local stderr_fiber =
+      proc.stderr and fiber.spawn(reader, proc.stderr, stderr_maxlen)
     local proc_status = proc:wait()
     if time_exceeded then
       return nil, "child process exceeded time limit", "timeout"
     end
-    local stdout, errmsg, reader_status = stdout_fiber:await()
-    if not stdout then return nil, errmsg, reader_status end
-    local stderr, errmsg, reader_status = stderr_fiber:await()
-    if not stderr then return nil, errmsg, reader_status end
+    local stdout, stderr
+    if stdout_fiber then
+      local errmsg, reader_status
+      stdout, errmsg, reader_status = stdout_fiber:await()
+      if not stdout then return nil, errmsg, reader_status end
+    end
+    if stderr_fiber then
+      local errmsg, reader_status
+      stderr, errmsg, reader_status = stderr_fiber:await()
+      if not stderr then return nil, errmsg, reader_status end
+    end
     local result = { stdout = stdout, stderr = stderr  }
     if proc_status < 0 then
       local signal = -proc_status
@@ -11,6 +11,124 @@ local _M = {}
 
 local wait = require "neumond.wait"
 
+-- Maximum initial capacity of ring buffers (larger ring buffers start with
+-- this capacity and grow when needed):
+local ring_maxinit = 1024
+
+-- Methods for ring buffers, which store values in a fixed-size array with the
+-- keys 1 to capacity (positions are taken modulo the capacity), such that the
+-- array is reused instead of moving to ever increasing keys:
+local ring_methods = {}
+
+-- Function increasing the capacity of a ring buffer (only needed for large or
+-- unbounded queues, or when a popped value is put back into a full queue):
+local function ring_grow(self, needed)
+  local capacity = self._capacity
+  local head = self._head
+  local count = self._count
+  local values = {}
+  for i = 1, count do
+    local key = (head + i - 1) % capacity + 1
+    values[i] = self[key]
+    self[key] = nil
+  end
+  while capacity < needed do
+    capacity = capacity * 2
+  end
+  for i = 1, count do
+    self[i] = values[i]
+  end
+  self._capacity = capacity
+  self._head = 0
+end
+
+function ring_methods:push(value)
+  local count = self._count
+  if count == self._capacity then
+    ring_grow(self, count + 1)
+  end
+  self[(self._head + count) % self._capacity + 1] = value
+  self._count = count + 1
+end
+
+function ring_methods:unshift(value)
+  local count = self._count
+  if count == self._capacity then
+    ring_grow(self, count + 1)
+  end
+  local head = (self._head - 1) % self._capacity
+  self[head + 1] = value
+  self._head = head
+  self._count = count + 1
+end
+
+function ring_methods:shift()
+  local count = self._count
+  if count > 0 then
+    local key = self._head + 1
+    local value = self[key]
+    self[key] = nil
+    self._head = key % self._capacity
+    self._count = count - 1
+    return value
+  end
+end
+
+function ring_methods:push_many(values, first, last)
+  first = first or 1
+  last = last or #values
+  local count = self._count
+  local needed = count + last - first + 1
+  if needed > self._capacity then
+    ring_grow(self, needed)
+  end
+  local capacity = self._capacity
+  local pos = self._head + count
+  for i = first, last do
+    self[pos % capacity + 1] = values[i]
+    pos = pos + 1
+  end
+  self._count = needed
+end
+
+function ring_methods:shift_many(values, pos, count)
+  local available = self._count
+  if count > available then
+    count = available
+  end
+  local capacity = self._capacity
+  local head = self._head
+  for i = 0, count - 1 do
+    local key = (head + i) % capacity + 1
+    values[pos + i] = self[key]
+    self[key] = nil
+  end
+  self._head = (head + count) % capacity
+  self._count = available - count
+  return count
+end
+
+local ring_metatable = {
+  __index = ring_methods,
+  __len = function(self)
+    return self._count
+  end,
+}
+
+-- Function ring(size) creates a ring buffer for size values (which grows if
+-- more values are stored) with methods push, unshift, shift, push_many, and
+-- shift_many:
+local function ring(size)
+  local capacity = ring_maxinit
+  if size < capacity then
+    capacity = math.max(1, math.floor(size))
+  end
+  return setmetatable(
+    { _head = 0, _count = 0, _capacity = capacity },
+    ring_metatable
+  )
+end
+
 -- Alias for notify effect:
 local notify = wait.notify
 _M.notify = notify
@@ -111,117 +229,966 @@ local function mutex()
 end
 _M.mutex = mutex
 
--- Helper function doing nothing:
-local function noop()
+-- Function waiter_fifo() creates a FIFO queue of waiters, where each waiter is
+-- a table with a "closed" attribute that is set when the waiter has been
+-- closed (e.g. due to a killed fiber) and which is skipped then:
+local function waiter_fifo()
+  return { rpos = 0, wpos = 0 }
+end
+
+-- Function adding a waiter to a FIFO queue of waiters:
+local function waiter_fifo_push(fifo, waiter)
+  local wpos = fifo.wpos
+  fifo[wpos] = waiter
+  fifo.wpos = wpos + 1
+end
+
+-- Function returning the first non-closed waiter (without removing it) from a
+-- FIFO queue of waiters, or nil if there is no such waiter:
+local function waiter_fifo_peek(fifo)
+  local rpos, wpos = fifo.rpos, fifo.wpos
+  while rpos ~= wpos do
+    local waiter = fifo[rpos]
+    if not waiter.closed then
+      fifo.rpos = rpos
+      return waiter
+    end
+    fifo[rpos] = nil
+    rpos = rpos + 1
+  end
+  fifo.rpos = rpos
+  return nil
+end
+
+-- Function removing the first waiter from a FIFO queue of waiters (must only
+-- be called after waiter_fifo_peek returned a waiter):
+local function waiter_fifo_pop(fifo)
+  local rpos = fifo.rpos
+  fifo[rpos] = nil
+  fifo.rpos = rpos + 1
+end
+
+-- Function creating a waiter (with a single sleeper and waker), adding it to a
+-- FIFO queue of waiters, and waiting until it is woken. Fields of the given
+-- table are used as waiter, and the given metatable should provide a __close
+-- metamethod that handles closing the waiter while it is queued or being
+-- woken (waiter.waking is true in the latter case):
+local function wait_in_fifo(fifo, waiter, metatable)
+  local sleeper, waker = notify()
+  waiter.waker = waker
+  waiter.waking = false
+  waiter.closed = false
+  local waiter <close> = setmetatable(waiter, metatable)
+  waiter_fifo_push(fifo, waiter)
+  sleeper()
+  -- Mark waiter as woken, such that closing it has no further effect:
+  waiter.waking = false
+  waiter.closed = true
+end
+
+-- Methods for counting semaphores:
+local semaphore_methods = {}
+
+-- Function waking waiters of a semaphore in FIFO order as long as enough
+-- permits are available for the first waiter:
+local function semaphore_grant(self)
+  local waiters = self._waiters
+  while true do
+    local waiter = waiter_fifo_peek(waiters)
+    if not waiter or waiter.count > self.available then
+      return
+    end
+    waiter_fifo_pop(waiters)
+    -- Transfer permits to waiter before waking it:
+    self.available = self.available - waiter.count
+    waiter.waking = true
+    waiter.waker()
+  end
+end
+
+-- Metatable for guards returned when acquiring permits of a semaphore:
+local semaphore_guard_metatable = {
+  __close = function(self)
+    self.semaphore:release(self.count)
+  end,
+}
+
+-- Metatable for waiters of a semaphore:
+local semaphore_waiter_metatable = {
+  __close = function(self)
+    local semaphore = self.semaphore
+    -- Check if this waiter is currently waking up:
+    if self.waking then
+      -- Waiter has already been granted its permits but is closed before
+      -- wakeup was completed (e.g. due to canceled task).
+      -- Give permits back:
+      semaphore:release(self.count)
+    elseif not self.closed then
+      -- Waiter is still queued.
+      -- Mark waiter as closed and wake any waiters that have been blocked by
+      -- this waiter (which might have waited for more permits):
+      self.closed = true
+      semaphore_grant(semaphore)
+    end
+  end,
+}
+
+-- Method that returns a guard for the given number of permits (defaults to 1)
+-- without waiting, or nil if the permits are not available immediately:
+function semaphore_methods:try_acquire(count)
+  count = count or 1
+  if count <= self.available and not waiter_fifo_peek(self._waiters) then
+    self.available = self.available - count
+    if count == 1 then
+      return self._guard
+    end
+    return setmetatable(
+      { semaphore = self, count = count }, semaphore_guard_metatable
+    )
+  end
+  return nil
+end
+
+-- Method that waits until the given number of permits (defaults to 1) can be
+-- acquired and returns a to-be-closed guard that releases the permits:
+function semaphore_methods:acquire(count)
+  count = count or 1
+  -- Check if permits are available and no other waiter is queued (waiters are
+  -- served in FIFO order to avoid starvation of waiters for many permits):
+  if count <= self.available and not waiter_fifo_peek(self._waiters) then
+    self.available = self.available - count
+  else
+    wait_in_fifo(
+      self._waiters,
+      { semaphore = self, count = count },
+      semaphore_waiter_metatable
+    )
+  end
+  if count == 1 then
+    return self._guard
+  end
+  return setmetatable(
+    { semaphore = self, count = count }, semaphore_guard_metatable
+  )
+end
+
+-- Method that releases the given number of permits (defaults to 1):
+function semaphore_methods:release(count)
+  self.available = self.available + (count or 1)
+  semaphore_grant(self)
+end
+
+-- Metatable for counting semaphores:
+local semaphore_metatable = {
+  __index = semaphore_methods,
+  __call = semaphore_methods.acquire,
+}
+
+-- Function semaphore(permits) creates a counting semaphore with the given
+-- number of initially available permits (defaults to 1):
+function _M.semaphore(permits)
+  local semaphore = setmetatable(
+    {
+      available = permits or 1, -- number of available permits
+      _waiters = waiter_fifo(), -- FIFO queue of waiters
+    },
+    semaphore_metatable
+  )
+  -- Guard for a single permit (reused for all acquisitions of one permit):
+  semaphore._guard = setmetatable(
+    { semaphore = semaphore, count = 1 }, semaphore_guard_metatable
+  )
+  return semaphore
+end
+
+-- Methods for read-write locks:
+local rwlock_methods = {}
+
+-- Function waking waiters of a read-write lock in FIFO order as long as they
+-- can proceed, i.e. either a single writer or all readers up to the next
+-- writer:
+local function rwlock_grant(self)
+  local waiters = self._waiters
+  while not self.writing do
+    local waiter = waiter_fifo_peek(waiters)
+    if not waiter then
+      return
+    end
+    if waiter.exclusive then
+      if self.reading > 0 then
+        return
+      end
+      self.writing = true
+    else
+      self.reading = self.reading + 1
+    end
+    waiter_fifo_pop(waiters)
+    waiter.waking = true
+    waiter.waker()
+  end
+end
+
+-- Function releasing a read lock:
+local function rwlock_unlock_read(self)
+  local reading = self.reading - 1
+  self.reading = reading
+  if reading == 0 then
+    rwlock_grant(self)
+  end
+end
+
+-- Function releasing a write lock:
+local function rwlock_unlock_write(self)
+  self.writing = false
+  rwlock_grant(self)
+end
+
+-- Metatables for guards returned when locking a read-write lock:
+local rwlock_read_guard_metatable = {
+  __close = function(self)
+    rwlock_unlock_read(self.rwlock)
+  end,
+}
+local rwlock_write_guard_metatable = {
+  __close = function(self)
+    rwlock_unlock_write(self.rwlock)
+  end,
+}
+
+-- Metatable for waiters of a read-write lock:
+local rwlock_waiter_metatable = {
+  __close = function(self)
+    local rwlock = self.rwlock
+    -- Check if this waiter is currently waking up:
+    if self.waking then
+      -- Waiter has already been granted the lock but is closed before wakeup
+      -- was completed (e.g. due to canceled task).
+      -- Unlock again:
+      if self.exclusive then
+        rwlock_unlock_write(rwlock)
+      else
+        rwlock_unlock_read(rwlock)
+      end
+    elseif not self.closed then
+      -- Waiter is still queued.
+      -- Mark waiter as closed and wake any waiters that have been blocked by
+      -- this waiter:
+      self.closed = true
+      rwlock_grant(rwlock)
+    end
+  end,
+}
+
+-- Method that waits until the lock can be shared with other readers and
+-- returns a to-be-closed guard that releases the lock (readers have to wait
+-- for any queued writer to avoid starvation of writers):
+function rwlock_methods:read()
+  if not self.writing and not waiter_fifo_peek(self._waiters) then
+    self.reading = self.reading + 1
+  else
+    wait_in_fifo(
+      self._waiters,
+      { rwlock = self, exclusive = false },
+      rwlock_waiter_metatable
+    )
+  end
+  return self._read_guard
+end
+
+-- Method that waits until the lock can be held exclusively and returns a
+-- to-be-closed guard that releases the lock:
+function rwlock_methods:write()
+  if
+    not self.writing and self.reading == 0 and
+    not waiter_fifo_peek(self._waiters)
+  then
+    self.writing = true
+  else
+    wait_in_fifo(
+      self._waiters,
+      { rwlock = self, exclusive = true },
+      rwlock_waiter_metatable
+    )
+  end
+  return self._write_guard
+end
+
+-- Metatable for read-write locks:
+local rwlock_metatable = {
+  __index = rwlock_methods,
+}
+
+-- Function rwlock() creates a read-write lock:
+function _M.rwlock()
+  local rwlock = setmetatable(
+    {
+      reading = 0, -- number of readers holding the lock
+      writing = false, -- true if a writer holds the lock
+      _waiters = waiter_fifo(), -- FIFO queue of waiters
+    },
+    rwlock_metatable
+  )
+  rwlock._read_guard = setmetatable(
+    { rwlock = rwlock }, rwlock_read_guard_metatable
+  )
+  rwlock._write_guard = setmetatable(
+    { rwlock = rwlock }, rwlock_write_guard_metatable
+  )
+  return rwlock
+end
+
+-- Methods for condition variables:
+local condition_methods = {}
+
+-- Metatable for waiters of a condition variable:
+local condition_waiter_metatable = {
+  __close = function(self)
+    -- Check if this waiter is currently waking up due to a signal:
+    if self.waking then
+      -- Waiter is closed before wakeup was completed (e.g. due to canceled
+      -- task).
+      -- Pass signal to next waiter:
+      self.condition:signal()
+    else
+      -- Mark waiter as closed, so it is not woken up in future:
+      self.closed = true
+    end
+  end,
+}
+
+-- Method that waits until signal or broadcast is called:
+function condition_methods:wait()
+  wait_in_fifo(
+    self._waiters, { condition = self }, condition_waiter_metatable
+  )
+end
+
+-- Method that wakes the longest waiting waiter (if any) and returns true if a
+-- waiter was woken:
+function condition_methods:signal()
+  local waiters = self._waiters
+  local waiter = waiter_fifo_peek(waiters)
+  if waiter then
+    waiter_fifo_pop(waiters)
+    waiter.waking = true
+    waiter.waker()
+    return true
+  end
+  return false
+end
+
+-- Method that wakes all currently waiting waiters:
+function condition_methods:broadcast()
+  local waiters = self._waiters
+  local wpos = waiters.wpos
+  -- Only wake waiters that have been queued before calling this method:
+  while waiters.rpos ~= wpos do
+    local waiter = waiter_fifo_peek(waiters)
+    if not waiter then
+      return
+    end
+    waiter_fifo_pop(waiters)
+    -- No need to mark waiter as waking, because closing a waiter during
+    -- wakeup must not wake any other waiter in case of a broadcast:
+    waiter.waker()
+  end
+end
+
+-- Metatable for condition variables:
+local condition_metatable = {
+  __index = condition_methods,
+}
+
+-- Function condition() creates a condition variable:
+function _M.condition()
+  return setmetatable({ _waiters = waiter_fifo() }, condition_metatable)
+end
+
+-- Methods for wait groups:
+local waitgroup_methods = {}
+
+-- Metatable for waiters of a wait group:
+local waitgroup_waiter_metatable = {
+  __close = function(self)
+    self.closed = true
+  end,
+}
+
+-- Method that adds a (possibly negative) number to the counter (defaults to
+-- 1) and wakes all waiters if the counter becomes zero:
+function waitgroup_methods:add(delta)
+  local count = self.count + (delta or 1)
+  if count < 0 then
+    error("negative counter in wait group", 2)
+  end
+  self.count = count
+  if count == 0 then
+    local waiters = self._waiters
+    while true do
+      local waiter = waiter_fifo_peek(waiters)
+      if not waiter then
+        break
+      end
+      waiter_fifo_pop(waiters)
+      waiter.waker()
+    end
+  end
+end
+
+-- Method that decrements the counter:
+function waitgroup_methods:done()
+  return self:add(-1)
+end
+
+-- Method that waits until the counter is zero:
+function waitgroup_methods:wait()
+  if self.count > 0 then
+    wait_in_fifo(self._waiters, {}, waitgroup_waiter_metatable)
+  end
+end
+
+-- Metatable for wait groups:
+local waitgroup_metatable = {
+  __index = waitgroup_methods,
+}
+
+-- Function waitgroup() creates a wait group with a counter of zero:
+function _M.waitgroup()
+  return setmetatable(
+    { count = 0, _waiters = waiter_fifo() }, waitgroup_metatable
+  )
 end
 
 -- Methods for FIFO queues with backpressure:
 local queue_methods = {}
 
+-- Function returning the number of values that can be written to a queue
+-- without waiting, i.e. free space in the buffer plus number of waiting
+-- poppers, minus space reserved for woken pushers:
+local function queue_room(self)
+  return self.size + self._pending_pops - #self._buffer - self._reserved
+end
+
+-- Function waking waiting pushers as long as there is room for their values
+-- (woken pushers write their values themselves when resumed, such that a
+-- value is never popped before the corresponding push has returned):
+local function queue_grant(self)
+  local pushers = self._pushers
+  while true do
+    local room = queue_room(self)
+    if room <= 0 then
+      return
+    end
+    local pusher = waiter_fifo_peek(pushers)
+    if not pusher then
+      return
+    end
+    waiter_fifo_pop(pushers)
+    -- Reserve room for (some or all) values of the pusher:
+    local granted = pusher.count
+    if granted > room then
+      granted = room
+    end
+    pusher.granted = granted
+    self._reserved = self._reserved + granted
+    pusher.waking = true
+    pusher.waker()
+  end
+end
+
+-- Function passing a value to the first waiting popper, returns false if
+-- there is no waiting popper:
+local function queue_give_to_popper(self, value)
+  local poppers = self._poppers
+  local popper = waiter_fifo_peek(poppers)
+  if not popper then
+    return false
+  end
+  waiter_fifo_pop(poppers)
+  self._pending_pops = self._pending_pops - 1
+  popper.value = value
+  popper.waking = true
+  popper.waker()
+  return true
+end
+
+-- Metatable for waiters of a queue that wait for pushing:
+local queue_pusher_metatable = {
+  __close = function(self)
+    local queue = self.queue
+    -- Check if this waiter is currently waking up:
+    if self.waking then
+      -- Room has been reserved for waiter but waiter is closed before wakeup
+      -- was completed (e.g. due to canceled task).
+      -- Release reserved room and wake other pushers instead:
+      queue._reserved = queue._reserved - self.granted
+      queue._pending_pushes = queue._pending_pushes - self.count
+      queue_grant(queue)
+    elseif not self.closed then
+      -- Waiter is still queued.
+      -- Mark waiter as closed and undo counting of pending pushes:
+      self.closed = true
+      queue._pending_pushes = queue._pending_pushes - self.count
+    end
+  end,
+}
+
+-- Metatable for waiters of a queue that wait for popping:
+local queue_popper_metatable = {
+  __close = function(self)
+    local queue = self.queue
+    -- Check if this waiter is currently waking up:
+    if self.waking then
+      -- Waiter has already received a value but is closed before wakeup was
+      -- completed (e.g. due to canceled task).
+      -- Pass value to next waiting popper or put it back into the buffer:
+      if not queue_give_to_popper(queue, self.value) then
+        queue._buffer:unshift(self.value)
+      end
+    elseif not self.closed then
+      -- Waiter is still queued.
+      -- Mark waiter as closed and undo counting of pending pop:
+      self.closed = true
+      queue._pending_pops = queue._pending_pops - 1
+    end
+  end,
+}
+
+-- Function that waits until room for up to count values has been reserved,
+-- and returns the number of values that may be written:
+local function queue_wait_push(self, count)
+  self._pending_pushes = self._pending_pushes + count
+  local waiter = { queue = self, count = count, granted = 0 }
+  wait_in_fifo(self._pushers, waiter, queue_pusher_metatable)
+  local granted = waiter.granted
+  self._reserved = self._reserved - granted
+  self._pending_pushes = self._pending_pushes - count
+  return granted
+end
+
 -- Method that pushes a value into a queue:
 function queue_methods:push(value)
-  -- Serialize all pushes in a fair manner:
-  local mutex_guard <close> = self._writer_mutex()
-  -- Check if too many entries have been written or are waiting:
-  local old_used = self._used
-  if old_used >= self.size then
-    -- Too many entries have been written or are waiting.
-    -- Count pending push:
-    self._used = old_used + 1
-    -- Undo counting of pending push when woken or canceled:
-    local writer_guard <close> = self._writer_guard
-    -- Sleep with possibility to be woken:
-    local sleeper, waker = notify()
-    self._writer_waker = waker
-    sleeper()
-    self._writer_waker = noop
-  end
-  -- Write entry into queue:
-  local old_wpos = self._buffer_wpos
-  self._buffer[old_wpos] = value
-  self._buffer_wpos = old_wpos + 1
-  -- Count written entry:
-  self._used = self._used + 1
-  -- Wakeup any sleeping reader if exists:
-  self._reader_waker()
+  local buffer = self._buffer
+  -- Check if there are no waiters and there is room in the buffer:
+  if
+    self._pending_pushes == 0 and self._pending_pops == 0 and
+    #buffer < self.size
+  then
+    -- Write value into buffer:
+    buffer:push(value)
+    return
+  end
+  -- Wait unless there is room and no other pusher is waiting:
+  if queue_room(self) <= 0 or waiter_fifo_peek(self._pushers) then
+    queue_wait_push(self, 1)
+  end
+  -- Pass value directly to waiting popper, if exists, or write value into
+  -- buffer otherwise:
+  if not queue_give_to_popper(self, value) then
+    buffer:push(value)
+  end
+end
+
+-- Method that pushes several values (given as a table with optional first and
+-- last index) into a queue, writing as many values as possible whenever there
+-- is room:
+function queue_methods:push_many(values, first, last)
+  first = first or 1
+  last = last or #values
+  local buffer = self._buffer
+  while first <= last do
+    -- Determine how many values can be written, waiting if necessary:
+    local count = last - first + 1
+    local room = queue_room(self)
+    if room <= 0 or waiter_fifo_peek(self._pushers) then
+      count = queue_wait_push(self, count)
+    elseif count > room then
+      count = room
+    end
+    -- Pass values directly to waiting poppers, if exist, and write remaining
+    -- values into buffer:
+    local stop = first + count - 1
+    while first <= stop and queue_give_to_popper(self, values[first]) do
+      first = first + 1
+    end
+    if first <= stop then
+      buffer:push_many(values, first, stop)
+      first = stop + 1
+    end
+  end
 end
 
 -- Method that pops a value from a queue:
 function queue_methods:pop()
-  -- Serialize all pops in a fair manner:
-  local mutex_guard <close> = self._reader_mutex()
-  -- Wakeup any sleeping writer if exists:
-  self._writer_waker()
-  -- Check if no entry is available:
-  local old_rpos = self._buffer_rpos
-  if self._buffer_wpos == self._buffer_rpos then
-    -- No entry is available.
-    -- Count pending pop:
-    self._used = self._used - 1
-    -- Undo counting of pending pop when woken or canceled:
-    local reader_guard <close> = self._reader_guard
-    -- Sleep with possibility to be woken:
-    local sleeper, waker = notify()
-    self._reader_waker = waker
-    sleeper()
-    self._reader_waker = noop
-  end
-  -- Read value from queue:
-  local value = self._buffer[old_rpos]
-  self._buffer_rpos = old_rpos + 1
-  -- Count read entry:
-  self._used = self._used - 1
-  -- Return read value:
-  return value
+  local buffer = self._buffer
+  -- Check if buffer contains a value:
+  if #buffer > 0 then
+    -- Buffer contains a value.
+    -- Read value from buffer and wake pushers that may use the free space:
+    local value = buffer:shift()
+    if self._pending_pushes > 0 then
+      queue_grant(self)
+    end
+    return value
+  end
+  -- Buffer is empty.
+  -- Count pending pop, wake pushers that may pass a value (only happens if
+  -- queue size is zero), and wait until a value has been passed:
+  self._pending_pops = self._pending_pops + 1
+  queue_grant(self)
+  local waiter = { queue = self }
+  wait_in_fifo(self._poppers, waiter, queue_popper_metatable)
+  return waiter.value
+end
+
+-- Method that pops at least one and at most max_count values (defaults to
+-- all available values) from a queue and returns them as a sequence:
+function queue_methods:pop_many(max_count)
+  max_count = max_count or math.maxinteger
+  local buffer = self._buffer
+  local values = {}
+  local count = 0
+  -- Wait for a single value if no value is available:
+  if #buffer == 0 then
+    values[1] = self:pop()
+    count = 1
+  end
+  -- Take further values from buffer without waiting:
+  if count < max_count and #buffer > 0 then
+    buffer:shift_many(values, count + 1, max_count - count)
+    queue_grant(self)
+  end
+  return values
 end
 
 -- Metatable for FIFO queues with backpressure:
 local queue_metatable = {
   __index = queue_methods,
   __len = function(self)
-    return self._used
+    return #self._buffer + self._pending_pushes - self._pending_pops
   end,
 }
 
--- Metatable for helper guard that undoes counting a pending push:
-local queue_writer_guard_metatable = {
+-- Function queue(size) returns a new queue with given size:
+function _M.queue(size)
+  return setmetatable(
+    {
+      _buffer = ring(size), -- ring buffer with buffered entries
+      _pushers = waiter_fifo(), -- FIFO queue of waiting pushers
+      _poppers = waiter_fifo(), -- FIFO queue of waiting poppers
+      _pending_pushes = 0, -- number of values of waiting pushers
+      _pending_pops = 0, -- number of waiting poppers
+      _reserved = 0, -- room reserved for woken pushers
+      size = size, -- maximum number of buffered entries
+    },
+    queue_metatable
+  )
+end
+
+-- Function waking the first non-closed waiter of a FIFO queue of waiters,
+-- where each woken waiter is expected to call this function again to wake the
+-- next waiter (such that waking all waiters costs O(1) for the caller):
+local function broadcast_relay(fifo)
+  local waiter = waiter_fifo_peek(fifo)
+  if waiter then
+    waiter_fifo_pop(fifo)
+    waiter.waking = true
+    waiter.waker()
+  end
+end
+
+-- Metatable for waiters of broadcast channels:
+local broadcast_waiter_metatable = {
   __close = function(self)
-    local queue = self.queue
-    queue._used = queue._used - 1
+    -- Check if this waiter is currently waking up:
+    if self.waking then
+      -- Waiter is closed before wakeup was completed (e.g. due to canceled
+      -- task).
+      -- Wake next waiter instead:
+      broadcast_relay(self.fifo)
+    else
+      -- Mark waiter as closed, so it is not woken up in future:
+      self.closed = true
+    end
   end,
 }
 
--- Metatable for helper guard that undoes counting a pending pop:
-local queue_reader_guard_metatable = {
-  __close = function(self)
-    local queue = self.queue
-    queue._used = queue._used + 1
-  end,
+-- Methods for broadcast channels:
+local broadcast_methods = {}
+
+-- Method that publishes a value to all subscribers:
+function broadcast_methods:publish(value)
+  if value == nil then
+    error("cannot publish nil", 2)
+  end
+  if self.closed then
+    error("broadcast channel has been closed", 2)
+  end
+  -- Overwrite oldest value in ring buffer:
+  local seq = self._seq
+  self._values[seq % self.capacity + 1] = value
+  self._seq = seq + 1
+  -- Detach list of waiters and wake first waiter, which wakes the next one:
+  local waiters = self._waiters
+  if waiters.rpos ~= waiters.wpos then
+    self._waiters = waiter_fifo()
+    broadcast_relay(waiters)
+  end
+end
+
+-- Method that closes a broadcast channel, such that subscribers receive nil
+-- after having received all remaining values:
+function broadcast_methods:close()
+  self.closed = true
+  local waiters = self._waiters
+  self._waiters = waiter_fifo()
+  broadcast_relay(waiters)
+end
+
+-- Methods for subscribers of broadcast channels:
+local broadcast_subscriber_methods = {}
+
+-- Method that waits for and returns the next value, or returns nil if the
+-- channel has been closed, or returns nil and an error message if the
+-- subscriber has been dropped because it lagged behind:
+function broadcast_subscriber_methods:recv()
+  local channel = self.channel
+  while true do
+    if self.dropped then
+      return nil, "subscriber dropped due to lag"
+    end
+    local cursor = self.cursor
+    local seq = channel._seq
+    -- Check if there is a value that has not been received yet:
+    if cursor < seq then
+      -- There is a value that has not been received yet.
+      -- Check if values have been overwritten before being received:
+      local oldest = seq - channel.capacity
+      if cursor < oldest then
+        -- Values have been overwritten.
+        -- Drop subscriber or skip missed values, depending on policy:
+        if channel.policy == "drop" then
+          self.dropped = true
+          return nil, "subscriber dropped due to lag"
+        end
+        self.lagged = self.lagged + (oldest - cursor)
+        cursor = oldest
+      end
+      self.cursor = cursor + 1
+      return channel._values[cursor % channel.capacity + 1]
+    end
+    -- No value is available.
+    -- Return nil if channel has been closed, or wait otherwise:
+    if channel.closed then
+      return nil
+    end
+    local fifo = channel._waiters
+    wait_in_fifo(fifo, { fifo = fifo }, broadcast_waiter_metatable)
+    -- Wake next waiter:
+    broadcast_relay(fifo)
+  end
+end
+
+-- Metatable for subscribers of broadcast channels:
+local broadcast_subscriber_metatable = {
+  __index = broadcast_subscriber_methods,
 }
 
--- Function queue(size) returns a new queue with given size:
-function _M.queue(size)
-  local queue = setmetatable(
+-- Method that creates a new subscriber, which will receive all values
+-- published after subscribing:
+function broadcast_methods:subscribe()
+  return setmetatable(
     {
-      _buffer = {}, -- buffered entries in queue
-      _buffer_rpos = 0, -- read position in buffer
-      _buffer_wpos = 0, -- write position in buffer
-      _writer_waker = noop, -- wakes sleeping writer if existent
-      _reader_waker = noop, -- wakes sleeping reader if existent
-      _writer_mutex = mutex(), -- mutex for push method
-      _reader_mutex = mutex(), -- mutex for pop method
-      size = size, -- maximum number of buffered entries
-      _used = 0, -- number of buffered entries plus minus pending
+      channel = self,
+      cursor = self._seq, -- sequence number of next value to receive
+      lagged = 0, -- number of skipped values (with policy "lag")
+      dropped = false, -- set when dropped (with policy "drop")
     },
-    queue_metatable
+    broadcast_subscriber_metatable
   )
-  queue._writer_guard = setmetatable(
-    {queue = queue}, queue_writer_guard_metatable
+end
+
+-- Metatable for broadcast channels:
+local broadcast_metatable = {
+  __index = broadcast_methods,
+}
+
+-- Function broadcast(capacity, policy) creates a broadcast channel which keeps
+-- the last capacity values, where policy determines whether subscribers that
+-- lag behind skip missed values ("lag", default) or are dropped ("drop"):
+function _M.broadcast(capacity, policy)
+  policy = policy or "lag"
+  if policy ~= "lag" and policy ~= "drop" then
+    error("unsupported policy for broadcast channel", 2)
+  end
+  if capacity < 1 then
+    error("capacity of broadcast channel must be positive", 2)
+  end
+  return setmetatable(
+    {
+      _values = {}, -- ring buffer with last published values
+      _seq = 0, -- sequence number of next published value
+      _waiters = waiter_fifo(), -- FIFO queue of waiting subscribers
+      capacity = capacity, -- size of ring buffer
+      policy = policy, -- policy for lagging subscribers
+      closed = false, -- set when channel has been closed
+    },
+    broadcast_metatable
   )
-  queue._reader_guard = setmetatable(
-    {queue = queue}, queue_reader_guard_metatable
+end
+
+-- Function closing a waiter that has been registered by a select operation
+-- (using the __close metamethod of the waiter's metatable):
+local function select_close_registration(registration)
+  getmetatable(registration).__close(registration)
+end
+
+-- Function called when a queue wakes a waiter registered by a select
+-- operation, which closes all other registrations of the select operation
+-- (such that only one operation is performed) and wakes the selecting task:
+local function select_fire(state, registration)
+  state.fired = registration
+  for _, other in ipairs(state.registrations) do
+    if other ~= registration then
+      select_close_registration(other)
+    end
+  end
+  state.waker()
+end
+
+-- Metatable for the state of a select operation, which closes all
+-- registrations of queue waiters when closed:
+local select_state_metatable = {
+  __close = function(self)
+    for _, registration in ipairs(self.registrations) do
+      select_close_registration(registration)
+    end
+  end,
+}
+
+-- Function registering a waiter of a select operation for a queue case:
+local function select_register(state, fifo, registration, metatable)
+  registration.waker = function()
+    select_fire(state, registration)
+  end
+  registration.waking = false
+  registration.closed = false
+  setmetatable(registration, metatable)
+  local registrations = state.registrations
+  registrations[#registrations+1] = registration
+  waiter_fifo_push(fifo, registration)
+end
+
+-- Function select(...) waits until one of several cases (each given as a
+-- table) can be performed, performs only that case, and returns its index
+-- (and the popped value for "pop" cases):
+function _M.select(...)
+  local cases = table.pack(...)
+  -- Check if a case can be performed without waiting (in order):
+  for idx = 1, cases.n do
+    local case = cases[idx]
+    local ctype, arg = case[1], case[2]
+    if ctype == "pop" then
+      if #arg._buffer > 0 then
+        return idx, arg:pop()
+      end
+    elseif ctype == "push" then
+      if queue_room(arg) > 0 and not waiter_fifo_peek(arg._pushers) then
+        arg:push(case[3])
+        return idx
+      end
+    elseif ctype == "handle" then
+      if arg.ready then
+        return idx
+      end
+    elseif ctype == "sleeper" then
+      if arg.ready then
+        arg.ready = false
+        return idx
+      end
+    elseif ctype ~= "fd_read" and ctype ~= "fd_write" then
+      error("unsupported select case type", 2)
+    end
+  end
+  -- No case can be performed immediately.
+  -- Register waiters for all queue cases, which share a single sleeper:
+  local sleeper, waker = notify()
+  local state <close> = setmetatable(
+    { registrations = {}, fired = false, waker = waker },
+    select_state_metatable
   )
-  return queue
+  local select_args = { "handle", sleeper }
+  for idx = 1, cases.n do
+    local case = cases[idx]
+    local ctype, arg = case[1], case[2]
+    if ctype == "pop" then
+      arg._pending_pops = arg._pending_pops + 1
+      select_register(
+        state, arg._poppers, { queue = arg, index = idx },
+        queue_popper_metatable
+      )
+      -- Wake pushers that may pass a value:
+      queue_grant(arg)
+    elseif ctype == "push" then
+      arg._pending_pushes = arg._pending_pushes + 1
+      select_register(
+        state, arg._pushers,
+        { queue = arg, index = idx, count = 1, granted = 0 },
+        queue_pusher_metatable
+      )
+    else
+      select_args[#select_args+1] = ctype == "sleeper" and "handle" or ctype
+      select_args[#select_args+1] = arg
+    end
+    -- Stop registering if a registration has been woken already:
+    if state.fired then
+      break
+    end
+  end
+  -- Wait until a queue waiter has been woken, a handle is ready, or a file
+  -- descriptor is ready:
+  while true do
+    local event_type, event_arg = wait.select(table.unpack(select_args))
+    -- Check if a queue waiter has been woken:
+    local registration = state.fired
+    if registration then
+      -- A queue waiter has been woken.
+      -- Mark waiter as woken, such that closing it has no further effect:
+      registration.waking = false
+      registration.closed = true
+      local idx = registration.index
+      local queue = registration.queue
+      if cases[idx][1] == "pop" then
+        -- Return value that has been passed to waiter:
+        return idx, registration.value
+      end
+      -- Write value for which room has been reserved:
+      queue._reserved = queue._reserved - registration.granted
+      queue._pending_pushes = queue._pending_pushes - 1
+      local value = cases[idx][3]
+      if not queue_give_to_popper(queue, value) then
+        queue._buffer:push(value)
+      end
+      return idx
+    end
+    -- Check if a handle is ready or a file descriptor event occurred:
+    for idx = 1, cases.n do
+      local case = cases[idx]
+      local ctype, arg = case[1], case[2]
+      if ctype == "handle" then
+        if arg.ready then
+          return idx
+        end
+      elseif ctype == "sleeper" then
+        if arg.ready then
+          arg.ready = false
+          return idx
+        end
+      elseif ctype == event_type and arg == event_arg then
+        return idx
+      end
+    end
+  end
 end
 
 return _M
@@ -22,6 +22,9 @@ local effect = require "neumond.effect"
 --   * "fd_read" followed by an integer file descriptor
 --   * "fd_write" followed by an integer file descriptor
 --   * "pid" followed by an integer process ID
+-- and to return "fd_read" or "fd_write" followed by the file descriptor if
+-- the wakeup was caused by a file descriptor becoming ready (otherwise nothing
+-- is returned):
 _M.select = effect.new("wait.select")
 
 -- Effect timeout(seconds) starts a one-shot timer and returns a (to-be-closed)
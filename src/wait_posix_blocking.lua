@@ -59,6 +59,24 @@ function _M.run(...)
   local function make_ready()
     ready = true
   end
+  -- Type and argument of the first file descriptor event that occurred while
+  -- waiting, which are returned by wait_select:
+  local event_type, event_arg
+  -- Callbacks for file descriptor events (cached per file descriptor):
+  local fd_read_callbacks, fd_write_callbacks = {}, {}
+  local function fd_callback(callbacks, rtype, fd)
+    local callback = callbacks[fd]
+    if not callback then
+      callback = function()
+        ready = true
+        if not event_type then
+          event_type, event_arg = rtype, fd
+        end
+      end
+      callbacks[fd] = callback
+    end
+    return callback
+  end
   local function wait_select(...)
     local poll_state <close> = poll_state
     for argidx = 1, math.huge, 2 do
@@ -68,10 +86,14 @@ function _M.run(...)
       end
       if rtype == "fd_read" then
         read_fds[arg] = true
-        eventqueue:add_fd_read_once(arg, make_ready)
+        eventqueue:add_fd_read_once(
+          arg, fd_callback(fd_read_callbacks, "fd_read", arg)
+        )
       elseif rtype == "fd_write" then
         write_fds[arg] = true
-        eventqueue:add_fd_write_once(arg, make_ready)
+        eventqueue:add_fd_write_once(
+          arg, fd_callback(fd_write_callbacks, "fd_write", arg)
+        )
       elseif rtype == "pid" then
         pids[arg] = true
         eventqueue:add_pid(arg, make_ready)
@@ -85,9 +107,11 @@ function _M.run(...)
       end
     end
     ready = false
+    event_type, event_arg = nil, nil
     while not ready do
       eventqueue:wait(call)
     end
+    return event_type, event_arg
   end
   local signal_handles = {}
   local function catch_signal(sig)
@@ -119,7 +143,7 @@ function _M.run(...)
     local inner_handle = self._inner_handle
     self._inner_handle = nil
     if inner_handle then
-      eventqueue:remove_timeout(seconds, inner_handle)
+      eventqueue:remove_timeout(inner_handle)
     end
   end
   local timeout_metatable = {
@@ -147,7 +171,7 @@ function _M.run(...)
     local inner_handle = self._inner_handle
     self._inner_handle = nil
     if inner_handle then
-      eventqueue:remove_interval(seconds, inner_handle)
+      eventqueue:remove_interval(inner_handle)
     end
   end
   local interval_metatable = {
@@ -186,24 +210,12 @@ function _M.run(...)
   end
   return effect.handle(
     {
-      [wait.select] = function(resume, ...)
-        return resume:call(wait_select, ...)
-      end,
-      [wait.timeout] = function(resume, seconds)
-        return resume:call(timeout, seconds)
-      end,
-      [wait.interval] = function(resume, seconds)
-        return resume:call(interval, seconds)
-      end,
-      [wait.notify] = function(resume)
-        return resume:call(notify)
-      end,
-      [wait_posix.deregister_fd] = function(resume, ...)
-        return resume()
-      end,
-      [wait_posix.catch_signal] = function(resume, sig)
-        return resume:call(catch_signal, sig)
-      end,
+      [wait.select] = effect.direct(wait_select),
+      [wait.timeout] = effect.direct(timeout),
+      [wait.interval] = effect.direct(interval),
+      [wait.notify] = effect.direct(notify),
+      [wait_posix.deregister_fd] = effect.direct(function() end),
+      [wait_posix.catch_signal] = effect.direct(catch_signal),
     },
     ...
   )
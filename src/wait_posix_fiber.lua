@@ -10,6 +10,7 @@ _ENV = setmetatable({}, {
 -- Table containing all public items of this module:
 local _M = {}
 
+local effect = require "neumond.effect"
 local fiber = require "neumond.fiber"
 local wait = require "neumond.wait"
 local wait_posix = require "neumond.wait_posix"
@@ -38,8 +39,121 @@ local handle_reset_metatable = {
   __call = handle_call_reset,
 }
 
+-- Maximum processor time (in seconds) spent on garbage collection whenever
+-- the event loop is idle, or false to leave garbage collection to Lua's
+-- automatic collector:
+_M.gc_budget = 0.001
+
+-- Heap growth factor (relative to the heap size after the last collection
+-- cycle) that starts a collection cycle during idle time:
+_M.gc_threshold = 1.25
+
+-- Pause of the automatic collector (in percent) while the event loop is
+-- running, which should be large enough such that automatic collection only
+-- happens if there is not enough idle time, or false to leave the pause
+-- unchanged:
+_M.gc_pause = 300
+
+-- Time (in seconds) that the event loop waits for events between two slices
+-- of garbage collection during idle time (such that an idle process does not
+-- keep the processor busy until a collection cycle has been completed):
+_M.gc_interval = 0.001
+
+-- Function setting the pause of the collector and returning the previous
+-- pause, or nil if this Lua version does not allow querying the pause (Lua
+-- 5.5 sets parameters individually, while Lua 5.4 still supports the
+-- deprecated "setpause" option):
+local set_gc_pause
+if pcall(collectgarbage, "param", "pause") then
+  function set_gc_pause(pause)
+    return collectgarbage("param", "pause", pause)
+  end
+else
+  local success, previous = pcall(collectgarbage, "setpause", 200)
+  if success then
+    collectgarbage("setpause", previous)
+    function set_gc_pause(pause)
+      return collectgarbage("setpause", pause)
+    end
+  end
+end
+
+-- Switches the collector to incremental mode with given pause (if the pause
+-- can be restored later) and returns a to-be-closed guard that restores the
+-- previous mode and pause:
+local function gc_pause_guard(pause)
+  local mode = collectgarbage("incremental")
+  local previous = pause and set_gc_pause and set_gc_pause(pause)
+  return setmetatable({}, {
+    __close = function()
+      if previous then
+        set_gc_pause(previous)
+      end
+      if mode == "generational" then
+        collectgarbage("generational")
+      end
+    end,
+  })
+end
+
+-- Statistics of the most recently started event loop (see function main):
+_M.stats = nil
+
 function _M.main(...)
   local eventqueue <close> = lkq.new_queue()
+  local stats = {
+    iterations = 0, -- number of iterations of the event loop
+    waits = 0, -- number of times the event loop blocked
+    gc_steps = 0, -- number of garbage collection steps during idle time
+    gc_cycles = 0, -- number of collection cycles completed during idle time
+    gc_seconds = 0, -- processor time spent on collection during idle time
+  }
+  _M.stats = stats
+  local gc_budget = _M.gc_budget
+  local gc_threshold = _M.gc_threshold
+  local gc_interval = _M.gc_interval
+  -- Raise pause of automatic collector while running (and restore it later):
+  local gc_guard <close> = gc_budget and gc_pause_guard(_M.gc_pause) or nil
+  -- Callback argument for the timer used to wait between slices of garbage
+  -- collection during idle time:
+  local gc_timer_arg = { wake = function() end }
+  -- Heap size (in kilobytes) after the last collection cycle, and whether a
+  -- collection cycle has been started during idle time:
+  local gc_base = collectgarbage("count")
+  local gc_active = false
+  -- Function checking if garbage collection should be done during idle time:
+  local function gc_pending()
+    if gc_active then
+      return true
+    end
+    if not gc_budget or not collectgarbage("isrunning") then
+      return false
+    end
+    local heap = collectgarbage("count")
+    -- Check if heap has shrunk, e.g. due to automatic collection:
+    if heap < gc_base then
+      gc_base = heap
+      return false
+    end
+    gc_active = heap > gc_base * gc_threshold
+    return gc_active
+  end
+  -- Function performing garbage collection steps until a collection cycle
+  -- has been completed or until the time budget has been used up:
+  local function gc_idle()
+    local t0 = os.clock()
+    local deadline = t0 + gc_budget
+    repeat
+      stats.gc_steps = stats.gc_steps + 1
+      if collectgarbage("step", 0) then
+        stats.gc_cycles = stats.gc_cycles + 1
+        gc_active = false
+        gc_base = collectgarbage("count")
+        break
+      end
+    until os.clock() >= deadline
+    stats.gc_seconds = stats.gc_seconds + (os.clock() - t0)
+  end
   local read_fd_locks, write_fd_locks, pid_locks, handle_locks = {}, {}, {}, {}
   local function deregister_fd(fd)
     eventqueue:deregister_fd(fd)
@@ -84,9 +198,33 @@ function _M.main(...)
         handle_locks[handle] = nil
         entries[handle] = nil
       end
+      self.event_type, self.event_arg = nil, nil
     end,
   }
   local fiber_poll_states = setmetatable({}, weak_mt)
+  -- Objects passed to the event queue for file descriptor events, which wake
+  -- the waiting fiber and record which event occurred (cached per file
+  -- descriptor):
+  local fd_read_wakers, fd_write_wakers = {}, {}
+  local function fd_waker(wakers, locks, rtype, fd)
+    local waker = wakers[fd]
+    if not waker then
+      waker = {
+        wake = function()
+          local fib = locks[fd]
+          if fib then
+            local poll_state = fiber_poll_states[fib]
+            if poll_state and not poll_state.event_type then
+              poll_state.event_type, poll_state.event_arg = rtype, fd
+            end
+            fib:wake()
+          end
+        end,
+      }
+      wakers[fd] = waker
+    end
+    return waker
+  end
   local function wait_select(...)
     local current_fiber = fiber.current()
     local poll_state = fiber_poll_states[current_fiber]
@@ -112,7 +250,9 @@ function _M.main(...)
         end
         poll_state.read_fds[arg] = true
         read_fd_locks[arg] = current_fiber
-        eventqueue:add_fd_read_once(arg, current_fiber)
+        eventqueue:add_fd_read_once(
+          arg, fd_waker(fd_read_wakers, read_fd_locks, "fd_read", arg)
+        )
       elseif rtype == "fd_write" then
         if write_fd_locks[arg] then
           error(
@@ -122,7 +262,9 @@ function _M.main(...)
         end
         poll_state.write_fds[arg] = true
         write_fd_locks[arg] = current_fiber
-        eventqueue:add_fd_write_once(arg, current_fiber)
+        eventqueue:add_fd_write_once(
+          arg, fd_waker(fd_write_wakers, write_fd_locks, "fd_write", arg)
+        )
       elseif rtype == "pid" then
         if pid_locks[arg] then
           error(
@@ -147,6 +289,7 @@ function _M.main(...)
       end
     end
     fiber.sleep()
+    return poll_state.event_type, poll_state.event_arg
   end
   local signal_handles = {}
   local function catch_signal(sig)
@@ -181,7 +324,7 @@ function _M.main(...)
     local inner_handle = self._inner_handle
     self._inner_handle = nil
     if inner_handle then
-      eventqueue:remove_timeout(seconds, inner_handle)
+      eventqueue:remove_timeout(inner_handle)
     end
   end
   local timeout_metatable = {
@@ -212,7 +355,7 @@ function _M.main(...)
     local inner_handle = self._inner_handle
     self._inner_handle = nil
     if inner_handle then
-      eventqueue:remove_interval(seconds, inner_handle)
+      eventqueue:remove_interval(inner_handle)
     end
   end
   local interval_metatable = {
@@ -256,31 +399,35 @@ function _M.main(...)
   end
   return fiber.handle(
     {
-      [wait.select] = function(resume, ...)
-        return resume:call(wait_select, ...)
-      end,
-      [wait.timeout] = function(resume, seconds)
-        return resume:call(timeout, seconds)
-      end,
-      [wait.interval] = function(resume, seconds)
-        return resume:call(interval, seconds)
-      end,
-      [wait.notify] = function(resume)
-        return resume:call(notify)
-      end,
-      [wait_posix.deregister_fd] = function(resume, ...)
-        return resume:call(deregister_fd, ...)
-      end,
-      [wait_posix.catch_signal] = function(resume, sig)
-        return resume:call(catch_signal, sig)
-      end,
+      [wait.select] = effect.direct(wait_select),
+      [wait.timeout] = effect.direct(timeout),
+      [wait.interval] = effect.direct(interval),
+      [wait.notify] = effect.direct(notify),
+      [wait_posix.deregister_fd] = effect.direct(deregister_fd),
+      [wait_posix.catch_signal] = effect.direct(catch_signal),
     },
     function(body, ...)
       fiber.spawn(function()
         while true do
+          stats.iterations = stats.iterations + 1
           if fiber.pending() then
             eventqueue:poll(wake)
+          elseif gc_pending() then
+            -- Collect garbage if there are no events (otherwise continue with
+            -- the next iteration after handling the events):
+            if eventqueue:poll(wake) == 0 then
+              gc_idle()
+              -- Wait for events (but not longer than gc_interval) if the
+              -- collection cycle is not finished yet, instead of spinning:
+              if gc_active then
+                stats.waits = stats.waits + 1
+                local timer = eventqueue:add_timeout(gc_interval, gc_timer_arg)
+                eventqueue:wait(wake)
+                eventqueue:remove_timeout(timer)
+              end
+            end
           else
+            stats.waits = stats.waits + 1
             eventqueue:wait(wake)
           end
           fiber.yield()
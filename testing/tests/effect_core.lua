@@ -0,0 +1,42 @@
+local checkpoint = require "checkpoint"
+
+-- The C implementation is optional, but if it is built, then the other effect
+-- tests cover it:
+if not pcall(require, "neumond.effect_core") then
+  print("C implementation of effect module not built, skipping test")
+  return
+end
+
+local effect = require "neumond.effect"
+
+local eff = effect.new("eff")
+local unhandled = effect.new("unhandled")
+
+effect.default_handlers[eff] = function(a, b)
+  return a + b
+end
+assert(eff(1, 2) == 3)
+checkpoint(1)
+
+local retval = effect.handle(
+  {
+    [unhandled] = function(resume)
+      error("unreachable")
+    end,
+  },
+  function()
+    return effect.handle({}, function()
+      checkpoint(2)
+      assert(eff(3, 4) == 7)
+      checkpoint(3)
+      local success, errmsg = pcall(effect.perform, "nonexistent")
+      assert(success == false)
+      assert(string.find(errmsg, "unhandled effect or yield: nonexistent", 1, true))
+      checkpoint(4)
+      return "done"
+    end)
+  end
+)
+assert(retval == "done")
+
+checkpoint(5)
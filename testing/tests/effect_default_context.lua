@@ -0,0 +1,34 @@
+local checkpoint = require "checkpoint"
+local effect = require "neumond.effect"
+
+local where = effect.new("where")
+local fail = effect.new("fail")
+
+-- Default handlers run in the context of the performer (like direct
+-- handlers), i.e. not in the main coroutine:
+effect.default_handlers[where] = function()
+  return coroutine.running()
+end
+effect.default_handlers[fail] = function()
+  error("failed in default handler", 0)
+end
+
+local main_coro = coroutine.running()
+assert(where() == main_coro)
+checkpoint(1)
+
+effect.handle({}, function()
+  effect.handle({}, function()
+    local coro = coroutine.running()
+    assert(coro ~= main_coro)
+    assert(where() == coro)
+    checkpoint(2)
+    -- Errors raised by default handlers can be caught by the performer:
+    local success, errmsg = pcall(fail)
+    assert(success == false)
+    assert(errmsg == "failed in default handler")
+    checkpoint(3)
+  end)
+end)
+
+checkpoint(4)
@@ -0,0 +1,53 @@
+local checkpoint = require "checkpoint"
+local effect = require "neumond.effect"
+
+local get = effect.new("get")
+local inner = effect.new("inner")
+
+local value = 0
+
+local retval = effect.handle(
+  {
+    [get] = effect.direct(function(a, b)
+      -- Direct handlers run in the context of the performer:
+      assert(inner() == "inner")
+      value = value + 1
+      return a + b, value
+    end),
+  },
+  function()
+    checkpoint(1)
+    local x, y = effect.handle(
+      {
+        [inner] = function(resume)
+          return resume("inner")
+        end,
+      },
+      function()
+        return get(1, 2)
+      end
+    )
+    assert(x == 3 and y == 1)
+    checkpoint(2)
+    -- Direct handlers can also be invoked when an effect is re-performed:
+    local x, y = effect.handle(
+      {
+        [get] = function(resume, a, b)
+          return resume:perform(get, a * 10, b * 10)
+        end,
+        [inner] = function(resume)
+          return resume("inner")
+        end,
+      },
+      function()
+        return get(3, 4)
+      end
+    )
+    assert(x == 70 and y == 2)
+    checkpoint(3)
+    return "done"
+  end
+)
+
+assert(retval == "done")
+checkpoint(4)
@@ -0,0 +1,107 @@
+local checkpoint = require "checkpoint"
+local effect = require "neumond.effect"
+
+local get = effect.new("get")
+local ask = effect.new("ask")
+local double = effect.new("double")
+
+effect.default_handlers[double] = function(x)
+  return 2 * x
+end
+
+local function nest(depth, func)
+  if depth == 0 then
+    return func()
+  end
+  return effect.handle({}, nest, depth - 1, func)
+end
+
+effect.handle(
+  {
+    [get] = effect.direct(function() return "outer" end),
+  },
+  function()
+    checkpoint(1)
+    nest(10, function()
+      assert(get() == "outer")
+      assert(double(21) == 42)
+      -- Inner handlers shadow outer handlers:
+      effect.handle(
+        {
+          [get] = effect.direct(function() return "inner" end),
+        },
+        function()
+          assert(get() == "inner")
+        end
+      )
+      assert(get() == "outer")
+    end)
+    checkpoint(2)
+  end
+)
+
+-- Resuming a continuation in a different context must not use outdated
+-- dispatch information:
+local resume_later
+effect.handle(
+  {
+    [get] = effect.direct(function() return "first" end),
+  },
+  function()
+    resume_later = effect.handle(
+      {
+        [ask] = function(resume)
+          return resume:persistent()
+        end,
+      },
+      function()
+        assert(get() == "first")
+        checkpoint(3)
+        ask()
+        assert(get() == "second")
+        checkpoint(5)
+        return "finished"
+      end
+    )
+  end
+)
+checkpoint(4)
+local result = effect.handle(
+  {
+    [get] = effect.direct(function() return "second" end),
+  },
+  function()
+    return resume_later()
+  end
+)
+assert(result == "finished")
+
+checkpoint(6)
+
+-- Replacing a default handler after it has been used must take effect
+-- immediately:
+nest(3, function()
+  assert(double(5) == 10)
+  effect.default_handlers[double] = function(x)
+    return 3 * x
+  end
+  assert(double(5) == 15)
+  effect.default_handlers[double] = nil
+  assert(pcall(double, 5) == false)
+end)
+assert(effect.default_handlers[double] == nil)
+
+-- Modifying a handlers table after passing it to effect.handle does not
+-- affect the running action:
+local handlers = {
+  [get] = effect.direct(function() return "original" end),
+}
+effect.handle(handlers, function()
+  nest(3, function()
+    assert(get() == "original")
+    handlers[get] = effect.direct(function() return "modified" end)
+    assert(get() == "original")
+  end)
+end)
+
+checkpoint(7)
@@ -0,0 +1,41 @@
+local effect = require "neumond.effect"
+
+local error_object = setmetatable({}, {
+  __tostring = function(self) return "error object" end,
+})
+
+local function fail_deeply(depth)
+  if depth > 0 then
+    fail_deeply(depth - 1)
+  else
+    error(error_object)
+  end
+  return depth
+end
+
+local success, message = effect.pcall(function()
+  effect.handle({}, function()
+    fail_deeply(30)
+  end)
+end)
+
+assert(success == false)
+assert(message == error_object)
+message = effect.stringify_error(message)
+assert(type(message) == "string")
+assert(string.find(message, "^error object\r?\nstack traceback:"))
+
+-- Check if stack traces of both the inner and the outer coroutine have been
+-- appended:
+local _, count = string.gsub(message, "stack traceback:", "")
+assert(count == 2)
+
+-- Check if stack trace contains function names and positions:
+assert(string.find(message, "effect_stringify_error_nested.lua:%d+: in"))
+assert(string.find(message, "fail_deeply"))
+
+-- Check if deep stack traces are shortened:
+assert(string.find(message, "(skipping %d+ levels)"))
+
+-- Check if stringifying twice yields the same result:
+assert(effect.stringify_error(error_object) == message)
@@ -0,0 +1,66 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".sock"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local function main(...)
+  checkpoint(1)
+  -- Searching, views, and consuming:
+  local buf = eio.buffer()
+  buf:append("GET / HTTP/1.1\r\n", "Host: x\r\n\r\nbody")
+  assert(#buf == 31)
+  local s, e = buf:find("\r\n\r\n")
+  assert(s == 24 and e == 27)
+  assert(buf:find("\r\n", 17) == 24)
+  assert(buf:find("missing") == nil)
+  local head = buf:sub(1, e)
+  assert(#head == 27)
+  assert(head:tostring(-4) == "\r\n\r\n")
+  local line = head:sub(1, head:find("\r\n") - 1)
+  assert(tostring(line) == "GET / HTTP/1.1")
+  assert(buf:consume(e) == 27)
+  assert(tostring(buf) == "body")
+  assert(tostring(line) == "GET / HTTP/1.1")
+  assert(buf:consume(100) == 4)
+  assert(#buf == 0)
+  -- Views are invalidated when the buffer moves its data:
+  buf:append(string.rep("x", 100000))
+  assert(not pcall(tostring, line))
+  buf:consume()
+  checkpoint(2)
+  -- Reading into a buffer:
+  local big = string.rep("0123456789", 100000)
+  local listener <close> = assert(eio.locallisten(path))
+  local sender = fiber.spawn(function()
+    local conn <close> = assert(eio.localconnect(path))
+    assert(conn:flush("first line\n", big))
+  end)
+  local conn <close> = assert(listener:accept())
+  assert(conn:read(nil, "\n") == "first line\n")
+  while true do
+    local count = assert(conn:read_into(buf))
+    if count == 0 then
+      break
+    end
+  end
+  assert(#buf == #big)
+  assert(buf:tostring() == big)
+  assert(buf:tostring(11, 20) == "0123456789")
+  assert(not pcall(conn.nbio_handle.read_into, conn.nbio_handle, line))
+  sender:await()
+  checkpoint(3)
+end
+
+runtime(main)
+
+checkpoint(4)
@@ -0,0 +1,82 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local nbio = require "neumond.nbio"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".sock"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local function main(...)
+  checkpoint(1)
+  local listener <close> = assert(eio.locallisten(path))
+  local clients, servers = {}, {}
+  for i = 1, 50 do
+    local connector = fiber.spawn(function()
+      return assert(eio.localconnect(path))
+    end)
+    servers[i] = assert(listener:accept())
+    clients[i] = connector:await()
+  end
+  -- Handles borrow buffers only while holding data:
+  for i = 1, 50 do
+    assert(clients[i]:write("partial"))
+  end
+  assert(nbio.buffer_stats() >= 50 * 8192)
+  for i = 1, 50 do
+    assert(clients[i]:flush(" line\nnext"))
+    assert(servers[i]:read(nil, "\n") == "partial line\n")
+  end
+  assert(nbio.buffer_stats() >= 50 * 8192)
+  for i = 1, 50 do
+    assert(servers[i]:read(4) == "next")
+  end
+  -- Returned buffers are kept for reuse:
+  local borrowed, pooled = nbio.buffer_stats()
+  assert(borrowed == 0)
+  assert(pooled >= 50 * 8192)
+  checkpoint(2)
+  -- Idle handles waiting for data do not keep buffers:
+  local waiters = {}
+  for i = 1, 50 do
+    waiters[i] = fiber.spawn(function()
+      return servers[i]:read(nil, "\n")
+    end)
+  end
+  fiber.yield()
+  assert(nbio.buffer_stats() == 0)
+  for i = 1, 50 do
+    assert(clients[i]:flush("x\n"))
+    assert(waiters[i]:await() == "x\n")
+  end
+  checkpoint(3)
+  -- Unread data and large reads:
+  local big = string.rep("0123456789", 100000)
+  local sender = fiber.spawn(function()
+    assert(clients[1]:flush(big))
+    clients[1]:shutdown()
+  end)
+  local data = servers[1]:read(#big - 10)
+  servers[1]:unread(data)
+  assert(servers[1]:read() == big)
+  sender:await()
+  local borrowed, pooled = nbio.buffer_stats()
+  assert(borrowed == 0)
+  assert(pooled <= 6 * 1024 * 1024)
+  for i = 1, 50 do
+    clients[i]:close()
+    servers[i]:close()
+  end
+  checkpoint(4)
+end
+
+runtime(main)
+
+checkpoint(5)
@@ -0,0 +1,65 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local nbio = require "neumond.nbio"
+local eio = require "neumond.eio"
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  -- Resolved addresses are numeric:
+  local addrs = assert(nbio.tcpresolve("localhost", port))
+  assert(#addrs >= 1)
+  for _, addr in ipairs(addrs) do
+    assert(addr == "127.0.0.1" or addr == "::1")
+  end
+  -- Connection to a single address:
+  local listener4 <close> = assert(eio.tcplisten("127.0.0.1", port))
+  local conn <close> = assert(eio.tcpconnect("127.0.0.1", port, {
+    happy_eyeballs = true,
+  }))
+  local peer <close> = assert(listener4:accept())
+  assert(conn:flush("hello"))
+  assert(peer:read(5) == "hello")
+  checkpoint(2)
+  -- Connection attempts to an unresponsive address do not delay the
+  -- connection (a listener whose queue is full drops new connection
+  -- requests):
+  local listener6 <close> = assert(eio.tcplisten("::1", port, {
+    backlog = 1,
+  }))
+  local fillers = {}
+  for i = 1, 4 do
+    fillers[i] = assert(eio.tcpconnect("::1", port))
+  end
+  eio.timeout(0.1)()
+  local orig_tcpresolve = nbio.tcpresolve
+  nbio.tcpresolve = function() return {"::1", "127.0.0.1"} end
+  local deadline <close> = eio.timeout(0.8)
+  local conn2 <close> = assert(eio.tcpconnect("localhost", port, {
+    happy_eyeballs = true,
+    attempt_delay = 0.05,
+  }))
+  assert(not deadline.ready)
+  local peer2 <close> = assert(listener4:accept())
+  assert(peer2.peer_addr == "127.0.0.1")
+  checkpoint(3)
+  -- Failures are reported after all addresses have been tried:
+  nbio.tcpresolve = function() return {"::1", "127.0.0.1"} end
+  listener4:close()
+  listener6:close()
+  local conn3, errmsg = eio.tcpconnect("localhost", port, {
+    happy_eyeballs = true,
+  })
+  assert(conn3 == nil and errmsg)
+  nbio.tcpresolve = orig_tcpresolve
+  for i = 1, 4 do
+    fillers[i]:close()
+  end
+  checkpoint(4)
+end
+
+runtime(main)
+
+checkpoint(5)
@@ -0,0 +1,68 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".sock"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  -- Accepting several pending connections at once:
+  local listener <close> = assert(eio.locallisten(path, { backlog = 1024 }))
+  local clients = {}
+  for i = 1, 10 do
+    clients[i] = assert(eio.localconnect(path))
+  end
+  local conns = assert(listener:accept_many(4))
+  assert(#conns == 4)
+  local more = assert(listener:accept_many(100))
+  assert(#more == 6)
+  for i = 1, 6 do
+    conns[4+i] = more[i]
+  end
+  for i = 1, 10 do
+    assert(clients[i]:flush(tostring(i)))
+    clients[i]:close()
+  end
+  local received = {}
+  for i = 1, 10 do
+    received[#received+1] = assert(conns[i]:read())
+    conns[i]:close()
+  end
+  table.sort(received, function(a, b) return tonumber(a) < tonumber(b) end)
+  assert(table.concat(received, ",") == "1,2,3,4,5,6,7,8,9,10")
+  checkpoint(2)
+  -- Waiting for a connection:
+  fiber.spawn(function()
+    local h <close> = assert(eio.localconnect(path))
+  end)
+  local conns = assert(listener:accept_many(10))
+  assert(#conns == 1)
+  conns[1]:close()
+  assert(not pcall(eio.locallisten, path, { backlog = 0 }))
+  checkpoint(3)
+  -- Several TCP listeners on the same port:
+  local l1 <close> = assert(eio.tcplisten("localhost", port, {
+    reuseport = true,
+  }))
+  local l2 <close> = assert(eio.tcplisten("localhost", port, {
+    reuseport = true,
+  }))
+  local l3, errmsg = eio.tcplisten("localhost", port)
+  assert(l3 == nil and errmsg)
+  checkpoint(4)
+end
+
+runtime(main)
+
+checkpoint(5)
@@ -0,0 +1,56 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".sock"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  -- Accepted TCP connections report the address of the peer:
+  local listener <close> = assert(eio.tcplisten("127.0.0.1", port))
+  local client_fiber = fiber.spawn(function()
+    return assert(eio.tcpconnect("127.0.0.1", port))
+  end)
+  local conn <close> = assert(listener:accept())
+  local client <close> = client_fiber:await()
+  assert(conn.peer_addr == "127.0.0.1")
+  local peer_port = conn.peer_port
+  assert(math.type(peer_port) == "integer")
+  assert(peer_port >= 1 and peer_port <= 65535 and peer_port ~= port)
+  -- Repeated reads return the same values:
+  assert(conn.peer_addr == "127.0.0.1")
+  assert(conn.peer_port == peer_port)
+  -- Methods are available before and after reading the peer address:
+  assert(client:flush("x"))
+  assert(conn:read(1) == "x")
+  -- Outgoing connections have no peer address:
+  assert(client.peer_addr == nil)
+  assert(client.peer_port == nil)
+  checkpoint(2)
+  -- Local sockets have no peer address:
+  local local_listener <close> = assert(eio.locallisten(path))
+  local client_fiber = fiber.spawn(function()
+    return assert(eio.localconnect(path))
+  end)
+  local conn <close> = assert(local_listener:accept())
+  local client <close> = client_fiber:await()
+  assert(client:flush("y"))
+  assert(conn:read(1) == "y")
+  assert(conn.peer_addr == nil)
+  assert(conn.peer_port == nil)
+  checkpoint(3)
+end
+
+runtime(main)
+checkpoint(4)
@@ -0,0 +1,54 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8()
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function()
+    os.execute("rm -f " .. path .. "-1.sock " .. path .. "-2.sock")
+  end,
+})
+
+local function main(...)
+  checkpoint(1)
+  local parts = {}
+  for i = 1, 200000 do
+    parts[i] = tostring(i)
+  end
+  local data = table.concat(parts, ",")
+  local listener1 <close> = assert(eio.locallisten(path .. "-1.sock"))
+  local listener2 <close> = assert(eio.locallisten(path .. "-2.sock"))
+  -- Proxy connections from first socket to second socket:
+  local proxy = fiber.spawn(function()
+    local src <close> = assert(listener1:accept())
+    local dst <close> = assert(eio.localconnect(path .. "-2.sock"))
+    -- Data read into buffer of source is transferred first:
+    assert(src:read(5) == "head:")
+    assert(eio.pump(src, dst, { length = 10 }) == 10)
+    assert(dst:write("|"))
+    assert(eio.pump(src, dst, { shutdown = true }) == #data - 10)
+    checkpoint(3)
+  end)
+  local sender = fiber.spawn(function()
+    local conn <close> = assert(eio.localconnect(path .. "-1.sock"))
+    assert(conn:flush("head:"))
+    checkpoint(2)
+    assert(conn:flush(data))
+  end)
+  local conn <close> = assert(listener2:accept())
+  local received = assert(conn:read())
+  assert(received == data:sub(1, 10) .. "|" .. data:sub(11))
+  sender:await()
+  proxy:await()
+  checkpoint(4)
+end
+
+runtime(main)
+
+checkpoint(5)
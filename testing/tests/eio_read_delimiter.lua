@@ -0,0 +1,55 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".sock"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local function main(...)
+  checkpoint(1)
+  local listener <close> = assert(eio.locallisten(path))
+  local step = sync.queue(0)
+  local sender = fiber.spawn(function()
+    local conn <close> = assert(eio.localconnect(path))
+    -- Delimiter split across several writes:
+    assert(conn:flush("Host: x\r"))
+    step:pop()
+    assert(conn:flush("\nAccept: */*\r\n\r"))
+    step:pop()
+    assert(conn:flush("\nbody--bound"))
+    step:pop()
+    assert(conn:flush("ary--rest\nline\n"))
+  end)
+  local conn <close> = assert(listener:accept())
+  fiber.spawn(function()
+    for i = 1, 3 do
+      fiber.yield()
+      step:push(true)
+    end
+  end)
+  assert(conn:read(nil, "\r\n") == "Host: x\r\n")
+  assert(conn:read(nil, "\r\n\r\n") == "Accept: */*\r\n\r\n")
+  checkpoint(2)
+  -- Delimiter must end within maxlen:
+  assert(conn:read(8, "--boundary--") == "body--bo")
+  conn:unread("body--bo")
+  assert(conn:read(nil, "--boundary--") == "body--boundary--")
+  -- Single byte delimiters and switching delimiters:
+  assert(conn:read(nil, "\n") == "rest\n")
+  assert(conn:read(nil, "\r\n") == "line\n")
+  sender:await()
+  checkpoint(3)
+end
+
+runtime(main)
+
+checkpoint(4)
@@ -0,0 +1,53 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8()
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function()
+    os.execute("rm -f " .. path .. ".file " .. path .. ".sock")
+  end,
+})
+
+local function main(...)
+  checkpoint(1)
+  local parts = {}
+  for i = 1, 100000 do
+    parts[i] = tostring(i)
+  end
+  local data = table.concat(parts, ",")
+  do
+    local file <close> =
+      assert(eio.open(path .. ".file", "w,create,exclusive"))
+    assert(file:flush(data))
+  end
+  local listener <close> = assert(eio.locallisten(path .. ".sock"))
+  local sender = fiber.spawn(function()
+    local file <close> = assert(eio.open(path .. ".file"))
+    local conn <close> = assert(eio.localconnect(path .. ".sock"))
+    assert(conn:write("head:"))
+    assert(conn:sendfile(file, 10, 20) == 20)
+    assert(conn:write(":"))
+    assert(conn:sendfile(file, 10) == #data - 10)
+    assert(conn:sendfile(file, #data) == 0)
+    assert(conn:flush(":tail"))
+    checkpoint(2)
+  end)
+  local conn <close> = assert(listener:accept())
+  local received = assert(conn:read())
+  assert(
+    received == "head:" .. data:sub(11, 30) .. ":" .. data:sub(11) .. ":tail"
+  )
+  sender:await()
+  checkpoint(3)
+end
+
+runtime(main)
+
+checkpoint(4)
@@ -0,0 +1,55 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  -- Options given when listening and connecting:
+  local listener <close> = assert(eio.tcplisten("localhost", port, {
+    rcvbuf = 65536,
+    keepalive = true,
+  }))
+  assert(listener:getopt("keepalive") == true)
+  assert(listener:getopt("rcvbuf") >= 65536)
+  local client_fiber = fiber.spawn(function()
+    return assert(eio.tcpconnect("localhost", port, {
+      nodelay = true,
+      sndbuf = 32768,
+    }))
+  end)
+  local conn <close> = assert(listener:accept())
+  local client <close> = client_fiber:await()
+  assert(client:getopt("nodelay") == true)
+  assert(client:getopt("sndbuf") >= 32768)
+  checkpoint(2)
+  -- Options set and read on open handles:
+  assert(conn:getopt("nodelay") == false)
+  assert(conn:setopt("nodelay", true))
+  assert(conn:getopt("nodelay") == true)
+  assert(conn:setopt("keepalive", false))
+  assert(conn:getopt("keepalive") == false)
+  local ok, errmsg = conn:setopt("keepidle", 30)
+  assert(ok or string.find(errmsg, "not supported"))
+  if ok then
+    assert(conn:getopt("keepidle") == 30)
+  end
+  assert(client:flush("data"))
+  assert(conn:read(4) == "data")
+  checkpoint(3)
+  -- Invalid option names and values are errors:
+  assert(not pcall(conn.setopt, conn, "no_such_option", 1))
+  assert(not pcall(conn.setopt, conn, "sndbuf", "large"))
+  assert(not pcall(eio.tcpconnect, "localhost", port, { sndbuf = "x" }))
+  -- TCP options fail for other kinds of handles:
+  local file <close> = assert(eio.open("/dev/null"))
+  local ok, errmsg = file:setopt("nodelay", true)
+  assert(ok == nil and errmsg)
+  checkpoint(4)
+end
+
+runtime(main)
+
+checkpoint(5)
@@ -0,0 +1,52 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  local listener <close> = assert(eio.tcplisten("localhost", port))
+  local big = string.rep("0123456789", 18000)
+  local server = fiber.spawn(function()
+    local h <close> = assert(listener:accept())
+    while true do
+      local line = assert(h:read(nil, "\n"))
+      if line == "" then
+        break
+      end
+      local len = assert(tonumber(string.match(line, "^([0-9]+)\n$")))
+      assert(h:read(len) == string.sub(big, 1, len))
+      -- Buffered and unbuffered writes followed by flush:
+      assert(h:write("ok "))
+      assert(h:write(tostring(len)))
+      assert(h:flush("\n"))
+    end
+    assert(h:shutdown())
+  end)
+  local h <close> = assert(eio.tcpconnect("localhost", port))
+  local t0 = os.time()
+  for i = 1, 60 do
+    local len = i * 3000
+    -- Header followed by body that does not fit into write buffer:
+    assert(h:write(len .. "\n"))
+    assert(h:write(string.sub(big, 1, len)))
+    assert(h:flush())
+    assert(h:read(nil, "\n") == "ok " .. len .. "\n")
+    -- Small requests must not be delayed:
+    assert(h:write("1\n", "0"))
+    assert(h:flush())
+    assert(h:read(nil, "\n") == "ok 1\n")
+  end
+  -- Delayed pushes (of 200ms each) would take several seconds:
+  assert(os.time() - t0 <= 2)
+  checkpoint(2)
+  assert(h:shutdown())
+  server:await()
+  checkpoint(3)
+end
+
+runtime(main)
+
+checkpoint(4)
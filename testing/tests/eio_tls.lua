@@ -0,0 +1,119 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+if not eio.tls_context then
+  print("TLS support not compiled in, skipping test")
+  return
+end
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local prefix = "/tmp/neumond-test-" .. r8() .. "-" .. r8()
+local keyfile = prefix .. ".key"
+local certfile = prefix .. ".crt"
+local datafile = prefix .. ".file"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function()
+    os.execute("rm -f " .. keyfile .. " " .. certfile .. " " .. datafile)
+  end,
+})
+
+assert(os.execute(
+  "openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 " ..
+  "-nodes -keyout " .. keyfile .. " -out " .. certfile .. " -days 1 " ..
+  "-subj /CN=localhost -addext subjectAltName=DNS:localhost,IP:127.0.0.1 " ..
+  "2>/dev/null"
+))
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  local server_ctx = assert(eio.tls_context{
+    server = true, cert = certfile, key = keyfile,
+  })
+  local client_ctx = assert(eio.tls_context{ ca = certfile })
+  local listener <close> = assert(eio.tcplisten("127.0.0.1", port))
+  -- Handshake and data transfer in both directions:
+  local server_fiber = fiber.spawn(function()
+    local conn <close> = assert(listener:accept())
+    assert(conn:starttls(server_ctx))
+    local line = assert(conn:read(nil, "\n"))
+    assert(conn:flush("echo: " .. line))
+    local data = assert(conn:read(100000))
+    assert(#data == 100000 and string.find(data, "^x+$"))
+    local file <close> = assert(eio.open(datafile, "r"))
+    assert(conn:sendfile(file) == 20000)
+    assert(conn:shutdown())
+    assert(conn:read() == "")
+  end)
+  local f <close> = assert(io.open(datafile, "w"))
+  f:write(string.rep("y", 20000))
+  f:close()
+  local client <close> = assert(eio.tcpconnect("127.0.0.1", port, {
+    tls = client_ctx,
+  }))
+  local info = client:tls_info()
+  assert(info.established)
+  assert(string.find(info.version, "^TLS"))
+  assert(type(info.ktls_send) == "boolean")
+  assert(type(info.ktls_recv) == "boolean")
+  checkpoint(2)
+  assert(client:write("he", "llo", "\n"))
+  assert(client:flush())
+  assert(client:read(nil, "\n") == "echo: hello\n")
+  assert(client:flush(string.rep("x", 100000)))
+  assert(client:read(20000) == string.rep("y", 20000))
+  assert(client:read() == "")
+  assert(client:shutdown())
+  server_fiber:await()
+  checkpoint(3)
+  -- Host name is verified:
+  local server_fiber = fiber.spawn(function()
+    local conn <close> = assert(listener:accept())
+    local ok, errmsg = conn:starttls(server_ctx)
+    assert(not ok and errmsg)
+  end)
+  local client, errmsg = eio.tcpconnect("127.0.0.1", port, {
+    tls = client_ctx, tls_hostname = "wrong.example",
+  })
+  assert(client == nil)
+  assert(string.find(errmsg, "verification failed"))
+  server_fiber:await()
+  checkpoint(4)
+  -- Untrusted certificates are rejected:
+  local untrusted_ctx = assert(eio.tls_context())
+  local server_fiber = fiber.spawn(function()
+    local conn <close> = assert(listener:accept())
+    local ok, errmsg = conn:starttls(server_ctx)
+    assert(not ok and errmsg)
+  end)
+  local client, errmsg = eio.tcpconnect("localhost", port, {
+    tls = untrusted_ctx,
+  })
+  assert(client == nil)
+  assert(string.find(errmsg, "verification failed"))
+  server_fiber:await()
+  checkpoint(5)
+  -- Unless verification is disabled:
+  local unverified_ctx = assert(eio.tls_context{ verify = false })
+  local server_fiber = fiber.spawn(function()
+    local conn <close> = assert(listener:accept())
+    assert(conn:starttls(server_ctx))
+    assert(conn:flush("ok"))
+  end)
+  local client <close> = assert(eio.tcpconnect("localhost", port, {
+    tls = unverified_ctx,
+  }))
+  assert(client:read(2) == "ok")
+  server_fiber:await()
+  checkpoint(6)
+end
+
+runtime(main)
+checkpoint(7)
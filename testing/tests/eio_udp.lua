@@ -0,0 +1,78 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local port = math.random(1024, 65535)
+
+local function main(...)
+  checkpoint(1)
+  -- Single datagrams between connected and bound sockets:
+  local server <close> = assert(eio.udpbind("127.0.0.1", port))
+  local client <close> = assert(eio.udpconnect("127.0.0.1", port))
+  local receiver = fiber.spawn(function()
+    return server:recv()
+  end)
+  fiber.yield()
+  assert(client:send("ping"))
+  local data, addr, client_port = receiver:await()
+  assert(data == "ping" and addr == "127.0.0.1")
+  assert(math.type(client_port) == "integer")
+  assert(server:send("pong", addr, client_port))
+  assert(client:recv() == "pong")
+  -- Empty datagrams and truncation:
+  assert(client:send(""))
+  local data, addr, port, truncated = server:recv()
+  assert(data == "" and truncated == false)
+  assert(client:send("abcdef"))
+  local data, addr, port, truncated = server:recv(3)
+  assert(data == "abc" and truncated == true)
+  assert(client:send("abc"))
+  local data, addr, port, truncated = server:recv(3)
+  assert(data == "abc" and truncated == false)
+  assert(client:send_many({"abcdef", "xy"}))
+  local batch, addrs, ports, truncated = server:recv_many(1, 3)
+  assert(batch[1] == "abc" and truncated[1] == true)
+  local batch, addrs, ports, truncated = server:recv_many(1, 3)
+  assert(batch[1] == "xy" and truncated[1] == false)
+  checkpoint(2)
+  -- Batches of datagrams:
+  local datagrams = {}
+  for i = 1, 100 do
+    datagrams[i] = "datagram " .. i
+  end
+  assert(client:send_many(datagrams))
+  local received = {}
+  while #received < 100 do
+    local batch, addrs, ports, truncated = assert(server:recv_many(32))
+    assert(#batch >= 1 and #batch <= 32)
+    assert(#addrs == #batch and #ports == #batch and #truncated == #batch)
+    for i = 1, #batch do
+      assert(addrs[i] == "127.0.0.1" and ports[i] == client_port)
+      received[#received+1] = batch[i]
+    end
+  end
+  for i = 1, 100 do
+    assert(received[i] == datagrams[i])
+  end
+  checkpoint(3)
+  -- Replying to the sources of a batch:
+  assert(client:send_many({"a", "b"}))
+  local batch, addrs, ports = server:recv_many(2)
+  if #batch == 1 then
+    local more, more_addrs, more_ports = server:recv_many(1)
+    batch[2], addrs[2], ports[2] = more[1], more_addrs[1], more_ports[1]
+  end
+  for i = 1, 2 do
+    batch[i] = string.upper(batch[i])
+  end
+  assert(server:send_many(batch, addrs, ports))
+  assert(client:recv() == "A")
+  assert(client:recv() == "B")
+  assert(not pcall(server.send, server, "x", "not an address", 1))
+  checkpoint(4)
+end
+
+runtime(main)
+
+checkpoint(5)
@@ -0,0 +1,50 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".sock"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local function main(...)
+  checkpoint(1)
+  local big = string.rep("0123456789", 100000)
+  local many = {}
+  for i = 1, 200 do
+    many[i] = tostring(i) .. ";"
+  end
+  local expected = table.concat({
+    "small1", "small2", 42,
+    "head:", big, ":tail",
+    table.concat(many),
+    "end1", big, "end2",
+  })
+  local listener <close> = assert(eio.locallisten(path))
+  local sender = fiber.spawn(function()
+    local conn <close> = assert(eio.localconnect(path))
+    -- Small pieces are buffered:
+    assert(conn:write("small1", "small2", 42))
+    -- Large pieces are written together with buffered data:
+    assert(conn:write("head:", big, ":tail"))
+    -- More pieces than passed to a single system call:
+    assert(conn:write(table.unpack(many)))
+    assert(conn:flush("end1", big, "end2"))
+    checkpoint(2)
+  end)
+  local conn <close> = assert(listener:accept())
+  local received = assert(conn:read())
+  assert(received == expected)
+  sender:await()
+  checkpoint(3)
+end
+
+runtime(main)
+
+checkpoint(4)
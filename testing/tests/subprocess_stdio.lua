@@ -0,0 +1,84 @@
+local checkpoint = require "checkpoint"
+local subprocess = require "neumond.subprocess" -- uses fibers
+local fiber = require "neumond.fiber"
+local eio = require "neumond.eio"
+local runtime = require "neumond.runtime"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".file"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+local function main(...)
+  checkpoint(1)
+  -- Output to a file and to /dev/null:
+  local file = assert(eio.open(path, "w,create,exclusive"))
+  local proc <close> = assert(eio.execute(
+    { stdin = "null", stdout = file, stderr = "null" },
+    "sh", "-c", "cat; echo written; echo ignored >&2"
+  ))
+  file:close()
+  assert(proc.stdin == nil and proc.stdout == nil and proc.stderr == nil)
+  assert(proc:wait() == 0)
+  local file <close> = assert(eio.open(path))
+  assert(file:read() == "written\n")
+  checkpoint(2)
+  -- Pipeline of two processes (data does not pass through Lua):
+  local producer <close> = assert(eio.execute(
+    { stdout = "pipe", pipe_size = 1024 * 1024 },
+    "sh", "-c", "echo first; echo second; echo third"
+  ))
+  local consumer <close> = assert(eio.execute(
+    { stdin = producer.stdout }, "sort", "-r"
+  ))
+  producer.stdout:close()
+  assert(consumer.stdout:read() == "third\nsecond\nfirst\n")
+  assert(producer:wait() == 0)
+  assert(consumer:wait() == 0)
+  checkpoint(3)
+  -- Pipes can be used like sockets:
+  local proc <close> = assert(eio.execute(
+    { stdin = "pipe", stdout = "pipe", stderr = "stdout" },
+    "sh", "-c", "cat; echo error >&2"
+  ))
+  assert(proc.stderr == nil)
+  fiber.spawn(function()
+    assert(proc.stdin:flush(string.rep("x", 200000)))
+    proc.stdin:close()
+  end)
+  assert(proc.stdout:read() == string.rep("x", 200000) .. "error\n")
+  assert(proc:wait() == 0)
+  checkpoint(4)
+  -- Redirected streams are not collected:
+  local result = assert(subprocess.execute_collect(
+    nil, true, { stderr = "null" }, "sh", "-c", "echo out; echo err >&2"
+  ))
+  assert(result.stdout == "out\n" and result.stderr == nil)
+  checkpoint(5)
+  -- Invalid options raise an error:
+  assert(not pcall(eio.execute, { stdin = "stdout" }, "true"))
+  local closed = assert(eio.open(path))
+  closed:close()
+  assert(not pcall(eio.execute, { stdout = closed }, "true"))
+  checkpoint(6)
+  -- A handle stays non-blocking if the child process cannot be started:
+  local proc <close> = assert(eio.execute(
+    { stdin = "pipe", stdout = "pipe" }, "sh", "-c", "read x; echo $x"
+  ))
+  assert(not eio.execute(
+    { stdin = proc.stdout }, "/nonexistent/neumond-test-command"
+  ))
+  assert(proc.stdout:read_nonblocking() == "")
+  assert(proc.stdin:flush("done\n"))
+  assert(proc.stdout:read() == "done\n")
+  assert(proc:wait() == 0)
+  checkpoint(7)
+end
+
+runtime(main, ...)
+checkpoint(8)
@@ -0,0 +1,70 @@
+local checkpoint = require "checkpoint"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local runtime = require "neumond.runtime"
+
+runtime(function()
+  local chan = sync.broadcast(4)
+  local received = {}
+  local subscribers = {}
+  for i = 1, 100 do
+    local sub = chan:subscribe()
+    subscribers[i] = fiber.spawn(function()
+      local values = {}
+      while true do
+        local value = sub:recv()
+        if value == nil then
+          break
+        end
+        values[#values+1] = value
+      end
+      received[i] = table.concat(values, ",")
+    end)
+  end
+  checkpoint(1)
+  fiber.yield()
+  -- Killing a waiting subscriber does not affect others:
+  subscribers[50]:kill()
+  chan:publish("a")
+  chan:publish("b")
+  fiber.yield()
+  chan:publish("c")
+  chan:close()
+  for i = 1, 100 do
+    subscribers[i]:try_await()
+  end
+  for i = 1, 100 do
+    if i == 50 then
+      assert(received[i] == nil)
+    else
+      assert(received[i] == "a,b,c")
+    end
+  end
+  checkpoint(2)
+  -- Lagging subscribers skip overwritten values:
+  local chan = sync.broadcast(2)
+  local sub = chan:subscribe()
+  for i = 1, 5 do
+    chan:publish(i)
+  end
+  assert(sub:recv() == 4)
+  assert(sub.lagged == 3)
+  assert(sub:recv() == 5)
+  checkpoint(3)
+  -- Lagging subscribers are dropped with policy "drop":
+  local chan = sync.broadcast(2, "drop")
+  local sub = chan:subscribe()
+  local other = chan:subscribe()
+  chan:publish(1)
+  assert(other:recv() == 1)
+  chan:publish(2)
+  chan:publish(3)
+  local value, errmsg = sub:recv()
+  assert(value == nil and errmsg)
+  assert(sub.dropped)
+  assert(other:recv() == 2)
+  assert(other:recv() == 3)
+  checkpoint(4)
+end)
+
+checkpoint(5)
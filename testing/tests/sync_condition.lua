@@ -0,0 +1,42 @@
+local checkpoint = require "checkpoint"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local runtime = require "neumond.runtime"
+
+runtime(function()
+  local cond = sync.condition()
+  local woken = 0
+  local waiters = {}
+  for i = 1, 3 do
+    waiters[i] = fiber.spawn(function()
+      cond:wait()
+      woken = woken + 1
+    end)
+  end
+  checkpoint(1)
+  fiber.yield()
+  assert(woken == 0)
+  assert(cond:signal() == true)
+  fiber.yield()
+  assert(woken == 1)
+  checkpoint(2)
+  -- Killing a waiter after it has been signaled passes the signal on:
+  cond:signal()
+  waiters[2]:kill()
+  fiber.yield()
+  assert(woken == 2)
+  checkpoint(3)
+  local late = fiber.spawn(function()
+    cond:wait()
+    checkpoint(5)
+  end)
+  fiber.yield()
+  cond:broadcast()
+  assert(cond:signal() == false)
+  checkpoint(4)
+  late:await()
+  assert(woken == 2)
+  checkpoint(6)
+end)
+
+checkpoint(7)
@@ -0,0 +1,83 @@
+local checkpoint = require "checkpoint"
+local runtime = require "neumond.runtime"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+
+for _, size in ipairs{0, 1, 3, 100} do
+  runtime(function()
+    local q = sync.queue(size)
+    local total = 50
+    local producer = fiber.spawn(function()
+      local values = {}
+      for i = 1, total do
+        values[i] = i
+      end
+      q:push_many(values, 1, 20)
+      q:push_many(values, 21)
+    end)
+    local expected = 1
+    while expected <= total do
+      local values = q:pop_many(7)
+      assert(#values >= 1 and #values <= 7)
+      for i, value in ipairs(values) do
+        assert(value == expected)
+        expected = expected + 1
+      end
+      if math.random(1, 2) == 1 then
+        fiber.yield()
+      end
+    end
+    producer:await()
+    assert(#q == 0)
+  end)
+end
+
+checkpoint(1)
+
+runtime(function()
+  local q = sync.queue(2)
+  q:push_many({"A", "B"})
+  assert(#q == 2)
+  local f = fiber.spawn(function()
+    q:push_many({"C", "D", "E"})
+    checkpoint(3)
+  end)
+  fiber.yield()
+  assert(#q == 5)
+  local values = q:pop_many()
+  assert(#values == 2 and values[1] == "A" and values[2] == "B")
+  checkpoint(2)
+  assert(q:pop() == "C")
+  assert(q:pop() == "D")
+  assert(q:pop() == "E")
+  f:await()
+  checkpoint(4)
+end)
+
+checkpoint(5)
+
+-- Large queues grow their buffer and keep the order of values:
+runtime(function()
+  local q = sync.queue(math.huge)
+  local values = {}
+  for i = 1, 3000 do
+    values[i] = i
+  end
+  q:push_many(values)
+  local popped = q:pop_many(1000)
+  for i = 1, 1000 do
+    assert(popped[i] == i)
+  end
+  for i = 1, 2000 do
+    q:push(3000 + i)
+  end
+  assert(#q == 4000)
+  local popped = q:pop_many()
+  assert(#popped == 4000)
+  for i = 1, 4000 do
+    assert(popped[i] == 1000 + i)
+  end
+  checkpoint(6)
+end)
+
+checkpoint(7)
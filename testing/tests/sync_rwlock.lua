@@ -0,0 +1,48 @@
+local checkpoint = require "checkpoint"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local runtime = require "neumond.runtime"
+
+runtime(function()
+  local lock = sync.rwlock()
+  checkpoint(1)
+  local reader1 = fiber.spawn(function()
+    local guard <close> = lock:read()
+    checkpoint(3)
+    fiber.yield()
+    checkpoint(6)
+  end)
+  local reader2 = fiber.spawn(function()
+    local guard <close> = lock:read()
+    checkpoint(4)
+    -- Both readers hold the lock at the same time:
+    assert(lock.reading == 2)
+    fiber.yield()
+    fiber.yield()
+    checkpoint(7)
+  end)
+  local writer = fiber.spawn(function()
+    local guard <close> = lock:write()
+    checkpoint(8)
+    assert(lock.writing and lock.reading == 0)
+    fiber.yield()
+    checkpoint(10)
+  end)
+  local reader3 = fiber.spawn(function()
+    checkpoint(5)
+    -- Reader must wait for queued writer:
+    local guard <close> = lock:read()
+    checkpoint(11)
+    assert(not lock.writing)
+  end)
+  checkpoint(2)
+  reader1:await()
+  reader2:await()
+  checkpoint(9)
+  writer:await()
+  reader3:await()
+  checkpoint(12)
+  assert(lock.reading == 0 and not lock.writing)
+end)
+
+checkpoint(13)
@@ -0,0 +1,81 @@
+local checkpoint = require "checkpoint"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local eio = require "neumond.eio"
+local runtime = require "neumond.runtime"
+
+local function r8()
+  return math.random(10000000,99999999)
+end
+
+local path = "/tmp/neumond-test-" .. r8() .. "-" ..r8() .. ".file"
+
+local tmp_guard <close> = setmetatable({}, {
+  __close = function() os.execute("rm -f " .. path) end,
+})
+
+runtime(function()
+  local q1 = sync.queue(0)
+  local q2 = sync.queue(0)
+  local q3 = sync.queue(1)
+  local sleeper, waker = sync.notify()
+  checkpoint(1)
+  -- Cases that can be performed immediately are chosen in order:
+  q3:push("buffered")
+  local idx, value = sync.select({"pop", q1}, {"pop", q3})
+  assert(idx == 2 and value == "buffered")
+  local idx = sync.select({"pop", q1}, {"push", q3, "x"})
+  assert(idx == 2)
+  assert(q3:pop() == "x")
+  checkpoint(2)
+  -- Only one of several pending pops is performed:
+  fiber.spawn(function()
+    q2:push("a")
+    checkpoint(4)
+    q1:push("b")
+    checkpoint(6)
+  end)
+  checkpoint(3)
+  local idx, value = sync.select({"pop", q1}, {"pop", q2})
+  assert(idx == 2 and value == "a")
+  assert(#q1 == 1)
+  checkpoint(5)
+  assert(q1:pop() == "b")
+  fiber.yield()
+  assert(#q1 == 0 and #q2 == 0)
+  -- Pending push is performed when a popper appears:
+  local popper = fiber.spawn(function()
+    return q2:pop()
+  end)
+  local idx = sync.select({"pop", q1}, {"push", q2, "c"})
+  assert(idx == 2)
+  assert(popper:await() == "c")
+  assert(#q1 == 0 and #q2 == 0)
+  checkpoint(7)
+  -- Sleepers are reset when chosen:
+  fiber.spawn(function()
+    waker()
+  end)
+  local idx = sync.select({"pop", q1}, {"sleeper", sleeper})
+  assert(idx == 2)
+  assert(sleeper.ready == false)
+  assert(#q1 == 0)
+  checkpoint(8)
+  -- File descriptors are reported when ready for reading:
+  local listener <close> = assert(eio.locallisten(path))
+  fiber.spawn(function()
+    local h <close> = assert(eio.localconnect(path))
+    assert(h:flush("data"))
+    q1:push("late")
+  end)
+  local conn <close> = assert(listener:accept())
+  local idx = sync.select(
+    {"sleeper", sleeper}, {"fd_read", conn.nbio_handle.fd}
+  )
+  assert(idx == 2)
+  assert(conn:read(4) == "data")
+  assert(q1:pop() == "late")
+  checkpoint(9)
+end)
+
+checkpoint(10)
@@ -0,0 +1,57 @@
+local checkpoint = require "checkpoint"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local runtime = require "neumond.runtime"
+
+runtime(function()
+  local sem = sync.semaphore(2)
+  checkpoint(1)
+  sem()
+  sem:acquire()
+  assert(sem.available == 0)
+  assert(sem:try_acquire() == nil)
+  -- Fiber waiting for two permits:
+  local f1 = fiber.spawn(function()
+    checkpoint(3)
+    local guard <close> = sem:acquire(2)
+    checkpoint(7)
+    assert(sem.available == 0)
+  end)
+  -- Fiber waiting for one permit (must not overtake f1):
+  local f2 = fiber.spawn(function()
+    checkpoint(4)
+    local guard <close> = sem:acquire()
+    checkpoint(8)
+  end)
+  checkpoint(2)
+  fiber.yield()
+  checkpoint(5)
+  sem:release()
+  assert(sem.available == 1)
+  fiber.yield()
+  checkpoint(6)
+  sem:release()
+  f1:await()
+  f2:await()
+  checkpoint(9)
+  assert(sem.available == 2)
+
+  -- Killing a queued waiter that waits for many permits must wake waiters
+  -- behind it:
+  local guard <close> = sem:acquire()
+  local f3 = fiber.spawn(function()
+    local guard <close> = sem:acquire(2)
+    error("unreachable")
+  end)
+  local f4 = fiber.spawn(function()
+    local guard <close> = sem:acquire()
+    checkpoint(11)
+  end)
+  fiber.yield()
+  checkpoint(10)
+  f3:kill()
+  f4:await()
+  checkpoint(12)
+end)
+
+checkpoint(13)
@@ -0,0 +1,34 @@
+local checkpoint = require "checkpoint"
+local fiber = require "neumond.fiber"
+local sync = require "neumond.sync"
+local runtime = require "neumond.runtime"
+
+runtime(function()
+  local wg = sync.waitgroup()
+  wg:wait()
+  checkpoint(1)
+  local finished = 0
+  for i = 1, 5 do
+    wg:add()
+    fiber.spawn(function()
+      for j = 1, i do
+        fiber.yield()
+      end
+      finished = finished + 1
+      wg:done()
+    end)
+  end
+  local waiter = fiber.spawn(function()
+    wg:wait()
+    checkpoint(3)
+    assert(finished == 5)
+  end)
+  wg:wait()
+  checkpoint(2)
+  assert(finished == 5)
+  waiter:await()
+  checkpoint(4)
+  assert(not pcall(wg.done, wg))
+end)
+
+checkpoint(5)
@@ -0,0 +1,47 @@
+local checkpoint = require "checkpoint"
+local wait = require "neumond.wait"
+local wait_posix_fiber = require "neumond.wait_posix_fiber"
+local runtime = require "neumond.runtime"
+
+-- Function setting the pause of the collector and returning the previous
+-- pause (nil if not supported):
+local function setpause(pause)
+  local success, previous = pcall(collectgarbage, "param", "pause", pause)
+  if success then
+    return previous
+  end
+  local success, previous = pcall(collectgarbage, "setpause", pause)
+  if success then
+    return previous
+  end
+end
+
+-- Mode and pause of the collector are restored when the event loop
+-- terminates:
+local original_pause = setpause(150)
+local custom_pause = setpause(150)
+collectgarbage("generational")
+
+runtime(function()
+  local stats = wait_posix_fiber.stats
+  checkpoint(1)
+  -- Produce garbage and wait, such that garbage is collected while idle:
+  for i = 1, 3 do
+    for j = 1, 10000 do
+      local garbage = { j }
+    end
+    wait.timeout(0.05)()
+  end
+  assert(stats.iterations > 0)
+  assert(stats.waits > 0)
+  assert(stats.gc_steps > 0)
+  assert(stats.gc_cycles > 0)
+  assert(stats.gc_seconds >= 0)
+  checkpoint(2)
+end)
+
+assert(collectgarbage("incremental") == "generational")
+if original_pause then
+  assert(setpause(original_pause) == custom_pause)
+end
+checkpoint(3)
@@ -0,0 +1,35 @@
+local checkpoint = require "checkpoint"
+local wait = require "neumond.wait"
+local runtime = require "neumond.runtime"
+local wait_posix_blocking = require "neumond.wait_posix_blocking"
+
+-- Timers may be closed before they elapsed:
+local function close_early()
+  do
+    local tmr <close> = wait.timeout(0.05)
+  end
+  do
+    local tmr <close> = wait.interval(0.05)
+  end
+  do
+    -- Interval that has elapsed once:
+    local tmr <close> = wait.interval(0.01)
+    tmr()
+  end
+  -- Closed timers do not fire later:
+  wait.timeout(0.1)()
+end
+
+runtime(function()
+  checkpoint(1)
+  close_early()
+  checkpoint(2)
+end)
+
+wait_posix_blocking.run(function()
+  checkpoint(3)
+  close_early()
+  checkpoint(4)
+end)
+
+checkpoint(5)